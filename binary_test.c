@@ -0,0 +1,158 @@
+/*
+ * Checks a running server's framing of binary requests.
+ *
+ * Each command that takes no value (NOOP, STAT, QUIT, QUITQ) is sent with a
+ * value anyway: the header of a GET request. The server must answer with one
+ * EINVAL and throw the value away, so the reply that follows is the one to
+ * the NOOP sent next, not a miss for the GET hidden in the value.
+ *
+ * Build: make binary_test
+ * Usage: binary_test [-s host] [-p port]
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "client.h"
+#include "protocol_binary.h"
+
+#define OPAQUE_REQUEST 1
+#define OPAQUE_FENCE 2
+#define OPAQUE_HIDDEN 77
+
+static const char hidden_key[] = "binary_test_hidden";
+
+static size_t make_request(char *buf, const uint8_t opcode, const uint32_t opaque,
+                           const char *key, const size_t nkey,
+                           const char *value, const size_t nvalue) {
+    protocol_binary_request_header req;
+
+    memset(&req, 0, sizeof(req));
+    req.magic = PROTOCOL_BINARY_REQ;
+    req.opcode = opcode;
+    req.keylen = htons(nkey);
+    req.bodylen = htonl(nkey + nvalue);
+    req.opaque = htonl(opaque);
+    memcpy(buf, &req, sizeof(req));
+    memcpy(buf + sizeof(req), key, nkey);
+    memcpy(buf + sizeof(req) + nkey, value, nvalue);
+    return sizeof(req) + nkey + nvalue;
+}
+
+static bool write_all(const int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(const int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Reads one response, throwing its body away. */
+static bool read_response(const int fd, protocol_binary_response_header *res) {
+    char body[4096];
+    uint32_t left;
+
+    if (!read_all(fd, (char *)res, sizeof(*res)) || res->magic != PROTOCOL_BINARY_RES)
+        return false;
+    res->status = ntohs(res->status);
+    res->bodylen = ntohl(res->bodylen);
+    res->opaque = ntohl(res->opaque);
+    for (left = res->bodylen; left > 0; ) {
+        uint32_t n = left < sizeof(body) ? left : sizeof(body);
+        if (!read_all(fd, body, n))
+            return false;
+        left -= n;
+    }
+    return true;
+}
+
+/* Sends opcode with a GET as its value, then a NOOP. */
+static bool check_value_swallowed(const int fd, const uint8_t opcode, const char *name) {
+    char hidden[sizeof(protocol_binary_request_header) + sizeof(hidden_key)];
+    char buf[3 * sizeof(hidden)];
+    protocol_binary_response_header res;
+    size_t nhidden, len;
+
+    nhidden = make_request(hidden, PROTOCOL_BINARY_CMD_GET, OPAQUE_HIDDEN,
+                           hidden_key, strlen(hidden_key), "", 0);
+    len = make_request(buf, opcode, OPAQUE_REQUEST, "", 0, hidden, nhidden);
+    len += make_request(buf + len, PROTOCOL_BINARY_CMD_NOOP, OPAQUE_FENCE,
+                        "", 0, "", 0);
+    if (!write_all(fd, buf, len)) {
+        fprintf(stderr, "%s: write failed\n", name);
+        return false;
+    }
+
+    if (!read_response(fd, &res)) {
+        fprintf(stderr, "%s: no reply\n", name);
+        return false;
+    }
+    if (res.opaque != OPAQUE_REQUEST || res.status != PROTOCOL_BINARY_RESPONSE_EINVAL) {
+        fprintf(stderr, "%s: got status 0x%02x opaque %u, expected EINVAL for the "
+                "request\n", name, res.status, res.opaque);
+        return false;
+    }
+    if (!read_response(fd, &res)) {
+        fprintf(stderr, "%s: no reply to the NOOP after it\n", name);
+        return false;
+    }
+    if (res.opaque != OPAQUE_FENCE) {
+        fprintf(stderr, "%s: got status 0x%02x opaque %u, expected the NOOP's "
+                "reply; the value was read as a request\n",
+                name, res.status, res.opaque);
+        return false;
+    }
+    printf("%s with a value: ok\n", name);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    int port = 11211;
+    mc_conn_t *c;
+    bool ok;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:h")) != -1) {
+        switch (opt) {
+        case 's':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s host] [-p port]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    c = mc_connect(host, port);
+    if (c == NULL) {
+        fprintf(stderr, "Can't connect to %s:%d\n", host, port);
+        return 2;
+    }
+    ok = check_value_swallowed(c->fd, PROTOCOL_BINARY_CMD_NOOP, "NOOP") &&
+         check_value_swallowed(c->fd, PROTOCOL_BINARY_CMD_STAT, "STAT") &&
+         check_value_swallowed(c->fd, PROTOCOL_BINARY_CMD_QUIT, "QUIT") &&
+         check_value_swallowed(c->fd, PROTOCOL_BINARY_CMD_QUITQ, "QUITQ");
+    mc_close(c);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,400 @@
+/*
+ * Text protocol client, see client.h.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "client.h"
+
+#define BUFFER_INITIAL 16384
+
+mc_conn_t *mc_connect(const char *host, const int port) {
+    struct addrinfo hints, *ai, *next;
+    char service[16];
+    mc_conn_t *c;
+    int fd = -1, flag = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &ai) != 0)
+        return NULL;
+    for (next = ai; next != NULL; next = next->ai_next) {
+        fd = socket(next->ai_family, next->ai_socktype, next->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, next->ai_addr, next->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    if (fd == -1)
+        return NULL;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    c = calloc(1, sizeof(mc_conn_t));
+    if (c == NULL ||
+        (c->wbuf = malloc(BUFFER_INITIAL)) == NULL ||
+        (c->rbuf = malloc(BUFFER_INITIAL)) == NULL) {
+        if (c != NULL)
+            free(c->wbuf);
+        free(c);
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->wsize = c->rsize = BUFFER_INITIAL;
+    return c;
+}
+
+void mc_close(mc_conn_t *c) {
+    if (c == NULL)
+        return;
+    close(c->fd);
+    free(c->wbuf);
+    free(c->rbuf);
+    free(c);
+}
+
+bool mc_key_ok(const char *key, const size_t nkey) {
+    size_t i;
+
+    if (nkey == 0 || nkey > MC_KEY_MAX_LENGTH)
+        return false;
+    for (i = 0; i < nkey; i++) {
+        if ((unsigned char)key[i] <= ' ' || key[i] == 0x7f)
+            return false;
+    }
+    return true;
+}
+
+/* Makes room for n more bytes in the write buffer. */
+static bool wbuf_reserve(mc_conn_t *c, const size_t n) {
+    size_t size = c->wsize;
+    char *buf;
+
+    while (size - c->wused < n)
+        size *= 2;
+    if (size == c->wsize)
+        return true;
+    if ((buf = realloc(c->wbuf, size)) == NULL)
+        return false;
+    c->wbuf = buf;
+    c->wsize = size;
+    return true;
+}
+
+static void wbuf_append(mc_conn_t *c, const void *data, const size_t n) {
+    memcpy(c->wbuf + c->wused, data, n);
+    c->wused += n;
+}
+
+int mc_queue_get(mc_conn_t *c, const char * const *keys, const size_t *nkeys,
+                 const int n) {
+    size_t len = 4 + 2;     /* "get" and a space per key, then \r\n */
+    int i;
+
+    if (n <= 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (!mc_key_ok(keys[i], nkeys[i]))
+            return -1;
+        len += 1 + nkeys[i];
+    }
+    if (!wbuf_reserve(c, len))
+        return -1;
+    wbuf_append(c, "get", 3);
+    for (i = 0; i < n; i++) {
+        wbuf_append(c, " ", 1);
+        wbuf_append(c, keys[i], nkeys[i]);
+    }
+    wbuf_append(c, "\r\n", 2);
+    c->pending++;
+    return 0;
+}
+
+int mc_queue_set(mc_conn_t *c, const char *key, const size_t nkey,
+                 const uint32_t flags, const int32_t exptime,
+                 const void *value, const size_t nvalue) {
+    char header[64];
+    int hlen;
+
+    if (!mc_key_ok(key, nkey))
+        return -1;
+    hlen = snprintf(header, sizeof(header), " %u %d %zu\r\n", flags, exptime, nvalue);
+    if (!wbuf_reserve(c, 3 + 1 + nkey + hlen + nvalue + 2))
+        return -1;
+    wbuf_append(c, "set ", 4);
+    wbuf_append(c, key, nkey);
+    wbuf_append(c, header, hlen);
+    wbuf_append(c, value, nvalue);
+    wbuf_append(c, "\r\n", 2);
+    c->pending++;
+    return 0;
+}
+
+int mc_queue_delete(mc_conn_t *c, const char *key, const size_t nkey) {
+    if (!mc_key_ok(key, nkey) || !wbuf_reserve(c, 7 + nkey + 2))
+        return -1;
+    wbuf_append(c, "delete ", 7);
+    wbuf_append(c, key, nkey);
+    wbuf_append(c, "\r\n", 2);
+    c->pending++;
+    return 0;
+}
+
+int mc_queue_stats(mc_conn_t *c) {
+    if (!wbuf_reserve(c, 7))
+        return -1;
+    wbuf_append(c, "stats\r\n", 7);
+    c->pending++;
+    return 0;
+}
+
+int mc_flush(mc_conn_t *c) {
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < c->wused) {
+        n = send(c->fd, c->wbuf + done, c->wused - done, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    c->wused = 0;
+    return 0;
+}
+
+/*
+ * Reads until at least n unreturned bytes are buffered. No valid reply
+ * needs more than a line and a value; asking for more fails.
+ */
+static int rbuf_fill(mc_conn_t *c, const size_t n) {
+    ssize_t got;
+
+    if (n > MC_REPLY_LINE_MAX + MC_VALUE_MAX_LENGTH + 2)
+        return -1;
+
+    if (c->rstart > 0 && c->rsize - c->rstart < n) {
+        memmove(c->rbuf, c->rbuf + c->rstart, c->rend - c->rstart);
+        c->rend -= c->rstart;
+        c->rstart = 0;
+    }
+    if (c->rsize - c->rstart < n) {
+        size_t size = c->rsize;
+        char *buf;
+
+        while (size - c->rstart < n)
+            size *= 2;
+        if ((buf = realloc(c->rbuf, size)) == NULL)
+            return -1;
+        c->rbuf = buf;
+        c->rsize = size;
+    }
+    while (c->rend - c->rstart < n) {
+        got = recv(c->fd, c->rbuf + c->rend, c->rsize - c->rend, 0);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        c->rend += got;
+    }
+    return 0;
+}
+
+/* Whether the line of n bytes at line starts with word. */
+#define line_is(line, n, word) \
+    ((n) >= sizeof(word) - 1 && memcmp((line), (word), sizeof(word) - 1) == 0)
+
+/* Parses "VALUE <key> <flags> <bytes>" into r. */
+static bool parse_value_line(const char *line, const size_t n, mc_reply_t *r) {
+    const char *p = line + 6, *end = line + n, *sp;
+    char *num_end;
+    unsigned long v;
+
+    sp = memchr(p, ' ', end - p);
+    if (sp == NULL || sp == p)
+        return false;
+    r->key = p;
+    r->nkey = sp - p;
+    v = strtoul(sp + 1, &num_end, 10);
+    if (num_end == sp + 1 || *num_end != ' ' || v > UINT32_MAX)
+        return false;
+    r->flags = v;
+    p = num_end + 1;
+    v = strtoul(p, &num_end, 10);
+    if (num_end == p || num_end != end || v > MC_VALUE_MAX_LENGTH)
+        return false;
+    r->nvalue = v;
+    return true;
+}
+
+int mc_read_reply(mc_conn_t *c, mc_reply_t *r) {
+    char *line, *eol;
+    size_t n, from = 0;
+
+    if (c->pending == 0)
+        return 0;
+
+    /* A line, searching only what arrived since the last try. */
+    for (;;) {
+        line = c->rbuf + c->rstart;
+        n = c->rend - c->rstart;
+        if ((eol = memmem(line + from, n - from, "\r\n", 2)) != NULL)
+            break;
+        from = n > 0 ? n - 1 : 0;    /* the \r may have come alone */
+        if (n >= MC_REPLY_LINE_MAX || rbuf_fill(c, n + 1) != 0)
+            return -1;
+    }
+    n = eol - line;
+
+    memset(r, 0, sizeof(*r));
+    r->line = line;
+    r->nline = n;
+    if (line_is(line, n, "VALUE ")) {
+        size_t off;
+
+        if (!parse_value_line(line, n, r))
+            return -1;
+        /* The data and its \r\n may not all be here yet. */
+        if (rbuf_fill(c, n + 2 + r->nvalue + 2) != 0)
+            return -1;
+        line = c->rbuf + c->rstart;     /* the buffer may have moved */
+        if (memcmp(line + n + 2 + r->nvalue, "\r\n", 2) != 0)
+            return -1;
+        off = r->key - r->line;
+        r->line = line;
+        r->key = line + off;
+        r->value = line + n + 2;
+        r->type = MC_REPLY_VALUE;
+        c->rstart += n + 2 + r->nvalue + 2;
+        return 1;
+    }
+
+    if (line_is(line, n, "STAT ")) {
+        const char *sp = memchr(line + 5, ' ', n - 5);
+
+        if (sp == NULL)
+            return -1;
+        r->type = MC_REPLY_STAT;
+        r->key = line + 5;
+        r->nkey = sp - r->key;
+        r->value = sp + 1;
+        r->nvalue = line + n - r->value;
+        c->rstart += n + 2;
+        return 1;
+    }
+
+    if (line_is(line, n, "END"))
+        r->type = MC_REPLY_END;
+    else if (line_is(line, n, "STORED"))
+        r->type = MC_REPLY_STORED;
+    else if (line_is(line, n, "NOT_STORED"))
+        r->type = MC_REPLY_NOT_STORED;
+    else if (line_is(line, n, "DELETED"))
+        r->type = MC_REPLY_DELETED;
+    else if (line_is(line, n, "NOT_FOUND"))
+        r->type = MC_REPLY_NOT_FOUND;
+    else if (line_is(line, n, "ERROR") || line_is(line, n, "CLIENT_ERROR") ||
+             line_is(line, n, "SERVER_ERROR"))
+        r->type = MC_REPLY_ERROR;
+    else
+        return -1;
+    c->rstart += n + 2;
+    c->pending--;
+    return 1;
+}
+
+/******************************* CONNECTION POOL ****************************/
+
+mc_pool_t *mc_pool_new(const char *host, const int port, const int size) {
+    mc_pool_t *p;
+
+    if (size <= 0)
+        return NULL;
+    p = calloc(1, sizeof(mc_pool_t));
+    if (p == NULL)
+        return NULL;
+    p->host = strdup(host);
+    p->idle = calloc(size, sizeof(mc_conn_t *));
+    if (p->host == NULL || p->idle == NULL) {
+        free(p->host);
+        free(p->idle);
+        free(p);
+        return NULL;
+    }
+    p->port = port;
+    p->size = size;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    return p;
+}
+
+/* Connections handed out and not returned are the callers' to close. */
+void mc_pool_free(mc_pool_t *p) {
+    int i;
+
+    if (p == NULL)
+        return;
+    for (i = 0; i < p->nidle; i++)
+        mc_close(p->idle[i]);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p->idle);
+    free(p->host);
+    free(p);
+}
+
+mc_conn_t *mc_pool_get(mc_pool_t *p) {
+    mc_conn_t *c;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->nidle == 0 && p->open == p->size)
+        pthread_cond_wait(&p->cond, &p->lock);
+    if (p->nidle > 0) {
+        c = p->idle[--p->nidle];
+        pthread_mutex_unlock(&p->lock);
+        return c;
+    }
+    p->open++;
+    pthread_mutex_unlock(&p->lock);
+
+    /* Connect outside the lock; others can still take idle connections. */
+    if ((c = mc_connect(p->host, p->port)) == NULL) {
+        pthread_mutex_lock(&p->lock);
+        p->open--;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return c;
+}
+
+void mc_pool_put(mc_pool_t *p, mc_conn_t *c, const bool failed) {
+    /* Replies nobody read would be taken for the next user's. */
+    if (failed || c->pending > 0 || c->wused > 0) {
+        mc_close(c);
+        c = NULL;
+    }
+    pthread_mutex_lock(&p->lock);
+    if (c != NULL)
+        p->idle[p->nidle++] = c;
+    else
+        p->open--;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
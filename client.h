@@ -0,0 +1,117 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Blocking client for the text protocol.
+ *
+ * Requests are queued on a connection and go out together with
+ * mc_flush(); replies are then read back in request order with
+ * mc_read_reply(). Queueing several requests before flushing pipelines
+ * them. A pipeline should stay within what the socket buffers hold, since
+ * nothing is read while a flush blocks. A get of several keys is sent as a
+ * single "get k1 k2 ..." line, however long; the server serves long ones
+ * as they arrive.
+ *
+ * A connection is used by one thread at a time. A pool hands connections
+ * out to threads that need one.
+ */
+
+#define MC_KEY_MAX_LENGTH 250
+
+/* Largest value the server stores, an item filling a whole slab page. A
+   reply announcing more is taken for a corrupt one. */
+#define MC_VALUE_MAX_LENGTH (1024 * 1024)
+
+/* Longest reply line other than a value's data. */
+#define MC_REPLY_LINE_MAX 1024
+
+typedef struct {
+    int fd;
+    char *wbuf;         /* queued requests */
+    size_t wsize;
+    size_t wused;
+    char *rbuf;         /* replies read but not yet returned */
+    size_t rsize;
+    size_t rstart;
+    size_t rend;
+    int pending;        /* replies still to come, the END of a get or stats
+                           counting as one */
+} mc_conn_t;
+
+enum mc_reply_type {
+    MC_REPLY_VALUE,         /* one item of a get; more follow until END */
+    MC_REPLY_END,           /* end of a get */
+    MC_REPLY_STORED,
+    MC_REPLY_NOT_STORED,
+    MC_REPLY_DELETED,
+    MC_REPLY_NOT_FOUND,
+    MC_REPLY_STAT,          /* one counter of stats; more follow until END */
+    MC_REPLY_ERROR          /* ERROR, CLIENT_ERROR or SERVER_ERROR */
+};
+
+/*
+ * Key and value point into the connection's buffer until its next read.
+ * A STAT reply has the counter's name as key and its value as value.
+ */
+typedef struct {
+    enum mc_reply_type type;
+    const char *key;
+    size_t nkey;
+    uint32_t flags;
+    const char *value;
+    size_t nvalue;
+    const char *line;       /* the whole reply line, without \r\n */
+    size_t nline;
+} mc_reply_t;
+
+// Connect to host:port over TCP; NULL on failure
+mc_conn_t *mc_connect(const char *host, const int port);
+void mc_close(mc_conn_t *c);
+
+// Whether the text protocol accepts key as a key
+bool mc_key_ok(const char *key, const size_t nkey);
+
+// Queue requests; return 0, or -1 for a bad key or out of memory
+int mc_queue_get(mc_conn_t *c, const char * const *keys, const size_t *nkeys,
+                 const int n);
+int mc_queue_set(mc_conn_t *c, const char *key, const size_t nkey,
+                 const uint32_t flags, const int32_t exptime,
+                 const void *value, const size_t nvalue);
+int mc_queue_delete(mc_conn_t *c, const char *key, const size_t nkey);
+int mc_queue_stats(mc_conn_t *c);
+
+// Send everything queued; 0, or -1 if the connection failed
+int mc_flush(mc_conn_t *c);
+
+// Read the next reply; 1 with *r filled, 0 when no reply is pending,
+// -1 if the connection failed or the reply made no sense
+int mc_read_reply(mc_conn_t *c, mc_reply_t *r);
+
+typedef struct {
+    char *host;
+    int port;
+    mc_conn_t **idle;
+    int nidle;
+    int size;
+    int open;               /* connections made so far */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} mc_pool_t;
+
+// A pool of up to size connections, opened as they are first needed
+mc_pool_t *mc_pool_new(const char *host, const int port, const int size);
+void mc_pool_free(mc_pool_t *p);
+
+// Take a connection out of the pool, waiting for one if all are in use;
+// NULL if a new connection could not be made
+mc_conn_t *mc_pool_get(mc_pool_t *p);
+
+// Give it back; a failed connection is closed and replaced on demand
+void mc_pool_put(mc_pool_t *p, mc_conn_t *c, const bool failed);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Settings and startup of the engine, shared by the server and the tools
+ * that drive the engine in their own process (engine_bench, lru_bench,
+ * replay). A program fills in settings with engine_settings_default(),
+ * changes what it wants, then calls engine_init(); the threads that keep
+ * the engine tidy are its own to start.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "simple_memcached.h"
+
+struct settings settings;
+
+/*
+ * We keep the current time of day in a global variable that's updated by the
+ * clock thread. This saves us a bunch of time() system calls (we really only
+ * need to get the time once a second, whereas there can be tens of thousands
+ * of requests a second) and allows us to use server-start-relative timestamps
+ * rather than absolute UNIX timestamps, a space savings on systems where
+ * sizeof(time_t) > sizeof(unsigned int). Programs without a clock thread
+ * set it themselves.
+ */
+volatile rel_time_t current_time;
+
+void engine_settings_default(void) {
+    settings.maxbytes = MAX_BYTES_DEFAULT;
+    settings.maxconns = MAXCONNS_DEFAULT;
+    settings.port = PORT_DEFAULT;
+    settings.inter = NULL;
+    settings.verbose = 0;
+    settings.factor = FACTOR_DEFAULT;
+    settings.hashpower_init = HASHPOWER_DEFAULT;
+    settings.preallocate = false;
+    settings.backlog = BACKLOG_DEFAULT;
+    settings.reqs_per_event = REQS_PER_EVENT_DEFAULT;
+    settings.num_threads = NUM_THREADS_DEFAULT;
+    settings.hash_algorithm = HASH_ALGORITHM_DEFAULT;
+    settings.hash_index = HASH_INDEX_DEFAULT;
+    settings.hot_lru_pct = HOT_LRU_PCT_DEFAULT;
+    settings.warm_lru_pct = WARM_LRU_PCT_DEFAULT;
+    settings.lru_policy = LRU_POLICY_DEFAULT;
+    settings.admission = ADMISSION_DEFAULT;
+    settings.slab_automove = false;
+    settings.slab_compact = false;
+    settings.slab_arena = SLAB_ARENA_MALLOC;
+    settings.numa_policy = NUMA_POLICY_NONE;
+    settings.numa_node = 0;
+    settings.trace_file = NULL;
+    settings.trace_sample = 1;
+}
+
+int engine_init(void (*phase_done)(const char *name)) {
+    if (hash_algorithm_init(settings.hash_algorithm) != 0) {
+        fprintf(stderr, "Failed to initialize hash_algorithm!\n");
+        return -1;
+    }
+    latency_init();
+
+    if (phase_done != NULL)
+        phase_done(NULL);
+    do_hash_init(settings.hashpower_init);
+    if (phase_done != NULL)
+        phase_done("hashtable");
+    slabs_init(settings.maxbytes, settings.factor, settings.preallocate);
+    item_lru_init();
+    if (phase_done != NULL)
+        phase_done("slabs");
+    /* Sketch sized for roughly as many keys as fit in memory. */
+    if (settings.admission != ADMISSION_NONE &&
+        tinylfu_init(settings.maxbytes / 128) != 0) {
+        return -1;
+    }
+    item_locks_init(settings.num_threads);
+    if (phase_done != NULL)
+        phase_done("admission");
+    return 0;
+}
@@ -0,0 +1,523 @@
+/*
+ * Microbenchmarks for the engine's building blocks, driven straight
+ * against the hashtable, slab allocator and item layer with no network.
+ *
+ *   hash_find         lookups of keys that are present, hash value given
+ *   hash_insert       inserts of new items into the filled table
+ *   slabs_alloc       slabs_alloc() and slabs_free() of one item's chunk
+ *   item_alloc_evict  do_item_alloc() into a full cache, then linking the item
+ *   item_update       do_item_update() of an item that is due for it
+ *
+ * Every parameter takes a comma-separated list, and every combination runs
+ * once per benchmark, each in its own child process since the engine keeps
+ * its state in globals. The table is filled with fill * 2^hashpower items
+ * before timing starts. Results go to stdout as CSV, one line per run, so
+ * runs of two versions can be compared line by line; cycles are TSC cycles
+ * and are reported as 0 on machines without one.
+ *
+ * Build: make engine_bench
+ * Usage: engine_bench [-b benchmarks] [-k key sizes] [-v value sizes]
+ *                     [-H hashpowers] [-f fill factors] [-t threads]
+ *                     [-n ops] [-i index] 2>/dev/null
+ *
+ * The engine's startup messages go to stderr.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "simple_memcached.h"
+
+#define MAX_LIST 16
+#define INSERT_ROUND 1024   /* items hash_insert puts in before taking them out */
+#define SLAB_ROUND 64       /* chunks slabs_alloc takes before freeing them */
+#define MIN_BYTES (4 * 1024 * 1024)
+
+enum bench_type {
+    BENCH_HASH_FIND,
+    BENCH_HASH_INSERT,
+    BENCH_SLABS_ALLOC,
+    BENCH_ITEM_ALLOC_EVICT,
+    BENCH_ITEM_UPDATE,
+    BENCH_COUNT
+};
+
+static const char *bench_names[BENCH_COUNT] = {
+    "hash_find", "hash_insert", "slabs_alloc", "item_alloc_evict", "item_update"
+};
+
+typedef struct {
+    enum bench_type bench;
+    int key_size;
+    int value_size;
+    int hashpower;
+    double fill;
+    int nthreads;
+    size_t nops;                /* per thread */
+    enum hash_index_type index;
+} bench_params_t;
+
+typedef struct {
+    pthread_t tid;
+    int id;
+    const bench_params_t *p;
+    uint32_t *draws;            /* key numbers, drawn up front */
+    item **own;                 /* hash_insert: items only this thread inserts */
+    uint64_t cycles;            /* spent in the timed operations */
+    uint64_t nsec;
+} bench_thread_t;
+
+/* Keys of the prefilled items, key_size bytes apart, and their hashes. */
+static char *keys;
+static uint32_t *hvs;
+static item **items;
+static size_t nitems;
+static unsigned int item_clsid;
+static size_t item_ntotal;
+static pthread_barrier_t barrier;
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t cycles_now(void) {
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size);
+
+    if (p == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    return p;
+}
+
+/* Key number n, padded with 'k' to exactly len bytes. */
+static void make_key(char *key, const int len, const uint64_t n) {
+    char num[24];
+    int nlen = snprintf(num, sizeof(num), "%lu", n);
+
+    memset(key, 'k', len);
+    if (nlen > len)
+        memcpy(key, num + nlen - len, len);
+    else
+        memcpy(key + len - nlen, num, nlen);
+}
+
+/* Allocates and links the item for key number n, or returns NULL. */
+static item *store_new_item(const bench_params_t *p, const uint64_t n) {
+    char key[KEY_MAX_LENGTH];
+    item *it;
+
+    make_key(key, p->key_size, n);
+    it = do_item_alloc(key, p->key_size, 0, 0, p->value_size + 2, NULL);
+    if (it == NULL)
+        return NULL;
+    memset(ITEM_data(it), 'v', p->value_size);
+    memcpy(ITEM_data(it) + p->value_size, "\r\n", 2);
+    item_lock(it->hv);
+    do_store_item(it, it->hv);
+    item_unlock(it->hv);
+    return it;
+}
+
+static void engine_start(const bench_params_t *p) {
+    /* Roughly ITEM_ntotal(), for sizing; the suffix is at most this long. */
+    size_t ntotal = sizeof(item) + p->key_size + 1 + p->value_size + 2 + 16;
+    size_t bytes;
+
+    nitems = (size_t)(p->fill * ((size_t)1 << p->hashpower));
+    if (nitems == 0)
+        nitems = 1;
+
+    /* The eviction benchmark gets memory for fewer items than it stores,
+       since chunks are larger than items; the others get room for the
+       table, what hash_insert and slabs_alloc add, and slab rounding. */
+    if (p->bench == BENCH_ITEM_ALLOC_EVICT) {
+        bytes = nitems * ntotal;
+    } else {
+        bytes = (nitems + (size_t)p->nthreads * (INSERT_ROUND + SLAB_ROUND))
+            * ntotal * 2;
+        if (bytes < MIN_BYTES)
+            bytes = MIN_BYTES;
+    }
+
+    engine_settings_default();
+    settings.maxbytes = bytes;
+    settings.hashpower_init = p->hashpower;
+    settings.num_threads = p->nthreads;
+    settings.hash_index = p->index;
+    settings.lru_policy = LRU_POLICY_SEGMENTED;
+    settings.admission = ADMISSION_NONE;
+
+    if (engine_init(NULL) != 0)
+        exit(1);
+    /* The table is not grown while we measure it: the maintenance thread is
+       never started, so a fill above the load limit makes longer chains. */
+}
+
+/* Links nitems items and records their keys. Returns false if memory ran out. */
+static bool prefill(const bench_params_t *p) {
+    size_t i;
+
+    keys = xmalloc(nitems * p->key_size);
+    hvs = xmalloc(nitems * sizeof(uint32_t));
+    items = xmalloc(nitems * sizeof(item *));
+    for (i = 0; i < nitems; i++) {
+        items[i] = store_new_item(p, i);
+        if (items[i] == NULL)
+            return false;
+        memcpy(keys + i * p->key_size, ITEM_key(items[i]), p->key_size);
+        hvs[i] = items[i]->hv;
+        if (i == 0) {
+            item_ntotal = ITEM_ntotal(items[0]);
+            item_clsid = items[0]->slabs_clsid;
+        }
+        item_remove(items[i]);  /* the table keeps it alive */
+    }
+    return true;
+}
+
+static void run_hash_find(bench_thread_t *me) {
+    const size_t klen = me->p->key_size;
+    uintptr_t found = 0;
+    size_t i;
+
+    for (i = 0; i < me->p->nops; i++) {
+        uint32_t n = me->draws[i];
+        found += (uintptr_t)hash_find(keys + n * klen, klen, hvs[n]);
+    }
+    if (found == 0)
+        fprintf(stderr, "hash_find found nothing\n");
+}
+
+/* Inserts rounds of new items, unlinking each round untimed so the table
+   stays at the requested fill. */
+static void run_hash_insert(bench_thread_t *me) {
+    size_t done = 0, i, n;
+    uint64_t t, c;
+
+    while (done < me->p->nops) {
+        n = me->p->nops - done < INSERT_ROUND ? me->p->nops - done : INSERT_ROUND;
+        t = now_nsec();
+        c = cycles_now();
+        for (i = 0; i < n; i++) {
+            item *it = me->own[i];
+            item_lock(it->hv);
+            hash_insert(it, it->hv);
+            item_unlock(it->hv);
+        }
+        me->cycles += cycles_now() - c;
+        me->nsec += now_nsec() - t;
+        for (i = 0; i < n; i++) {
+            item *it = me->own[i];
+            item_lock(it->hv);
+            hash_delete(ITEM_key(it), it->nkey, it->hv);
+            item_unlock(it->hv);
+        }
+        done += n;
+    }
+}
+
+static void run_slabs_alloc(bench_thread_t *me) {
+    void *chunks[SLAB_ROUND];
+    size_t done = 0;
+    int i;
+
+    while (done < me->p->nops) {
+        for (i = 0; i < SLAB_ROUND; i++)
+            chunks[i] = slabs_alloc(item_ntotal, item_clsid);
+        for (i = 0; i < SLAB_ROUND; i++) {
+            if (chunks[i] != NULL)
+                slabs_free(chunks[i], item_ntotal, item_clsid);
+        }
+        done += SLAB_ROUND;
+    }
+}
+
+static void run_item_alloc_evict(bench_thread_t *me) {
+    uint64_t next = nitems + (uint64_t)me->id * me->p->nops;
+    size_t i;
+
+    for (i = 0; i < me->p->nops; i++) {
+        item *it = store_new_item(me->p, next++);
+        if (it != NULL)
+            item_remove(it);
+    }
+}
+
+static void run_item_update(bench_thread_t *me) {
+    size_t i;
+
+    for (i = 0; i < me->p->nops; i++) {
+        item *it = items[me->draws[i]];
+        /* Due for an update, so it takes the LRU lock every time. */
+        it->time = 0;
+        do_item_update(it);
+    }
+}
+
+/*
+ * Threads time themselves: with fewer CPUs than threads, a clock read
+ * around the whole run would count time the threads spent waiting to be
+ * scheduled before they started.
+ */
+static void *bench_thread(void *arg) {
+    bench_thread_t *me = arg;
+    uint64_t t, c;
+
+    pthread_barrier_wait(&barrier);
+    t = now_nsec();
+    c = cycles_now();
+    switch (me->p->bench) {
+    case BENCH_HASH_FIND:
+        run_hash_find(me);
+        break;
+    case BENCH_HASH_INSERT:
+        run_hash_insert(me);
+        break;
+    case BENCH_SLABS_ALLOC:
+        run_slabs_alloc(me);
+        break;
+    case BENCH_ITEM_ALLOC_EVICT:
+        run_item_alloc_evict(me);
+        break;
+    case BENCH_ITEM_UPDATE:
+        run_item_update(me);
+        break;
+    default:
+        break;
+    }
+    if (me->p->bench != BENCH_HASH_INSERT) {
+        me->cycles = cycles_now() - c;
+        me->nsec = now_nsec() - t;
+    }
+    return NULL;
+}
+
+/* Runs one benchmark in this process and prints its CSV line. */
+static void run(const bench_params_t *p) {
+    bench_thread_t *threads = calloc(p->nthreads, sizeof(bench_thread_t));
+    uint64_t cycles = 0, ops;
+    double ops_per_sec = 0;
+    unsigned int seed;
+    size_t j;
+    int i;
+
+    engine_start(p);
+    if (!prefill(p)) {
+        fprintf(stderr, "%s: out of memory prefilling\n", bench_names[p->bench]);
+        exit(1);
+    }
+    if (p->bench == BENCH_ITEM_UPDATE)
+        current_time = ITEM_UPDATE_INTERVAL + 1;
+
+    pthread_barrier_init(&barrier, NULL, p->nthreads + 1);
+    for (i = 0; i < p->nthreads; i++) {
+        threads[i].id = i;
+        threads[i].p = p;
+        threads[i].draws = xmalloc(p->nops * sizeof(uint32_t));
+        seed = i + 1;
+        for (j = 0; j < p->nops; j++)
+            threads[i].draws[j] = rand_r(&seed) % nitems;
+        if (p->bench == BENCH_HASH_INSERT) {
+            threads[i].own = xmalloc(INSERT_ROUND * sizeof(item *));
+            for (j = 0; j < INSERT_ROUND; j++) {
+                char key[KEY_MAX_LENGTH];
+
+                make_key(key, p->key_size, nitems + (uint64_t)i * INSERT_ROUND + j);
+                threads[i].own[j] = do_item_alloc(key, p->key_size, 0, 0,
+                                                  p->value_size + 2, NULL);
+                if (threads[i].own[j] == NULL) {
+                    fprintf(stderr, "hash_insert: out of memory\n");
+                    exit(1);
+                }
+            }
+        }
+        pthread_create(&threads[i].tid, NULL, bench_thread, &threads[i]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < p->nthreads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        cycles += threads[i].cycles;
+        if (threads[i].nsec > 0)
+            ops_per_sec += (double)p->nops * 1e9 / threads[i].nsec;
+    }
+
+    ops = (uint64_t)p->nops * p->nthreads;
+    printf("%s,%d,%d,%d,%.2f,%d,%lu,%.0f,%.1f\n", bench_names[p->bench],
+           p->key_size, p->value_size, p->hashpower, p->fill, p->nthreads, ops,
+           ops_per_sec, (double)cycles / ops);
+    fflush(stdout);
+}
+
+/* Parses a comma-separated list of up to MAX_LIST numbers. */
+static int parse_list(const char *arg, double *out) {
+    char *copy = strdup(arg), *tok, *save = NULL, *end;
+    int n = 0;
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL && n < MAX_LIST;
+         tok = strtok_r(NULL, ",", &save)) {
+        out[n] = strtod(tok, &end);
+        if (end == tok || *end != '\0') {
+            n = 0;
+            break;
+        }
+        n++;
+    }
+    free(copy);
+    return n;
+}
+
+static void usage(void) {
+    printf("engine_bench\n"
+           "-b <names>    benchmarks: hash_find, hash_insert, slabs_alloc,\n"
+           "              item_alloc_evict, item_update (default: all)\n"
+           "-k <sizes>    key sizes in bytes (default: 16)\n"
+           "-v <sizes>    value sizes in bytes (default: 64)\n"
+           "-H <powers>   hashtable powers (default: 16)\n"
+           "-f <factors>  items per bucket to fill the table with (default: 1.0)\n"
+           "-t <counts>   threads (default: 1)\n"
+           "-n <num>      operations per thread (default: 1000000)\n"
+           "-i <name>     hashtable index: chained, bucketed (default: chained)\n"
+           "Lists are comma-separated; every combination is run.\n");
+}
+
+int main(int argc, char **argv) {
+    bool benches[BENCH_COUNT];
+    double key_sizes[MAX_LIST] = { 16 }, value_sizes[MAX_LIST] = { 64 };
+    double powers[MAX_LIST] = { 16 }, fills[MAX_LIST] = { 1.0 };
+    double thread_counts[MAX_LIST] = { 1 };
+    int nkey_sizes = 1, nvalue_sizes = 1, npowers = 1, nfills = 1, nthread_counts = 1;
+    enum hash_index_type index = HASH_INDEX_DEFAULT;
+    size_t nops = 1000000;
+    int b, c, k, v, h, f, t;
+
+    for (b = 0; b < BENCH_COUNT; b++)
+        benches[b] = true;
+
+    while (-1 != (c = getopt(argc, argv, "b:k:v:H:f:t:n:i:h"))) {
+        switch (c) {
+        case 'b': {
+            char *copy = strdup(optarg), *tok, *save = NULL;
+
+            for (b = 0; b < BENCH_COUNT; b++)
+                benches[b] = false;
+            for (tok = strtok_r(copy, ",", &save); tok != NULL;
+                 tok = strtok_r(NULL, ",", &save)) {
+                for (b = 0; b < BENCH_COUNT; b++) {
+                    if (strcmp(tok, bench_names[b]) == 0)
+                        break;
+                }
+                if (b == BENCH_COUNT) {
+                    usage();
+                    return 1;
+                }
+                benches[b] = true;
+            }
+            free(copy);
+            break;
+        }
+        case 'k':
+            nkey_sizes = parse_list(optarg, key_sizes);
+            break;
+        case 'v':
+            nvalue_sizes = parse_list(optarg, value_sizes);
+            break;
+        case 'H':
+            npowers = parse_list(optarg, powers);
+            break;
+        case 'f':
+            nfills = parse_list(optarg, fills);
+            break;
+        case 't':
+            nthread_counts = parse_list(optarg, thread_counts);
+            break;
+        case 'n':
+            nops = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            if (strcmp(optarg, "chained") == 0) {
+                index = HASH_INDEX_CHAINED;
+            } else if (strcmp(optarg, "bucketed") == 0) {
+                index = HASH_INDEX_BUCKETED;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (nkey_sizes == 0 || nvalue_sizes == 0 || npowers == 0 || nfills == 0 ||
+        nthread_counts == 0 || nops == 0) {
+        usage();
+        return 1;
+    }
+
+    printf("bench,key_size,value_size,hashpower,fill,threads,ops,ops_per_sec,cycles_per_op\n");
+    fflush(stdout);
+    for (b = 0; b < BENCH_COUNT; b++) {
+        if (!benches[b])
+            continue;
+        for (k = 0; k < nkey_sizes; k++)
+        for (v = 0; v < nvalue_sizes; v++)
+        for (h = 0; h < npowers; h++)
+        for (f = 0; f < nfills; f++)
+        for (t = 0; t < nthread_counts; t++) {
+            bench_params_t p = {
+                .bench = b,
+                .key_size = key_sizes[k],
+                .value_size = value_sizes[v],
+                .hashpower = powers[h],
+                .fill = fills[f],
+                .nthreads = thread_counts[t],
+                .nops = nops,
+                .index = index,
+            };
+            pid_t pid;
+            int status;
+
+            if (p.key_size < 1 || p.key_size > KEY_MAX_LENGTH || p.value_size < 0 ||
+                p.hashpower < HASHPOWER_MIN || p.hashpower > HASHPOWER_MAX || p.fill <= 0 || p.nthreads < 1) {
+                fprintf(stderr, "skipping %s: parameters out of range\n", bench_names[b]);
+                continue;
+            }
+            pid = fork();
+            if (pid == -1) {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0) {
+                run(&p);
+                _exit(0);
+            }
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fprintf(stderr, "%s run failed\n", bench_names[b]);
+        }
+    }
+    return 0;
+}
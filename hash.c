@@ -0,0 +1,301 @@
+/*
+ * Key hash functions.
+ *
+ * djb is the original byte-at-a-time hash. The others consume 8 or more
+ * bytes per step and mix every input bit into the low bits that hashmask()
+ * keeps. SipHash is keyed with random bytes at startup, so chain lengths
+ * can't be driven up by a client who picks keys that collide.
+ *
+ * The 64/128-bit results are folded to 32 bits by xoring the halves.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hash.h"
+
+hash_func hash = djb_hash;
+
+/* Key for SipHash, filled from /dev/urandom by hash_algorithm_init(). */
+static uint64_t sip_k0 = 0x0706050403020100ULL;
+static uint64_t sip_k1 = 0x0f0e0d0c0b0a0908ULL;
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t load32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Reads 0..8 trailing bytes little-endian, as the reference code does. */
+static inline uint64_t load_tail(const unsigned char *p, size_t len) {
+    uint64_t v = 0;
+    switch (len) {
+    case 8: return load64(p);
+    case 7: v ^= (uint64_t)p[6] << 48; /* fall through */
+    case 6: v ^= (uint64_t)p[5] << 40; /* fall through */
+    case 5: v ^= (uint64_t)p[4] << 32; /* fall through */
+    case 4: v ^= (uint64_t)p[3] << 24; /* fall through */
+    case 3: v ^= (uint64_t)p[2] << 16; /* fall through */
+    case 2: v ^= (uint64_t)p[1] << 8;  /* fall through */
+    case 1: v ^= (uint64_t)p[0];
+    }
+    return v;
+}
+
+uint32_t djb_hash(const void *key, size_t length) {
+    const char *p;
+    size_t i;
+    uint32_t hv = 5381;
+
+    for (i = 0, p = key; i < length; p++, i++) {
+        hv = (hv << 5) + hv + *p;
+    }
+
+    return hv;
+}
+
+/*-------------------------------- MurmurHash3 -------------------------------*/
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+uint32_t murmur3_hash(const void *key, size_t length) {
+    const unsigned char *data = key;
+    const size_t nblocks = length / 16;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0;
+    uint64_t k1, k2;
+    size_t i;
+
+    for (i = 0; i < nblocks; i++) {
+        k1 = load64(data + i * 16);
+        k2 = load64(data + i * 16 + 8);
+
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = data + nblocks * 16;
+    size_t rem = length & 15;
+
+    if (rem > 8) {
+        k2 = load_tail(tail + 8, rem - 8);
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    if (rem > 0) {
+        k1 = load_tail(tail, rem > 8 ? 8 : rem);
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= length; h2 ^= length;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+
+    return (uint32_t)(h1 ^ (h1 >> 32));
+}
+
+/*---------------------------------- xxHash64 --------------------------------*/
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = ROTL64(acc, 31);
+    acc *= XXH_P1;
+    return acc;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t xxh64(const void *key, size_t length) {
+    const unsigned char *p = key;
+    const unsigned char *end = p + length;
+    uint64_t h;
+
+    if (length >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = XXH_P1 + XXH_P2;
+        uint64_t v2 = XXH_P2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -XXH_P1;
+
+        do {
+            v1 = xxh64_round(v1, load64(p)); p += 8;
+            v2 = xxh64_round(v2, load64(p)); p += 8;
+            v3 = xxh64_round(v3, load64(p)); p += 8;
+            v4 = xxh64_round(v4, load64(p)); p += 8;
+        } while (p <= limit);
+
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = XXH_P5;
+    }
+
+    h += (uint64_t)length;
+
+    while (p + 8 <= end) {
+        h ^= xxh64_round(0, load64(p));
+        h = ROTL64(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)load32(p) * XXH_P1;
+        h = ROTL64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_P5;
+        h = ROTL64(h, 11) * XXH_P1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+uint32_t xxh64_hash(const void *key, size_t length) {
+    uint64_t h = xxh64(key, length);
+
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+/*--------------------------------- SipHash-2-4 ------------------------------*/
+
+#define SIPROUND                                            \
+    do {                                                    \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0;            \
+        v0 = ROTL64(v0, 32);                                \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;            \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;            \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2;            \
+        v2 = ROTL64(v2, 32);                                \
+    } while (0)
+
+uint32_t siphash_hash(const void *key, size_t length) {
+    const unsigned char *p = key;
+    const unsigned char *end = p + (length & ~(size_t)7);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ sip_k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ sip_k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ sip_k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ sip_k1;
+    uint64_t m, b;
+
+    for (; p != end; p += 8) {
+        m = load64(p);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    b = ((uint64_t)length) << 56;
+    b |= load_tail(p, length & 7);
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    b = v0 ^ v1 ^ v2 ^ v3;
+
+    return (uint32_t)(b ^ (b >> 32));
+}
+
+/*----------------------------------------------------------------------------*/
+
+static const char *hash_names[] = { "djb", "murmur3", "xxh64", "siphash" };
+
+const char *hash_algorithm_name(enum hashfunc_type type) {
+    return hash_names[type];
+}
+
+int hash_algorithm_parse(const char *name, enum hashfunc_type *type) {
+    int i;
+    for (i = 0; i < (int)(sizeof(hash_names) / sizeof(hash_names[0])); i++) {
+        if (strcmp(name, hash_names[i]) == 0) {
+            *type = (enum hashfunc_type)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Draws a fresh SipHash key so collisions can't be precomputed. */
+static void siphash_seed(void) {
+    uint64_t key[2];
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd == -1 || read(fd, key, sizeof(key)) != sizeof(key)) {
+        fprintf(stderr, "Failed to read /dev/urandom, using the default SipHash key\n");
+    } else {
+        sip_k0 = key[0];
+        sip_k1 = key[1];
+    }
+    if (fd != -1)
+        close(fd);
+}
+
+int hash_algorithm_init(enum hashfunc_type type) {
+    switch (type) {
+        case DJB_HASH:
+            hash = djb_hash;
+            break;
+        case MURMUR3_HASH:
+            hash = murmur3_hash;
+            break;
+        case XXH64_HASH:
+            hash = xxh64_hash;
+            break;
+        case SIPHASH:
+            siphash_seed();
+            hash = siphash_hash;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
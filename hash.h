@@ -0,0 +1,37 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Key hash functions. Every caller goes through the hash pointer below, so
+   the item wrappers, eviction and hashtable expansion always agree. */
+typedef uint32_t (*hash_func)(const void *key, size_t length);
+extern hash_func hash;
+
+enum hashfunc_type {
+    DJB_HASH = 0,   /* byte-at-a-time, the original hash */
+    MURMUR3_HASH,   /* MurmurHash3 x64_128, 16 bytes per step */
+    XXH64_HASH,     /* xxHash64, 32-byte stripes of four 8-byte lanes */
+    SIPHASH         /* SipHash-2-4 with a random per-process key */
+};
+
+/* Selects the hash used by hash(); returns 0 on success. */
+int hash_algorithm_init(enum hashfunc_type type);
+
+/* Parses an algorithm name ("djb", "murmur3", "xxh64", "siphash");
+   returns 0 on success. */
+int hash_algorithm_parse(const char *name, enum hashfunc_type *type);
+
+const char *hash_algorithm_name(enum hashfunc_type type);
+
+uint32_t djb_hash(const void *key, size_t length);
+uint32_t murmur3_hash(const void *key, size_t length);
+uint32_t xxh64_hash(const void *key, size_t length);
+uint32_t siphash_hash(const void *key, size_t length);
+
+/* The whole 64-bit xxHash64 that xxh64_hash() folds, for callers that need
+   fewer collisions than 32 bits give. */
+uint64_t xxh64(const void *key, size_t length);
+
+#endif
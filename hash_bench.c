@@ -0,0 +1,255 @@
+/*
+ * Benchmark for the key hash functions in hash.c.
+ *
+ * For every algorithm and key shape it reports hashing throughput and the
+ * chain-length distribution the keys would produce in a hashtable sized
+ * like the server's (at most 1.5 items per bucket before it expands).
+ *
+ * Build: make hash_bench
+ * Usage: hash_bench [-n keys] [-r rounds] [-p hashpower] [-k keyfile]
+ *
+ * With -k, keys are read one per line from keyfile (e.g. a sample of
+ * production keys) instead of the synthetic shapes.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hash.h"
+
+#define KEY_MAX_LENGTH 250
+#define MAX_CHAIN_BUCKET 8
+
+typedef struct {
+    const char *name;
+    const char *fmt;    /* printf format taking the key number */
+    int pad;            /* pad the key with 'x' up to this length */
+} key_shape_t;
+
+static const key_shape_t key_shapes[] = {
+    { "short",  "u:%d",                 0 },
+    { "medium", "session:%08d:profile", 32 },
+    { "long",   "app:cache:v2:user:%d:",  100 },
+    { "max",    "blob:%d:",             KEY_MAX_LENGTH },
+};
+
+static const enum hashfunc_type algorithms[] = {
+    DJB_HASH, MURMUR3_HASH, XXH64_HASH, SIPHASH
+};
+
+typedef struct {
+    char **keys;
+    size_t *lengths;
+    size_t count;
+    size_t bytes;
+} keyset_t;
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void keyset_add(keyset_t *ks, const char *key, size_t len) {
+    ks->keys[ks->count] = malloc(len);
+    if (ks->keys[ks->count] == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(ks->keys[ks->count], key, len);
+    ks->lengths[ks->count] = len;
+    ks->bytes += len;
+    ks->count++;
+}
+
+static void keyset_alloc(keyset_t *ks, size_t n) {
+    ks->keys = calloc(n, sizeof(char *));
+    ks->lengths = calloc(n, sizeof(size_t));
+    ks->count = 0;
+    ks->bytes = 0;
+    if (ks->keys == NULL || ks->lengths == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+}
+
+static void keyset_free(keyset_t *ks) {
+    size_t i;
+    for (i = 0; i < ks->count; i++)
+        free(ks->keys[i]);
+    free(ks->keys);
+    free(ks->lengths);
+}
+
+static void keyset_synthetic(keyset_t *ks, const key_shape_t *shape, size_t n) {
+    char buf[KEY_MAX_LENGTH + 1];
+    size_t i;
+    int len;
+
+    keyset_alloc(ks, n);
+    for (i = 0; i < n; i++) {
+        len = snprintf(buf, sizeof(buf), shape->fmt, (int)i);
+        while (len < shape->pad)
+            buf[len++] = 'x';
+        keyset_add(ks, buf, len);
+    }
+}
+
+static size_t keyset_file(keyset_t *ks, const char *path, size_t n) {
+    char buf[KEY_MAX_LENGTH + 2];
+    FILE *fp = fopen(path, "r");
+    size_t len;
+
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    keyset_alloc(ks, n);
+    while (ks->count < n && fgets(buf, sizeof(buf), fp) != NULL) {
+        len = strcspn(buf, "\r\n");
+        if (len == 0)
+            continue;
+        keyset_add(ks, buf, len);
+    }
+    fclose(fp);
+    return ks->count;
+}
+
+static void run(const char *shape, const keyset_t *ks, enum hashfunc_type type,
+                int rounds, int hashpower) {
+    hash_func fn;
+    uint32_t *chains;
+    uint32_t histogram[MAX_CHAIN_BUCKET + 1] = { 0 };
+    uint32_t max_chain = 0;
+    uint32_t mask;
+    uint64_t start, elapsed;
+    double probes = 0, ideal;
+    volatile uint32_t sink = 0;
+    size_t i, nbuckets;
+    int r;
+
+    hash_algorithm_init(type);
+    fn = hash;
+
+    start = now_nsec();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < ks->count; i++)
+            sink += fn(ks->keys[i], ks->lengths[i]);
+    }
+    elapsed = now_nsec() - start;
+
+    nbuckets = (size_t)1 << hashpower;
+    mask = nbuckets - 1;
+    chains = calloc(nbuckets, sizeof(uint32_t));
+    if (chains == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < ks->count; i++)
+        chains[fn(ks->keys[i], ks->lengths[i]) & mask]++;
+    for (i = 0; i < nbuckets; i++) {
+        uint32_t len = chains[i];
+        histogram[len > MAX_CHAIN_BUCKET ? MAX_CHAIN_BUCKET : len]++;
+        if (len > max_chain)
+            max_chain = len;
+        /* a successful lookup walks on average (len + 1) / 2 items */
+        probes += (double)len * (len + 1) / 2;
+    }
+    free(chains);
+
+    /* expected probes per hit for a uniformly random hash */
+    ideal = 1 + (double)ks->count / nbuckets / 2;
+    probes /= ks->count;
+
+    printf("%-7s %-8s keys=%zu avg_key=%.1f ns/key=%.2f mkeys/s=%.2f MB/s=%.1f"
+           " hashpower=%d max_chain=%u probes/hit=%.3f ideal=%.3f chains=",
+           shape, hash_algorithm_name(type), ks->count,
+           (double)ks->bytes / ks->count,
+           (double)elapsed / ((double)ks->count * rounds),
+           ((double)ks->count * rounds) / (elapsed / 1e3),
+           ((double)ks->bytes * rounds) / (elapsed / 1e3),
+           hashpower, max_chain, probes, ideal);
+    for (i = 0; i <= MAX_CHAIN_BUCKET; i++)
+        printf("%s%u", i ? "," : "", histogram[i]);
+    printf("\n");
+    (void)sink;
+}
+
+/* Smallest table the server would hold these keys in without expanding. */
+static int hashpower_for(size_t nkeys) {
+    int power = 1;
+    while (((size_t)1 << power) * 3 / 2 < nkeys)
+        power++;
+    return power;
+}
+
+static void usage(void) {
+    printf("hash_bench\n"
+           "-n <num>      number of keys per shape (default: 1000000)\n"
+           "-r <num>      timing rounds over the key set (default: 5)\n"
+           "-p <num>      hashtable power for chain lengths (default: fit keys at 1.5 load)\n"
+           "-k <file>     read keys from file, one per line\n"
+           "\n"
+           "chains= lists how many buckets hold 0,1,...,7 and 8+ items.\n");
+}
+
+int main(int argc, char **argv) {
+    size_t nkeys = 1000000;
+    int rounds = 5;
+    int hashpower = 0;
+    const char *keyfile = NULL;
+    keyset_t ks;
+    size_t s, a;
+    int c;
+
+    while (-1 != (c = getopt(argc, argv, "n:r:p:k:h"))) {
+        switch (c) {
+        case 'n':
+            nkeys = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'p':
+            hashpower = atoi(optarg);
+            break;
+        case 'k':
+            keyfile = optarg;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (nkeys == 0 || rounds <= 0 || hashpower < 0 || hashpower > 32) {
+        usage();
+        return 1;
+    }
+
+    if (keyfile != NULL) {
+        if (keyset_file(&ks, keyfile, nkeys) == 0) {
+            fprintf(stderr, "No keys in %s\n", keyfile);
+            return 1;
+        }
+        for (a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]); a++)
+            run("file", &ks, algorithms[a], rounds,
+                hashpower ? hashpower : hashpower_for(ks.count));
+        keyset_free(&ks);
+        return 0;
+    }
+
+    for (s = 0; s < sizeof(key_shapes) / sizeof(key_shapes[0]); s++) {
+        keyset_synthetic(&ks, &key_shapes[s], nkeys);
+        for (a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]); a++)
+            run(key_shapes[s].name, &ks, algorithms[a], rounds,
+                hashpower ? hashpower : hashpower_for(ks.count));
+        keyset_free(&ks);
+    }
+    return 0;
+}
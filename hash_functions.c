@@ -1,210 +1,581 @@
-#include <errno.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <assert.h>
-#include <stdint.h>
-#include <stdbool.h>
-#include "simple_memcached.h"
-#include "hash_functions.h"
-
-
-
-typedef  uint32_t  ub4;   /* unsigned 4-byte quantities */
-typedef  unsigned       char ub1;   /* unsigned 1-byte quantities */
-
-/* how many powers of 2's worth of buckets we use */
-unsigned int hashpower = HASHPOWER_DEFAULT;
-
-#define hashsize(n) ((ub4)1<<(n))
-#define hashmask(n) (hashsize(n)-1)
-
-/* Main hash table. This is where we look except during expansion. */
-static item** primary_hashtable = 0;
-
-/*
- * Previous hash table. During expansion, we look here for keys that haven't
- * been moved over to the primary yet.
- */
-static item** old_hashtable = 0;
-
-/* Number of items in the hash table. */
-static unsigned int hash_items = 0;
-
-
-/* Flag: Are we in the middle of expanding now? */
-static bool expanding = false;
-
-/*
- * During expansion we migrate values with bucket granularity; this is how
- * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
- */
-static unsigned int expand_bucket = 0;
-// Initialize the hashtable
-void do_hash_init(const int hashtable_init){
-
-	if(hashtable_init){
-		hashpower = hashtable_init;
-	}
-	primary_hashtable = calloc(hashsize(hashpower), sizeof(void *));
-    if (! primary_hashtable) {
-        fprintf(stderr, "Failed to init hashtable.\n");
-        exit(EXIT_FAILURE);
-    }
-
-    fprintf(stderr, "Successfully intialize the hashtable.\n");
-
-}
-
-
-item *hash_find(const char *key, const size_t nkey, const uint32_t hv) {
-    item *it;
-    unsigned int oldbucket;
-
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it = old_hashtable[oldbucket];
-    } else {
-        it = primary_hashtable[hv & hashmask(hashpower)];
-    }
-
-    item *ret = NULL;
-    int depth = 0;
-    while (it) {
-        if ((nkey == it->nkey) && (memcmp(key, ITEM_key(it), nkey) == 0)) {
-            ret = it;
-            break;
-        }
-        it = it->h_next;
-        ++depth;
-    }
-    return ret;
-}
-
-/* returns the address of the item pointer before the key.  if *item == 0,
-   the item wasn't found */
-
-static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
-    item **pos;
-    unsigned int oldbucket;
-
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
-    } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
-    }
-
-    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
-        pos = &(*pos)->h_next;
-    }
-    return pos;
-}
-
-
-void hash_delete(const char *key, const size_t nkey, const uint32_t hv) {
-    item **before = _hashitem_before(key, nkey, hv);
-
-
-
-    if (*before) {
-        item *nxt;
-        hash_items--;
-        /* The DTrace probe cannot be triggered as the last instruction
-         * due to possible tail-optimization by the compiler
-         */
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
-        fprintf(stderr, "The item with key %s is successfully deleted\n", key);
-        return;
-    }
-    /* Note:  we never actually get here.  the callers don't delete things
-       they can't find. */
-    assert(*before != 0);
-}
-
-/* grows the hashtable to the next power of 2. */
-static void hash_start_expand(void) {
-    old_hashtable = primary_hashtable;
-
-    primary_hashtable = calloc(hashsize(hashpower + 1), sizeof(void *));
-    if (primary_hashtable) {
-        
-        fprintf(stderr, "Hash table expansion starting\n");
-        hashpower++;
-        expanding = true;
-        expand_bucket = 0;
-
-    } else {
-        primary_hashtable = old_hashtable;
-        /* Bad news, but we can keep running. */
-    }
-}
-
-
-static void *hash_table_expand(void) {
-
-        hash_start_expand();
-        
-        int i;
-        unsigned int old_hashtable_sizes;
-
-        old_hashtable_sizes= hashsize(hashpower-1);
-
-
-        for (i = 0; i < old_hashtable_sizes  && expanding; i++) {
-            item *it, *next;
-            int bucket;
-
-            for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                next = it->h_next;
-
-                bucket = hash(ITEM_key(it), it->nkey) & hashmask(hashpower);
-                it->h_next = primary_hashtable[bucket];
-                primary_hashtable[bucket] = it;
-            }
-
-            old_hashtable[expand_bucket] = NULL;
-
-            expand_bucket++;
-            if (expand_bucket == hashsize(hashpower - 1)) {
-                expanding = false;
-                free(old_hashtable);
-                fprintf(stderr, "Hash table expansion done\n");
-            }
-        }
-    
-    return NULL;
-}
-
-
-
-/* Note: this isn't an assoc_update.  The key must not already exist to call this */
-int hash_insert(item *it, const uint32_t hv) {
-    unsigned int oldbucket;
-
-    assert(hash_find(ITEM_key(it), it->nkey, hv) == 0);
-
-
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it->h_next = old_hashtable[oldbucket];
-        old_hashtable[oldbucket] = it;
-    } else {
-        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
-        primary_hashtable[hv & hashmask(hashpower)] = it;
-    }
-
-    hash_items++;
-    if (! expanding && hash_items > (hashsize(hashpower) * 3) / 2) {
-        hash_table_expand();
-        return 2;
-    }
-
-
-    return 1;
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "simple_memcached.h"
+#include "hash_functions.h"
+
+
+
+typedef  uint32_t  ub4;   /* unsigned 4-byte quantities */
+typedef  unsigned       char ub1;   /* unsigned 1-byte quantities */
+
+/* how many powers of 2's worth of buckets we use */
+unsigned int hashpower = HASHPOWER_DEFAULT;
+
+#define hashsize(n) ((ub4)1<<(n))
+#define hashmask(n) (hashsize(n)-1)
+
+/* Main hash table. This is where we look except during expansion. */
+static item** primary_hashtable = 0;
+
+/*
+ * Previous hash table. During expansion, we look here for keys that haven't
+ * been moved over to the primary yet.
+ */
+static item** old_hashtable = 0;
+
+/*
+ * Bucketed index (settings.hash_index == HASH_INDEX_BUCKETED). Each bucket is
+ * one cache line: an 8-bit tag per slot, taken from the top of the hash value
+ * and never 0 for an occupied slot, the item pointers, and a link to an
+ * overflow bucket. A lookup compares all tags of a bucket at once and only
+ * touches the items whose tag matched; their cached hv filters again before
+ * the key compare.
+ */
+#define BUCKET_SLOTS 6
+#define BUCKET_SLOT_MASK ((1u << BUCKET_SLOTS) - 1)
+
+/* Average items per bucket at which a bucketed table is grown. */
+#define BUCKET_LOAD 3
+
+typedef struct hash_bucket {
+    uint8_t tags[8];                    /* tags[BUCKET_SLOTS..7] stay 0 */
+    item *slots[BUCKET_SLOTS];
+    struct hash_bucket *next;           /* overflow chain */
+} __attribute__((aligned(64))) hash_bucket;
+
+_Static_assert(sizeof(hash_bucket) == 64, "hash_bucket must be one cache line");
+
+static hash_bucket *primary_buckets = 0;
+static hash_bucket *old_buckets = 0;
+
+/* Overflow buckets currently allocated. */
+static unsigned int overflow_buckets = 0;
+
+/* Number of items in the hash table. */
+static unsigned int hash_items = 0;
+
+
+/* Flag: Are we in the middle of expanding now? */
+static bool expanding = false;
+
+/*
+ * During expansion we migrate values with bucket granularity; this is how
+ * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+ */
+static unsigned int expand_bucket = 0;
+
+/*
+ * Expansion runs on its own thread. hash_insert() sets started_expanding and
+ * signals maintenance_cond when the table goes over its load factor.
+ */
+static pthread_t maintenance_tid;
+static pthread_cond_t maintenance_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool started_expanding = false;
+
+/* Expansion statistics, written only by the maintenance thread. */
+static uint64_t expansions = 0;
+static uint64_t expand_last_usec = 0;
+static uint64_t expand_max_step_usec = 0;
+
+static hash_bucket *bucket_table_new(const unsigned int power) {
+    hash_bucket *table = aligned_alloc(sizeof(hash_bucket),
+                                       hashsize(power) * sizeof(hash_bucket));
+    if (table != NULL)
+        memset(table, 0, hashsize(power) * sizeof(hash_bucket));
+    return table;
+}
+
+static inline uint8_t bucket_tag(const uint32_t hv) {
+    uint8_t tag = hv >> 24;
+    return tag ? tag : 1;
+}
+
+/* Returns a bitmask of the slots in b whose tag equals tag. */
+static inline unsigned int bucket_match(const hash_bucket *b, const uint8_t tag) {
+#ifdef __SSE2__
+    __m128i tags = _mm_loadl_epi64((const __m128i *)b->tags);
+    __m128i eq = _mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag));
+    return (unsigned int)_mm_movemask_epi8(eq) & BUCKET_SLOT_MASK;
+#else
+    /* Portable fallback: find the zero bytes of tags ^ tag, then gather the
+       high bit of every byte into the low 8 bits. */
+    const uint64_t lo7 = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t v;
+
+    memcpy(&v, b->tags, sizeof(v));
+    v ^= 0x0101010101010101ULL * tag;
+    v = ~(((v & lo7) + lo7) | v | lo7);
+    return (unsigned int)(((v >> 7) * 0x0102040810204080ULL) >> 56)
+        & BUCKET_SLOT_MASK;
+#endif
+}
+
+/* The bucket chain hv currently lives in, old or new table. */
+static hash_bucket *bucket_for(const uint32_t hv) {
+    unsigned int oldbucket;
+
+    if (__atomic_load_n(&expanding, __ATOMIC_ACQUIRE) &&
+        (oldbucket = (hv & hashmask(hashpower - 1))) >=
+            __atomic_load_n(&expand_bucket, __ATOMIC_ACQUIRE))
+    {
+        return &old_buckets[oldbucket];
+    }
+    return &primary_buckets[hv & hashmask(hashpower)];
+}
+
+static item *bucket_find(const char *key, const size_t nkey, const uint32_t hv) {
+    const uint8_t tag = bucket_tag(hv);
+    hash_bucket *b;
+
+    for (b = bucket_for(hv); b != NULL; b = b->next) {
+        unsigned int match = bucket_match(b, tag);
+        while (match) {
+            item *it = b->slots[__builtin_ctz(match)];
+            if (it->hv == hv && nkey == it->nkey &&
+                memcmp(key, ITEM_key(it), nkey) == 0)
+                return it;
+            match &= match - 1;
+        }
+    }
+    return NULL;
+}
+
+/* Puts it into the first free slot of the chain starting at b. */
+static void bucket_add(hash_bucket *b, item *it, const uint8_t tag) {
+    hash_bucket *last = NULL;
+    unsigned int free_slots;
+    int slot;
+
+    for (; b != NULL; last = b, b = b->next) {
+        if ((free_slots = bucket_match(b, 0)) != 0)
+            break;
+    }
+    if (b == NULL) {
+        b = bucket_table_new(0);
+        if (b == NULL) {
+            fprintf(stderr, "Failed to allocate an overflow hash bucket.\n");
+            exit(EXIT_FAILURE);
+        }
+        last->next = b;
+        __sync_add_and_fetch(&overflow_buckets, 1);
+        free_slots = BUCKET_SLOT_MASK;
+    }
+    slot = __builtin_ctz(free_slots);
+    b->slots[slot] = it;
+    b->tags[slot] = tag;
+}
+
+static void bucket_delete(const char *key, const size_t nkey, const uint32_t hv) {
+    const uint8_t tag = bucket_tag(hv);
+    hash_bucket *b, *prev = NULL;
+
+    for (b = bucket_for(hv); b != NULL; prev = b, b = b->next) {
+        unsigned int match = bucket_match(b, tag);
+        while (match) {
+            int slot = __builtin_ctz(match);
+            item *it = b->slots[slot];
+            if (it->hv == hv && nkey == it->nkey &&
+                memcmp(key, ITEM_key(it), nkey) == 0) {
+                b->slots[slot] = NULL;
+                b->tags[slot] = 0;
+                /* Give back overflow buckets as soon as they empty out. */
+                if (prev != NULL && bucket_match(b, 0) == BUCKET_SLOT_MASK) {
+                    prev->next = b->next;
+                    free(b);
+                    __sync_sub_and_fetch(&overflow_buckets, 1);
+                }
+                return;
+            }
+            match &= match - 1;
+        }
+    }
+    /* Callers never delete things they can't find. */
+    assert(b != NULL);
+}
+
+/* Bucketed counterpart of hash_move_bucket(), same locking rules. */
+static void bucket_move(unsigned int bucket) {
+    hash_bucket *b, *next;
+
+    for (b = &old_buckets[bucket]; b != NULL; b = next) {
+        unsigned int used = ~bucket_match(b, 0) & BUCKET_SLOT_MASK;
+
+        next = b->next;
+        while (used) {
+            int slot = __builtin_ctz(used);
+            item *it = b->slots[slot];
+            bucket_add(&primary_buckets[it->hv & hashmask(hashpower)],
+                       it, b->tags[slot]);
+            used &= used - 1;
+        }
+        if (b != &old_buckets[bucket]) {
+            free(b);
+            __sync_sub_and_fetch(&overflow_buckets, 1);
+        }
+    }
+    memset(&old_buckets[bucket], 0, sizeof(hash_bucket));
+}
+
+/* Item count above which the table is grown. */
+static unsigned int hash_load_limit(void) {
+    if (settings.hash_index == HASH_INDEX_BUCKETED)
+        return hashsize(hashpower) * BUCKET_LOAD;
+    return (hashsize(hashpower) * 3) / 2;
+}
+// Initialize the hashtable
+void do_hash_init(const int hashtable_init){
+
+	if(hashtable_init){
+		hashpower = hashtable_init;
+	}
+	if (settings.hash_index == HASH_INDEX_BUCKETED) {
+		primary_buckets = bucket_table_new(hashpower);
+		if (! primary_buckets) {
+			fprintf(stderr, "Failed to init hashtable.\n");
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stderr, "Successfully intialize the hashtable.\n");
+		return;
+	}
+	primary_hashtable = calloc(hashsize(hashpower), sizeof(void *));
+    if (! primary_hashtable) {
+        fprintf(stderr, "Failed to init hashtable.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "Successfully intialize the hashtable.\n");
+
+}
+
+
+/* The chain head hv currently lives in, old or new table. */
+static item **chain_head(const uint32_t hv) {
+    unsigned int oldbucket;
+
+    if (__atomic_load_n(&expanding, __ATOMIC_ACQUIRE) &&
+        (oldbucket = (hv & hashmask(hashpower - 1))) >=
+            __atomic_load_n(&expand_bucket, __ATOMIC_ACQUIRE))
+    {
+        return &old_hashtable[oldbucket];
+    }
+    return &primary_hashtable[hv & hashmask(hashpower)];
+}
+
+item *hash_find(const char *key, const size_t nkey, const uint32_t hv) {
+    item *it;
+
+    if (settings.hash_index == HASH_INDEX_BUCKETED)
+        return bucket_find(key, nkey, hv);
+
+    it = *chain_head(hv);
+
+    item *ret = NULL;
+    int depth = 0;
+    while (it) {
+        if ((nkey == it->nkey) && (memcmp(key, ITEM_key(it), nkey) == 0)) {
+            ret = it;
+            break;
+        }
+        it = it->h_next;
+        ++depth;
+    }
+    return ret;
+}
+
+/*
+ * Only computes the bucket's address, so it needs no lock: if the table
+ * changes under us, the prefetch is merely wasted.
+ */
+void hash_prefetch_bucket(const uint32_t hv) {
+    if (settings.hash_index == HASH_INDEX_BUCKETED)
+        __builtin_prefetch(bucket_for(hv));
+    else
+        __builtin_prefetch(chain_head(hv));
+}
+
+void hash_prefetch_items(const uint32_t hv) {
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        hash_bucket *b = bucket_for(hv);
+        unsigned int match = bucket_match(b, bucket_tag(hv));
+
+        while (match) {
+            __builtin_prefetch(b->slots[__builtin_ctz(match)]);
+            match &= match - 1;
+        }
+    } else {
+        item *it = *chain_head(hv);
+
+        if (it != NULL)
+            __builtin_prefetch(it);
+    }
+}
+
+/* returns the address of the item pointer before the key.  if *item == 0,
+   the item wasn't found */
+
+static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
+    item **pos;
+    unsigned int oldbucket;
+
+    if (__atomic_load_n(&expanding, __ATOMIC_ACQUIRE) &&
+        (oldbucket = (hv & hashmask(hashpower - 1))) >=
+            __atomic_load_n(&expand_bucket, __ATOMIC_ACQUIRE))
+    {
+        pos = &old_hashtable[oldbucket];
+    } else {
+        pos = &primary_hashtable[hv & hashmask(hashpower)];
+    }
+
+    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
+        pos = &(*pos)->h_next;
+    }
+    return pos;
+}
+
+
+void hash_delete(const char *key, const size_t nkey, const uint32_t hv) {
+    item **before;
+
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        bucket_delete(key, nkey, hv);
+        __sync_sub_and_fetch(&hash_items, 1);
+        return;
+    }
+
+    before = _hashitem_before(key, nkey, hv);
+
+
+    if (*before) {
+        item *nxt;
+        __sync_sub_and_fetch(&hash_items, 1);
+        /* The DTrace probe cannot be triggered as the last instruction
+         * due to possible tail-optimization by the compiler
+         */
+        nxt = (*before)->h_next;
+        (*before)->h_next = 0;   /* probably pointless, but whatever. */
+        *before = nxt;
+        if (settings.verbose > 1)
+            fprintf(stderr, "The item with key %.*s is successfully deleted\n",
+                    (int)nkey, key);
+        return;
+    }
+    /* Note:  we never actually get here.  the callers don't delete things
+       they can't find. */
+    assert(*before != 0);
+}
+
+/*
+ * Grows the hashtable to the next power of 2. The new table is allocated
+ * before any lock is taken; swapping it in has to exclude every reader, so
+ * it happens with all item locks held, but is only a few stores.
+ */
+static void hash_start_expand(void) {
+    item **new_hashtable = NULL;
+    hash_bucket *new_buckets = NULL;
+
+    if (settings.hash_index == HASH_INDEX_BUCKETED)
+        new_buckets = bucket_table_new(hashpower + 1);
+    else
+        new_hashtable = calloc(hashsize(hashpower + 1), sizeof(void *));
+    if (new_hashtable == NULL && new_buckets == NULL) {
+        /* Bad news, but we can keep running. */
+        fprintf(stderr, "Failed to allocate a larger hash table\n");
+        return;
+    }
+
+    item_lock_all();
+    if (new_buckets != NULL) {
+        old_buckets = primary_buckets;
+        primary_buckets = new_buckets;
+    } else {
+        old_hashtable = primary_hashtable;
+        primary_hashtable = new_hashtable;
+    }
+    hashpower++;
+    __atomic_store_n(&expand_bucket, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&expanding, true, __ATOMIC_RELEASE);
+    item_unlock_all();
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "Hash table expansion starting\n");
+}
+
+static uint64_t elapsed_usec(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000
+        + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*
+ * Moves one bucket of the old table into the new one. The caller holds the
+ * item lock covering that bucket: item locks are indexed by the low bits of
+ * the hash value, and there are never more of them than old buckets, so
+ * every item in the bucket maps to the same lock. Items carry their hash
+ * value, so nothing is rehashed here.
+ */
+static void hash_move_bucket(unsigned int bucket) {
+    item *it, *next;
+    unsigned int new_bucket;
+
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        bucket_move(bucket);
+        __atomic_store_n(&expand_bucket, bucket + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    for (it = old_hashtable[bucket]; NULL != it; it = next) {
+        next = it->h_next;
+
+        new_bucket = it->hv & hashmask(hashpower);
+        it->h_next = primary_hashtable[new_bucket];
+        primary_hashtable[new_bucket] = it;
+    }
+
+    old_hashtable[bucket] = NULL;
+    __atomic_store_n(&expand_bucket, bucket + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The expansion thread. It sleeps until hash_insert() finds the table over
+ * its load factor, then migrates one bucket per item lock hold, so a request
+ * never waits behind more than a single chain being moved.
+ */
+static void *hash_maintenance_thread(void *arg) {
+    struct timespec started;
+    uint64_t setup;
+
+    pthread_mutex_lock(&maintenance_lock);
+    for (;;) {
+        while (!started_expanding)
+            pthread_cond_wait(&maintenance_cond, &maintenance_lock);
+        pthread_mutex_unlock(&maintenance_lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        setup = latency_ticks();
+        hash_start_expand();
+        /* Workers wait out the setup, all item locks held, like a step. */
+        LATENCY_RECORD(LATENCY_HASH_EXPAND, setup);
+
+        while (__atomic_load_n(&expanding, __ATOMIC_ACQUIRE)) {
+            unsigned int bucket = expand_bucket;
+            unsigned int old_size = hashsize(hashpower - 1);
+            uint64_t step_ns, step_usec;
+            void *lock;
+
+            /* Back off briefly if a worker holds the lock we need. */
+            if ((lock = item_trylock(bucket)) == NULL) {
+                usleep(10);
+                continue;
+            }
+            step_ns = latency_ticks();
+            hash_move_bucket(bucket);
+            step_ns = latency_ns(latency_ticks() - step_ns);
+            item_trylock_unlock(lock);
+            step_usec = step_ns / 1000;
+            LATENCY_ADD(LATENCY_HASH_EXPAND, step_ns);
+
+            if (step_usec > expand_max_step_usec)
+                __atomic_store_n(&expand_max_step_usec, step_usec, __ATOMIC_RELAXED);
+
+            if (bucket + 1 == old_size) {
+                __atomic_store_n(&expanding, false, __ATOMIC_RELEASE);
+                /* No reader can still be in a bucket of the old table: each
+                   bucket was emptied under the lock its readers take. */
+                free(old_hashtable);
+                old_hashtable = NULL;
+                free(old_buckets);
+                old_buckets = NULL;
+                __atomic_store_n(&expand_last_usec, elapsed_usec(&started), __ATOMIC_RELAXED);
+                __atomic_add_fetch(&expansions, 1, __ATOMIC_RELAXED);
+                if (settings.verbose > 1)
+                    fprintf(stderr, "Hash table expansion done\n");
+            }
+        }
+
+        pthread_mutex_lock(&maintenance_lock);
+        started_expanding = false;
+    }
+    pthread_mutex_unlock(&maintenance_lock);
+    return NULL;
+}
+
+int start_hash_maintenance_thread(void) {
+    int ret;
+
+    if ((ret = pthread_create(&maintenance_tid, NULL,
+                              hash_maintenance_thread, NULL)) != 0) {
+        fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+void hash_get_stats(hash_stats_t *hs) {
+    pthread_mutex_lock(&maintenance_lock);
+    hs->hashpower = hashpower;
+    hs->hash_items = __atomic_load_n(&hash_items, __ATOMIC_RELAXED);
+    hs->expanding = __atomic_load_n(&expanding, __ATOMIC_ACQUIRE);
+    hs->expand_bucket = hs->expanding ? __atomic_load_n(&expand_bucket, __ATOMIC_ACQUIRE) : 0;
+    hs->expand_buckets_total = hs->expanding ? hashsize(hashpower - 1) : 0;
+    hs->expansions = __atomic_load_n(&expansions, __ATOMIC_RELAXED);
+    hs->expand_last_usec = __atomic_load_n(&expand_last_usec, __ATOMIC_RELAXED);
+    hs->expand_max_step_usec = __atomic_load_n(&expand_max_step_usec, __ATOMIC_RELAXED);
+    hs->overflow_buckets = __atomic_load_n(&overflow_buckets, __ATOMIC_RELAXED);
+    hs->bytes = (uint64_t)hashsize(hashpower) *
+        (settings.hash_index == HASH_INDEX_BUCKETED ? sizeof(hash_bucket) : sizeof(void *));
+    if (hs->expanding)
+        hs->bytes += hs->bytes / 2;
+    hs->bytes += (uint64_t)hs->overflow_buckets * sizeof(hash_bucket);
+    pthread_mutex_unlock(&maintenance_lock);
+}
+
+
+
+/* Note: this isn't an assoc_update.  The key must not already exist to call this */
+int hash_insert(item *it, const uint32_t hv) {
+    unsigned int oldbucket;
+
+    assert(hash_find(ITEM_key(it), it->nkey, hv) == 0);
+
+    if (settings.hash_index == HASH_INDEX_BUCKETED) {
+        bucket_add(bucket_for(hv), it, bucket_tag(hv));
+    } else if (__atomic_load_n(&expanding, __ATOMIC_ACQUIRE) &&
+        (oldbucket = (hv & hashmask(hashpower - 1))) >=
+            __atomic_load_n(&expand_bucket, __ATOMIC_ACQUIRE))
+    {
+        it->h_next = old_hashtable[oldbucket];
+        old_hashtable[oldbucket] = it;
+    } else {
+        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
+        primary_hashtable[hv & hashmask(hashpower)] = it;
+    }
+
+    /* Rehashing is left to the maintenance thread; just wake it up. */
+    if (__sync_add_and_fetch(&hash_items, 1) > hash_load_limit()
+        && ! __atomic_load_n(&expanding, __ATOMIC_ACQUIRE)
+        && hashpower < HASHPOWER_MAX) {
+        pthread_mutex_lock(&maintenance_lock);
+        if (!started_expanding) {
+            started_expanding = true;
+            pthread_cond_signal(&maintenance_cond);
+        }
+        pthread_mutex_unlock(&maintenance_lock);
+        return 2;
+    }
+
+
+    return 1;
 }
\ No newline at end of file
@@ -1,14 +1,43 @@
-// Initialize the hashtable
-void do_hash_init(const int hashpower_init);
-
-// Find a item in the hashtable
-item *hash_find(const char *key, const size_t nkey, const uint32_t hv);
-
-// Add a new item in the hashtable
-int hash_insert(item *it, const uint32_t hv);
-
-// Delete an item in the hashtable
-void hash_delete(const char *key, const size_t nkey, const uint32_t hv);
-
-
-extern unsigned int hashpower;
\ No newline at end of file
+#ifndef HASH_FUNCTIONS_H
+#define HASH_FUNCTIONS_H
+
+// Initialize the hashtable
+void do_hash_init(const int hashpower_init);
+
+// Find a item in the hashtable
+item *hash_find(const char *key, const size_t nkey, const uint32_t hv);
+
+// Prefetch hints for batched lookups: first the bucket hv maps to, then,
+// once that has arrived and with item_lock(hv) held, the items it points to
+void hash_prefetch_bucket(const uint32_t hv);
+void hash_prefetch_items(const uint32_t hv);
+
+// Add a new item in the hashtable
+int hash_insert(item *it, const uint32_t hv);
+
+// Delete an item in the hashtable
+void hash_delete(const char *key, const size_t nkey, const uint32_t hv);
+
+// Start the thread that grows the hashtable in the background
+int start_hash_maintenance_thread(void);
+
+typedef struct {
+    unsigned int hashpower;
+    unsigned int hash_items;
+    bool expanding;
+    unsigned int expand_bucket;         /* old buckets migrated so far */
+    unsigned int expand_buckets_total;  /* old buckets to migrate */
+    uint64_t expansions;                /* completed expansions */
+    uint64_t expand_last_usec;          /* duration of the last expansion */
+    uint64_t expand_max_step_usec;      /* longest single item lock hold */
+    unsigned int overflow_buckets;      /* bucketed index only */
+    uint64_t bytes;                     /* memory held by the index */
+} hash_stats_t;
+
+// Snapshot the hashtable size and expansion progress
+void hash_get_stats(hash_stats_t *hs);
+
+
+extern unsigned int hashpower;
+
+#endif
@@ -1,302 +1,1045 @@
-#include <stdint.h>
-#include <stdbool.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <time.h>
-#include <assert.h>
-#include "simple_memcached.h"
-
-
-/* Forward Declarations */
-static void item_link_q(item *it);
-static void item_unlink_q(item *it);
-
-#define LARGEST_ID POWER_LARGEST
-
-
-
-
-static item *heads[LARGEST_ID];
-
-static item *tails[LARGEST_ID];
-
-static unsigned int sizes[LARGEST_ID];
-
-/**
- * Generates the variable-sized part of the header for an object.
- *
- * key     - The key
- * nkey    - The length of the key
- * flags   - key flags
- * nbytes  - Number of bytes to hold value and addition CRLF terminator
- * suffix  - Buffer for the "VALUE" line suffix (flags, size).
- * nsuffix - The length of the suffix is stored here.
- *
- * Returns the total size of the header.
- */
-static size_t item_make_header(const uint8_t nkey, const int flags, const int nbytes,
-                     char *suffix, uint8_t *nsuffix) {
-    /* suffix is defined at 40 chars elsewhere.. */
-    *nsuffix = (uint8_t) snprintf(suffix, 40, " %d %d\r\n", flags, nbytes - 2);
-    return sizeof(item) + nkey + *nsuffix + nbytes;
-}
-
-/*@null@*/
-item *do_item_alloc(char *key, const size_t nkey, const int flags,
-                    const rel_time_t exptime, const int nbytes) {
-    uint8_t nsuffix;
-    item *it = NULL;
-    char suffix[40];
-    size_t ntotal = item_make_header(nkey + 1, flags, nbytes, suffix, &nsuffix);
-
-    unsigned int id = slabs_clsid(ntotal);
-    if (id == 0)
-        return 0;
-
-    /* do a quick check if we have any expired items in the tail.. */
-    int tries = 5; 
-    int tried_alloc = 0;
-    item *search;
-
-    search = tails[id]; 
-    for (; tries > 0 && search != NULL; tries--, search=search->prev) {
-        uint32_t hv = hash(ITEM_key(search), search->nkey);
-
-        /* Expired or flushed */
-        if (search->exptime != 0 && search->exptime < current_time) {
-            it = search;
-            slabs_adjust_mem_requested(it->slabs_clsid, ITEM_ntotal(it), ntotal);
-            do_item_unlink(it, hv); 
-            /* Initialize the item block: */
-            it->slabs_clsid = 0;
-        } else if ((it = slabs_alloc(ntotal, id)) == NULL) {
-            
-            tried_alloc = 1;
-            it = search;
-            slabs_adjust_mem_requested(it->slabs_clsid, ITEM_ntotal(it), ntotal);
-            do_item_unlink(it, hv);
-            /* Initialize the item block: */
-            it->slabs_clsid = 0;
-        }
-
-        refcount_decr(&search->refcount); 
-        break;
-    }
-
-    if (!tried_alloc && (tries == 0 || search == NULL))
-        it = slabs_alloc(ntotal, id);
-
-    if (it == NULL) {
-        fprintf(stderr, "Out of memory.\n" );
-        return NULL;
-    }
-
-    assert(it->slabs_clsid == 0);
-    assert(it != heads[id]);
-
-    /* Item initialization can happen outside of the lock; the item's already
-     * been removed from the slab LRU.
-     */
-    
-    it->refcount = 1;     /* the caller will have a reference */
-    it->next = it->prev = it->h_next = 0;
-    it->slabs_clsid = id;
-
-    it->it_flags = 0;
-    it->nkey = nkey;
-    it->nbytes = nbytes; 
-    memcpy(ITEM_key(it), key, nkey);
-    it->exptime = exptime;
-    memcpy(ITEM_suffix(it), suffix, (size_t)nsuffix);
-    it->nsuffix = nsuffix;
-
-    fprintf(stderr, "Item allocation success.\n");
-    return it;
-}
-
-void item_free(item *it) {
-    size_t ntotal = ITEM_ntotal(it);
-    unsigned int clsid;
-    assert((it->it_flags & ITEM_LINKED) == 0);
-    assert(it != heads[it->slabs_clsid]);
-    assert(it != tails[it->slabs_clsid]);
-    assert(it->refcount == 0);
-
-    /* so slab size changer can tell later if item is already free or not */
-    clsid = it->slabs_clsid;
-    it->slabs_clsid = 0;
-    slabs_free(it, ntotal, clsid);
-}
-
-/**
- * Returns true if an item will fit in the cache (its size does not exceed
- * the maximum for a cache entry.)
- */
-bool item_size_ok(const size_t nkey, const int flags, const int nbytes) {
-    char prefix[40];
-    uint8_t nsuffix;
-
-    size_t ntotal = item_make_header(nkey + 1, flags, nbytes,
-                                     prefix, &nsuffix);
-    return slabs_clsid(ntotal) != 0;
-}
-
-
-static void item_link_q(item *it) { /* item is the new head */
-    item **head, **tail;
-    assert(it->slabs_clsid < LARGEST_ID);
-    assert((it->it_flags & ITEM_SLABBED) == 0);
-
-    head = &heads[it->slabs_clsid];
-    tail = &tails[it->slabs_clsid];
-    assert(it != *head);
-    assert((*head && *tail) || (*head == 0 && *tail == 0));
-
-	it->prev = 0;
-    it->next = *head;
-    if (it->next) it->next->prev = it;
-    *head = it;
-
-    if (*tail == 0) *tail = it;
-
-    sizes[it->slabs_clsid]++;
-    return;
-}
-
-
-static void item_unlink_q(item *it) {
-    item **head, **tail;
-    assert(it->slabs_clsid < LARGEST_ID);
-    head = &heads[it->slabs_clsid];
-    tail = &tails[it->slabs_clsid];
-
-
-    if (*head == it) {
-        assert(it->prev == 0);
-        *head = it->next;
-    }
-
-    if (*tail == it) {
-        assert(it->next == 0);
-        *tail = it->prev;
-    }
-    assert(it->next != it);
-    assert(it->prev != it);
-
-
-    if (it->next) it->next->prev = it->prev;
-
-    sizes[it->slabs_clsid]--;
-    return;
-}
-
-int do_item_link(item *it, const uint32_t hv) {
-    assert((it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) == 0);
-    it->it_flags |= ITEM_LINKED;
-    it->time = current_time;
-    int hash_expand;
-
-    hash_expand = hash_insert(it, hv);
-
-    item_link_q(it);
-    refcount_incr(&it->refcount);
-    return hash_expand;
-}
-
-
-void do_item_unlink(item *it, const uint32_t hv) {
-    if ((it->it_flags & ITEM_LINKED) != 0) {
-        it->it_flags &= ~ITEM_LINKED;
-
-        hash_delete(ITEM_key(it), it->nkey, hv);
-
-        item_unlink_q(it);
-        do_item_remove(it);
-    }
-}
-
-
-
-void do_item_remove(item *it) {
-    assert((it->it_flags & ITEM_SLABBED) == 0);
-    assert(it->refcount > 0);
-    if (refcount_decr(&it->refcount) == 0) {
-        item_free(it);
-    }
-}
-
-
-void do_item_update(item *it) {
-
-    if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
-        assert((it->it_flags & ITEM_SLABBED) == 0);
-        if ((it->it_flags & ITEM_LINKED) != 0) {
-            item_unlink_q(it);
-            it->time = current_time;
-            item_link_q(it);
-        }
-    }
-}
-
-
-int do_item_replace(item *it, item *new_it, const uint32_t hv) {
-    assert((it->it_flags & ITEM_SLABBED) == 0);
-    do_item_unlink(it, hv);
-    return do_item_link(new_it, hv);
-}
-
-/** wrapper around assoc_find which does the lazy expiration logic */
-
-item *do_item_get(const char *key, const size_t nkey, const uint32_t hv) {
-    //mutex_lock(&cache_lock);
-    item *it = hash_find(key, nkey, hv);
-    if (it != NULL) {
-        refcount_incr(&it->refcount);
-    }
-
-    int was_found = 0;
-
-
-    int ii;
-    if (it == NULL) {
-        fprintf(stderr, "> NOT FOUND ");
-    } else {
-        fprintf(stderr, "> FOUND KEY ");
-        was_found++;
-    }
-    for (ii = 0; ii < nkey; ++ii) {
-        fprintf(stderr, "%c", key[ii]);
-    }
-    
-
-    if (it != NULL) {
-
-        if (it->exptime != 0 && it->exptime <= current_time) { 
-            do_item_unlink(it, hv);
-            do_item_remove(it);
-            it = NULL;
-            if (was_found) {
-                fprintf(stderr, " -nuked by expire");
-            }
-        } 
-        else {
-            it->it_flags |= ITEM_FETCHED;
-        }
-    }
-
-    return it;
-}
-
-
-item *do_item_touch(const char *key, size_t nkey, uint32_t exptime,
-                    const uint32_t hv) {
-    item *it = do_item_get(key, nkey, hv);
-    if (it != NULL) {
-        it->exptime = exptime;
-    }
-    return it;
-}
-
-
-
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "simple_memcached.h"
+
+
+/* Forward Declarations */
+static void item_link_q(item *it);
+static void item_unlink_q(item *it);
+static void do_item_unlink_q(item *it);
+static void do_item_unlink_nolock(item *it, const uint32_t hv);
+
+#define LARGEST_ID POWER_LARGEST
+
+/*
+ * One lock per slab class, covering all three of its LRU segments; taken
+ * after the item lock, before slab locks.
+ */
+static pthread_mutex_t lru_locks[LARGEST_ID];
+
+
+static item *heads[LARGEST_ID][NUM_LRU_SEGMENTS];
+
+static item *tails[LARGEST_ID][NUM_LRU_SEGMENTS];
+
+static unsigned int sizes[LARGEST_ID][NUM_LRU_SEGMENTS];
+
+/*
+ * CLOCK policy: all of a class's items sit in its HOT_LRU list, treated as
+ * a ring. The hand moves from the tail towards the head and wraps; NULL
+ * means "start over at the tail". Hits only set ITEM_ACTIVE, the hand
+ * clears it and evicts the first item found without it.
+ */
+#define CLOCK_LRU HOT_LRU
+static item *clock_hands[LARGEST_ID];
+
+/*
+ * Items with an exptime also sit on a hierarchical timing wheel of their
+ * class, under the class's LRU lock, so they are reclaimed as they expire
+ * instead of when someone happens to look at them. Level 0 has a slot per
+ * second for the next 256 seconds; each level above has 64 slots, each as
+ * wide as the whole level below. When a slot of an upper level comes up,
+ * its items are spread over the levels below, so an item moves at most
+ * once per level before its level 0 slot comes up and it is unlinked.
+ * Items further out than the top level reaches wait in its last slot.
+ */
+#define WHEEL_L0_BITS 8
+#define WHEEL_LN_BITS 6
+#define WHEEL_LEVELS 4
+#define WHEEL_L0_SLOTS (1 << WHEEL_L0_BITS)
+#define WHEEL_LN_SLOTS (1 << WHEEL_LN_BITS)
+#define WHEEL_SLOTS (WHEEL_L0_SLOTS + (WHEEL_LEVELS - 1) * WHEEL_LN_SLOTS)
+
+typedef struct {
+    item *slots[WHEEL_SLOTS];
+    item *cascade[WHEEL_LEVELS];    /* upper level slots being spread out */
+    rel_time_t now;                 /* items expiring by now are unlinked */
+    unsigned int items;             /* on the wheel, cascade included */
+} expiry_wheel_t;
+
+static expiry_wheel_t wheels[LARGEST_ID];
+
+/* Most items and seconds the maintainer gets through per class and pass. */
+#define WHEEL_BATCH 500
+
+/*
+ * The LRU crawler walks each segment from the tail to the head now and then,
+ * unlinking expired items the wheel hasn't got to. It keeps its place in
+ * crawl_next[], fixed up on unlink like the CLOCK hand, so it can let go of
+ * the LRU lock after every CRAWLER_BATCH items.
+ */
+static item *crawl_next[LARGEST_ID][NUM_LRU_SEGMENTS];
+static pthread_t lru_crawler_tid;
+
+#define CRAWLER_BATCH 200
+#define CRAWLER_STEP_SLEEP 1000     /* between batches, microseconds */
+#define CRAWLER_INTERVAL 60         /* between sweeps, seconds */
+
+/* Segment moves and evictions, for "stats". Updated atomically. */
+static uint64_t moves_to_cold = 0;
+static uint64_t moves_to_warm = 0;
+static uint64_t moves_within_warm = 0;
+static uint64_t evictions = 0;
+static uint64_t clock_second_chances = 0;
+static uint64_t admission_admitted = 0;
+static uint64_t admission_rejected = 0;
+static uint64_t admission_probation = 0;
+static uint64_t expired_reclaimed = 0;
+static uint64_t expired_unfetched = 0;
+static uint64_t crawler_sweeps = 0;
+static uint64_t crawler_reclaimed = 0;
+
+/* Evictions per class, for the slab automover. Under the class's LRU lock. */
+static uint64_t class_evictions[LARGEST_ID];
+
+/* How long the LRU maintainer sleeps between passes, in microseconds. */
+#define MIN_LRU_MAINTAINER_SLEEP 1000
+#define MAX_LRU_MAINTAINER_SLEEP 100000
+
+/* Upper bound on items the maintainer moves per segment and pass. */
+#define LRU_JUGGLE_BATCH 500
+
+static pthread_t lru_maintainer_tid;
+
+/**
+ * Generates the variable-sized part of the header for an object.
+ *
+ * key     - The key
+ * nkey    - The length of the key
+ * flags   - key flags
+ * nbytes  - Number of bytes to hold value and addition CRLF terminator
+ * suffix  - Buffer for the "VALUE" line suffix (flags, size).
+ * nsuffix - The length of the suffix is stored here.
+ *
+ * Returns the total size of the header.
+ */
+static size_t item_make_header(const uint8_t nkey, const uint32_t flags, const int nbytes,
+                     char *suffix, uint8_t *nsuffix) {
+    /* suffix is defined at 40 chars elsewhere.. */
+    *nsuffix = (uint8_t) snprintf(suffix, 40, " %u %d\r\n", flags, nbytes - 2);
+    return sizeof(item) + nkey + *nsuffix + nbytes;
+}
+
+/*
+ * TinyLFU check before victim is evicted for a new item with hash value hv:
+ * the newcomer has to have been asked for more often recently. Returns
+ * false if the write should be dropped; a newcomer that loses under
+ * ADMISSION_PROBATION is admitted with *probation set.
+ */
+static bool item_admit(const uint32_t hv, const item *victim, bool *probation) {
+    if (settings.admission == ADMISSION_NONE)
+        return true;
+
+    if (tinylfu_estimate(hv) > tinylfu_estimate(victim->hv)) {
+        __sync_add_and_fetch(&admission_admitted, 1);
+        return true;
+    }
+    if (settings.admission == ADMISSION_PROBATION) {
+        __sync_add_and_fetch(&admission_probation, 1);
+        *probation = true;
+        return true;
+    }
+    __sync_add_and_fetch(&admission_rejected, 1);
+    return false;
+}
+
+/* Counts an expired item taken away before anyone asked for it again. */
+static void item_count_expired(const item *it) {
+    __sync_add_and_fetch(&expired_reclaimed, 1);
+    if ((it->it_flags & ITEM_FETCHED) == 0)
+        __sync_add_and_fetch(&expired_unfetched, 1);
+}
+
+/*
+ * Sweeps the CLOCK hand of class id: referenced items lose their bit and
+ * are passed over, the first unreferenced (or expired) one is unlinked and
+ * handed back for reuse. One lap clears every bit, so the sweep goes a lap
+ * and one item further before giving up on items that are all busy.
+ * Caller holds the class's LRU lock.
+ */
+static item *do_item_clock_evict(const unsigned int id, const size_t ntotal,
+                                  const uint32_t hv, bool *probation,
+                                  bool *rejected) {
+    item *search;
+    void *hold_lock;
+    unsigned int tries;
+
+    for (tries = sizes[id][CLOCK_LRU] + 1; tries > 0; tries--) {
+        search = clock_hands[id] ? clock_hands[id] : tails[id][CLOCK_LRU];
+        if (search == NULL)
+            return NULL;
+        clock_hands[id] = search->prev;
+
+        if ((hold_lock = item_trylock(search->hv)) == NULL)
+            continue;
+        if (refcount_incr(&search->refcount) != 2) {
+            refcount_decr(&search->refcount);
+            item_trylock_unlock(hold_lock);
+            continue;
+        }
+
+        if (search->exptime == 0 || search->exptime >= current_time) {
+            if ((search->it_flags & ITEM_ACTIVE) != 0) {
+                search->it_flags &= ~ITEM_ACTIVE;
+                refcount_decr(&search->refcount);
+                item_trylock_unlock(hold_lock);
+                __sync_add_and_fetch(&clock_second_chances, 1);
+                continue;
+            }
+            if (!item_admit(hv, search, probation)) {
+                refcount_decr(&search->refcount);
+                item_trylock_unlock(hold_lock);
+                *rejected = true;
+                return NULL;
+            }
+            __sync_add_and_fetch(&evictions, 1);
+            class_evictions[id]++;
+        } else {
+            item_count_expired(search);
+        }
+
+        slabs_adjust_mem_requested(search->slabs_clsid, ITEM_ntotal(search), ntotal);
+        do_item_unlink_nolock(search, search->hv);
+        /* Initialize the item block; our reference becomes the caller's. */
+        search->slabs_clsid = 0;
+        item_trylock_unlock(hold_lock);
+        return search;
+    }
+    return NULL;
+}
+
+/*
+ * Segmented policy: reuses an expired tail item, else takes fresh memory,
+ * else evicts. Caller holds the class's LRU lock.
+ */
+static item *do_item_lru_alloc(const unsigned int id, const size_t ntotal,
+                               const uint32_t hv, bool *probation,
+                               bool *rejected) {
+    item *it = NULL;
+
+    /* do a quick check if we have any expired items in the tail.. */
+    int tries = 5; 
+    int tried_alloc = 0;
+    item *search;
+    void *hold_lock = NULL;
+    int seg;
+
+    /* Evict from COLD; the maintainer keeps it stocked. Fall back to the
+       other segments while it is empty. */
+    if (sizes[id][COLD_LRU] > 0)
+        seg = COLD_LRU;
+    else if (sizes[id][HOT_LRU] > 0)
+        seg = HOT_LRU;
+    else
+        seg = WARM_LRU;
+    search = tails[id][seg];
+    for (; tries > 0 && search != NULL; tries--, search=search->prev) {
+        uint32_t search_hv = search->hv;
+
+        /* Attempt to hash item lock the "search" item. If locked, no
+         * other callers can incr the refcount
+         */
+        if ((hold_lock = item_trylock(search_hv)) == NULL)
+            continue;
+
+        /* Someone else holds a reference; we can't reuse this one. */
+        if (refcount_incr(&search->refcount) != 2) {
+            refcount_decr(&search->refcount);
+            item_trylock_unlock(hold_lock);
+            continue;
+        }
+
+        /* Expired or flushed */
+        if (search->exptime != 0 && search->exptime < current_time) {
+            item_count_expired(search);
+            it = search;
+            slabs_adjust_mem_requested(it->slabs_clsid, ITEM_ntotal(it), ntotal);
+            do_item_unlink_nolock(it, search_hv); 
+            /* Initialize the item block: */
+            it->slabs_clsid = 0;
+        } else if ((it = slabs_alloc(ntotal, id)) == NULL) {
+            
+            tried_alloc = 1;
+            if (!item_admit(hv, search, probation)) {
+                /* Keep the victim, drop the write. */
+                *rejected = true;
+            } else {
+                __sync_add_and_fetch(&evictions, 1);
+                class_evictions[id]++;
+                it = search;
+                slabs_adjust_mem_requested(it->slabs_clsid, ITEM_ntotal(it), ntotal);
+                do_item_unlink_nolock(it, search_hv);
+                /* Initialize the item block: */
+                it->slabs_clsid = 0;
+            }
+        }
+
+        /* A reused item keeps our reference for the caller. */
+        if (it != search)
+            refcount_decr(&search->refcount);
+        item_trylock_unlock(hold_lock);
+        break;
+    }
+
+    if (!tried_alloc && (tries == 0 || search == NULL))
+        it = slabs_alloc(ntotal, id);
+
+    assert(it == NULL || it != heads[id][seg]);
+    return it;
+}
+
+/*@null@*/
+item *do_item_alloc(char *key, const size_t nkey, const uint32_t flags,
+                    const rel_time_t exptime, const int nbytes,
+                    bool *rejected) {
+    uint8_t nsuffix;
+    item *it = NULL;
+    char suffix[40];
+    size_t ntotal = item_make_header(nkey + 1, flags, nbytes, suffix, &nsuffix);
+    uint32_t hv = hash(key, nkey);
+    bool probation = false;
+    bool dropped = false;
+    uint64_t start, evicted;
+
+    unsigned int id = slabs_clsid(ntotal);
+    if (id == 0)
+        return 0;
+
+    start = latency_ticks();
+    pthread_mutex_lock(&lru_locks[id]);
+    evicted = class_evictions[id];
+    if (settings.lru_policy == LRU_POLICY_CLOCK) {
+        /* Free memory first: sweeping would age items for nothing. */
+        if ((it = slabs_alloc(ntotal, id)) == NULL)
+            it = do_item_clock_evict(id, ntotal, hv, &probation, &dropped);
+    } else {
+        it = do_item_lru_alloc(id, ntotal, hv, &probation, &dropped);
+    }
+    evicted = class_evictions[id] - evicted;
+    pthread_mutex_unlock(&lru_locks[id]);
+    if (evicted != 0)
+        LATENCY_RECORD(LATENCY_EVICTION, start);
+
+    if (rejected != NULL)
+        *rejected = dropped;
+
+    if (it == NULL) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Out of memory.\n" );
+        return NULL;
+    }
+
+    assert(it->slabs_clsid == 0);
+
+    /* Item initialization can happen outside of the lock; the item's already
+     * been removed from the slab LRU. The caller's reference was taken under
+     * it, so the slab rebalancer sees the chunk as busy.
+     */
+    assert(it->refcount == 1);
+    it->next = it->prev = it->h_next = it->e_next = 0;
+    it->e_pprev = NULL;
+    it->slabs_clsid = id;
+
+    it->it_flags = probation ? ITEM_PROBATION : 0;
+    it->nkey = nkey;
+    it->nbytes = nbytes; 
+    it->hv = hv;
+    memcpy(ITEM_key(it), key, nkey);
+    it->exptime = exptime;
+    memcpy(ITEM_suffix(it), suffix, (size_t)nsuffix);
+    it->nsuffix = nsuffix;
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "Item allocation success.\n");
+    return it;
+}
+
+void item_free(item *it) {
+    size_t ntotal = ITEM_ntotal(it);
+    unsigned int clsid;
+    assert((it->it_flags & ITEM_LINKED) == 0);
+    assert(it != heads[it->slabs_clsid][it->lru_seg]);
+    assert(it != tails[it->slabs_clsid][it->lru_seg]);
+    assert(it->refcount == 0);
+
+    /* so slab size changer can tell later if item is already free or not */
+    clsid = it->slabs_clsid;
+    it->slabs_clsid = 0;
+    slabs_free(it, ntotal, clsid);
+}
+
+/**
+ * Returns true if an item will fit in the cache (its size does not exceed
+ * the maximum for a cache entry.)
+ */
+bool item_size_ok(const size_t nkey, const uint32_t flags, const int nbytes) {
+    char prefix[40];
+    uint8_t nsuffix;
+
+    size_t ntotal = item_make_header(nkey + 1, flags, nbytes,
+                                     prefix, &nsuffix);
+    return slabs_clsid(ntotal) != 0;
+}
+
+
+/*
+ * Links it at the head of its class's it->lru_seg segment, or behind the
+ * CLOCK hand while one is sweeping.
+ */
+static void do_item_link_q(item *it) {
+    item **head, **tail;
+    assert(it->slabs_clsid < LARGEST_ID);
+    assert(it->lru_seg < NUM_LRU_SEGMENTS);
+    assert((it->it_flags & ITEM_SLABBED) == 0);
+
+    head = &heads[it->slabs_clsid][it->lru_seg];
+    tail = &tails[it->slabs_clsid][it->lru_seg];
+    assert(it != *head);
+    assert((*head && *tail) || (*head == 0 && *tail == 0));
+
+    if (settings.lru_policy == LRU_POLICY_CLOCK &&
+        clock_hands[it->slabs_clsid] != NULL) {
+        /* Just behind the hand, so it gets a full turn before its first
+           inspection. */
+        item *hand = clock_hands[it->slabs_clsid];
+        it->prev = hand;
+        it->next = hand->next;
+        if (it->next) it->next->prev = it;
+        else *tail = it;
+        hand->next = it;
+    } else {
+        it->prev = 0;
+        it->next = *head;
+        if (it->next) it->next->prev = it;
+        *head = it;
+
+        if (*tail == 0) *tail = it;
+    }
+
+    sizes[it->slabs_clsid][it->lru_seg]++;
+    return;
+}
+
+
+/* Chains it into the wheel slot at *slot. */
+static void wheel_link_at(item *it, item **slot) {
+    it->e_next = *slot;
+    if (it->e_next) it->e_next->e_pprev = &it->e_next;
+    *slot = it;
+    it->e_pprev = slot;
+    wheels[it->slabs_clsid].items++;
+}
+
+/*
+ * Puts an item with an exptime on its class's wheel, in the slot that comes
+ * up at its exptime or, further out, the upper level slot whose range holds
+ * it. An item already due goes where the wheel is now. Caller holds the
+ * class's LRU lock.
+ */
+static void do_item_wheel_link(item *it) {
+    expiry_wheel_t *w = &wheels[it->slabs_clsid];
+    rel_time_t exptime = it->exptime;
+    unsigned int level, shift = WHEEL_L0_BITS, base = WHEEL_L0_SLOTS;
+
+    if (exptime == 0)
+        return;
+    if (exptime <= w->now) {
+        wheel_link_at(it, &w->slots[w->now & (WHEEL_L0_SLOTS - 1)]);
+        return;
+    }
+    if (exptime - w->now < WHEEL_L0_SLOTS) {
+        wheel_link_at(it, &w->slots[exptime & (WHEEL_L0_SLOTS - 1)]);
+        return;
+    }
+    for (level = 1; level < WHEEL_LEVELS - 1; level++) {
+        if (exptime - w->now < 1u << (shift + WHEEL_LN_BITS))
+            break;
+        shift += WHEEL_LN_BITS;
+        base += WHEEL_LN_SLOTS;
+    }
+    if (exptime - w->now >= 1u << (shift + WHEEL_LN_BITS))
+        exptime = w->now + (1u << (shift + WHEEL_LN_BITS)) - 1;
+    wheel_link_at(it, &w->slots[base + ((exptime >> shift) & (WHEEL_LN_SLOTS - 1))]);
+}
+
+static void do_item_wheel_unlink(item *it) {
+    if (it->e_pprev == NULL)
+        return;
+    *it->e_pprev = it->e_next;
+    if (it->e_next) it->e_next->e_pprev = it->e_pprev;
+    it->e_pprev = NULL;
+    wheels[it->slabs_clsid].items--;
+}
+
+static void item_link_q(item *it) {
+    pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
+    do_item_link_q(it);
+    do_item_wheel_link(it);
+    pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
+}
+
+static void do_item_unlink_q(item *it) {
+    item **head, **tail;
+    assert(it->slabs_clsid < LARGEST_ID);
+    head = &heads[it->slabs_clsid][it->lru_seg];
+    tail = &tails[it->slabs_clsid][it->lru_seg];
+
+
+    if (*head == it) {
+        assert(it->prev == 0);
+        *head = it->next;
+    }
+
+    if (*tail == it) {
+        assert(it->next == 0);
+        *tail = it->prev;
+    }
+    assert(it->next != it);
+    assert(it->prev != it);
+
+    if (clock_hands[it->slabs_clsid] == it)
+        clock_hands[it->slabs_clsid] = it->prev;
+    if (crawl_next[it->slabs_clsid][it->lru_seg] == it)
+        crawl_next[it->slabs_clsid][it->lru_seg] = it->prev;
+
+
+    if (it->next) it->next->prev = it->prev;
+    if (it->prev) it->prev->next = it->next;
+
+    sizes[it->slabs_clsid][it->lru_seg]--;
+    return;
+}
+
+static void item_unlink_q(item *it) {
+    pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
+    do_item_unlink_q(it);
+    do_item_wheel_unlink(it);
+    pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
+}
+
+int do_item_link(item *it, const uint32_t hv) {
+    assert((it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) == 0);
+    it->it_flags |= ITEM_LINKED;
+    it->time = current_time;
+    it->lru_seg = HOT_LRU;
+    /* CLOCK keeps one list, where a new item starts unreferenced anyway. */
+    if ((it->it_flags & ITEM_PROBATION) != 0 &&
+        settings.lru_policy == LRU_POLICY_SEGMENTED)
+        it->lru_seg = COLD_LRU;
+    it->it_flags &= ~ITEM_PROBATION;
+    int hash_expand;
+
+    hash_expand = hash_insert(it, hv);
+
+    item_link_q(it);
+    STATS_ADD(current_bytes, ITEM_ntotal(it));
+    refcount_incr(&it->refcount);
+    return hash_expand;
+}
+
+
+void do_item_unlink(item *it, const uint32_t hv) {
+    if ((it->it_flags & ITEM_LINKED) != 0) {
+        it->it_flags &= ~ITEM_LINKED;
+
+        hash_delete(ITEM_key(it), it->nkey, hv);
+
+        item_unlink_q(it);
+        STATS_ADD(current_bytes, -(int64_t)ITEM_ntotal(it));
+        do_item_remove(it);
+    }
+}
+
+/* Same as do_item_unlink(), for callers already holding the LRU lock. */
+static void do_item_unlink_nolock(item *it, const uint32_t hv) {
+    if ((it->it_flags & ITEM_LINKED) != 0) {
+        it->it_flags &= ~ITEM_LINKED;
+
+        hash_delete(ITEM_key(it), it->nkey, hv);
+
+        do_item_unlink_q(it);
+        do_item_wheel_unlink(it);
+        STATS_ADD(current_bytes, -(int64_t)ITEM_ntotal(it));
+        do_item_remove(it);
+    }
+}
+
+
+
+void do_item_remove(item *it) {
+    assert((it->it_flags & ITEM_SLABBED) == 0);
+    assert(it->refcount > 0);
+    if (refcount_decr(&it->refcount) == 0) {
+        item_free(it);
+    }
+}
+
+
+/*
+ * Moves it to the head of segment seg. Caller holds the item lock and the
+ * class's LRU lock.
+ */
+static void do_item_move_q(item *it, const int seg) {
+    do_item_unlink_q(it);
+    it->lru_seg = seg;
+    do_item_link_q(it);
+}
+
+/*
+ * Segments don't reorder on hits; do_item_get() flags the item and the
+ * maintainer acts on the flag. Only the access time is refreshed here.
+ */
+void do_item_update(item *it) {
+
+    if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
+        assert((it->it_flags & ITEM_SLABBED) == 0);
+        pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
+        if ((it->it_flags & ITEM_LINKED) != 0) {
+            it->time = current_time;
+        }
+        pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
+    }
+}
+
+/*
+ * A COLD item hit again is about to be evicted, so it can't wait for the
+ * maintainer: move it to WARM right away. Caller holds the item lock.
+ */
+static void do_item_bump(item *it) {
+    pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
+    if ((it->it_flags & ITEM_LINKED) != 0 && it->lru_seg == COLD_LRU) {
+        it->it_flags &= ~ITEM_ACTIVE;
+        do_item_move_q(it, WARM_LRU);
+        __sync_add_and_fetch(&moves_to_warm, 1);
+    }
+    pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
+}
+
+
+int do_item_replace(item *it, item *new_it, const uint32_t hv) {
+    assert((it->it_flags & ITEM_SLABBED) == 0);
+    do_item_unlink(it, hv);
+    return do_item_link(new_it, hv);
+}
+
+/*
+ * Stores an item in the cache, replacing any existing item with the same
+ * key. Returns the do_item_link() result for the new item.
+ */
+int do_store_item(item *it, const uint32_t hv) {
+    item *old_it = do_item_get(ITEM_key(it), it->nkey, hv);
+    int ret;
+
+    if (old_it != NULL) {
+        ret = do_item_replace(old_it, it, hv);
+        do_item_remove(old_it);         /* release our reference */
+    } else {
+        ret = do_item_link(it, hv);
+    }
+
+    return ret;
+}
+
+/** wrapper around assoc_find which does the lazy expiration logic */
+
+item *do_item_get(const char *key, const size_t nkey, const uint32_t hv) {
+    //mutex_lock(&cache_lock);
+    item *it = hash_find(key, nkey, hv);
+    if (it != NULL) {
+        refcount_incr(&it->refcount);
+    }
+
+    int was_found = 0;
+
+
+    int ii;
+    if (it != NULL) {
+        was_found++;
+    }
+    if (settings.verbose > 1) {
+        fprintf(stderr, it == NULL ? "> NOT FOUND " : "> FOUND KEY ");
+        for (ii = 0; ii < nkey; ++ii) {
+            fprintf(stderr, "%c", key[ii]);
+        }
+    }
+    
+
+    if (it != NULL) {
+
+        if (it->exptime != 0 && it->exptime <= current_time) { 
+            do_item_unlink(it, hv);
+            do_item_remove(it);
+            it = NULL;
+            if (was_found && settings.verbose > 1) {
+                fprintf(stderr, " -nuked by expire");
+            }
+        } 
+        else if (settings.lru_policy == LRU_POLICY_CLOCK) {
+            /* Test first: an already referenced item isn't written to. */
+            if ((it->it_flags & (ITEM_FETCHED|ITEM_ACTIVE)) != (ITEM_FETCHED|ITEM_ACTIVE))
+                it->it_flags |= ITEM_FETCHED | ITEM_ACTIVE;
+        } else if ((it->it_flags & ITEM_FETCHED) == 0) {
+            it->it_flags |= ITEM_FETCHED;
+        } else {
+            it->it_flags |= ITEM_ACTIVE;
+            if (it->lru_seg == COLD_LRU)
+                do_item_bump(it);
+        }
+    }
+
+    if (settings.verbose > 1) {
+        fprintf(stderr, "\n");
+    }
+
+    return it;
+}
+
+
+item *do_item_touch(const char *key, size_t nkey, uint32_t exptime,
+                    const uint32_t hv) {
+    item *it = do_item_get(key, nkey, hv);
+    if (it != NULL) {
+        /* Off the wheel and back on, at the new exptime. */
+        pthread_mutex_lock(&lru_locks[it->slabs_clsid]);
+        do_item_wheel_unlink(it);
+        it->exptime = exptime;
+        if ((it->it_flags & ITEM_LINKED) != 0)
+            do_item_wheel_link(it);
+        pthread_mutex_unlock(&lru_locks[it->slabs_clsid]);
+    }
+    return it;
+}
+
+/*
+ * Takes a linked item out of its chunk for the slab rebalancer, which holds
+ * the item lock, the class's LRU lock and slabs lock, and a reference of its
+ * own. With new_it, a free chunk of the same class, the item is copied there
+ * and the copy takes its place in the hashtable and the LRU; without, it is
+ * evicted. Either way the old chunk is left unlinked with only the caller's
+ * reference.
+ */
+void do_item_evacuate(item *it, item *new_it) {
+    unsigned int id = it->slabs_clsid;
+
+    assert((it->it_flags & ITEM_LINKED) != 0);
+    if (new_it == NULL) {
+        do_item_unlink_nolock(it, it->hv);
+        return;
+    }
+
+    memcpy(new_it, it, ITEM_ntotal(it));
+    new_it->refcount = 1;       /* the hashtable's reference */
+    hash_delete(ITEM_key(it), it->nkey, it->hv);
+    hash_insert(new_it, new_it->hv);
+
+    if (new_it->prev) new_it->prev->next = new_it;
+    else heads[id][it->lru_seg] = new_it;
+    if (new_it->next) new_it->next->prev = new_it;
+    else tails[id][it->lru_seg] = new_it;
+    if (clock_hands[id] == it)
+        clock_hands[id] = new_it;
+    if (crawl_next[id][it->lru_seg] == it)
+        crawl_next[id][it->lru_seg] = new_it;
+    if (new_it->e_pprev != NULL) {
+        *new_it->e_pprev = new_it;
+        if (new_it->e_next) new_it->e_next->e_pprev = &new_it->e_next;
+        it->e_pprev = NULL;
+    }
+
+    it->it_flags &= ~ITEM_LINKED;
+    refcount_decr(&it->refcount);
+}
+
+void item_lru_lock(const unsigned int id) {
+    pthread_mutex_lock(&lru_locks[id]);
+}
+
+void item_lru_unlock(const unsigned int id) {
+    pthread_mutex_unlock(&lru_locks[id]);
+}
+
+/* Evictions from class id so far. Caller holds the class's LRU lock. */
+uint64_t do_item_lru_evictions(const unsigned int id) {
+    return class_evictions[id];
+}
+
+void item_lru_init(void) {
+    int i;
+    for (i = 0; i < LARGEST_ID; i++) {
+        pthread_mutex_init(&lru_locks[i], NULL);
+    }
+}
+
+/*
+ * Moves one item off the tail of segment seg of class id: active items get
+ * another round in WARM, the rest go to COLD. Items whose lock is busy are
+ * skipped, as in do_item_alloc(). Returns 1 if an item was moved. Caller
+ * holds the class's LRU lock.
+ */
+static int lru_pull_tail(const int id, const int seg) {
+    item *search = tails[id][seg];
+    void *hold_lock;
+    int tries;
+
+    for (tries = 5; tries > 0 && search != NULL; tries--, search = search->prev) {
+        if ((hold_lock = item_trylock(search->hv)) == NULL)
+            continue;
+
+        if ((search->it_flags & ITEM_ACTIVE) != 0) {
+            search->it_flags &= ~ITEM_ACTIVE;
+            do_item_move_q(search, WARM_LRU);
+            if (seg == WARM_LRU)
+                __sync_add_and_fetch(&moves_within_warm, 1);
+            else
+                __sync_add_and_fetch(&moves_to_warm, 1);
+        } else {
+            do_item_move_q(search, COLD_LRU);
+            __sync_add_and_fetch(&moves_to_cold, 1);
+        }
+        item_trylock_unlock(hold_lock);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Trims the HOT and WARM segments of class id back to their share of the
+ * class. Returns the number of items moved.
+ */
+static int lru_maintainer_juggle(const int id) {
+    unsigned int total, hot_limit, warm_limit;
+    int moved = 0;
+    int i;
+
+    pthread_mutex_lock(&lru_locks[id]);
+    total = sizes[id][HOT_LRU] + sizes[id][WARM_LRU] + sizes[id][COLD_LRU];
+    hot_limit = (uint64_t)total * settings.hot_lru_pct / 100;
+    warm_limit = (uint64_t)total * settings.warm_lru_pct / 100;
+
+    for (i = 0; i < LRU_JUGGLE_BATCH && sizes[id][HOT_LRU] > hot_limit; i++) {
+        if (!lru_pull_tail(id, HOT_LRU))
+            break;
+        moved++;
+    }
+    /* Bounded separately: an all-active WARM just rotates. */
+    for (i = 0; i < LRU_JUGGLE_BATCH && sizes[id][WARM_LRU] > warm_limit; i++) {
+        if (!lru_pull_tail(id, WARM_LRU))
+            break;
+        moved++;
+    }
+    pthread_mutex_unlock(&lru_locks[id]);
+    return moved;
+}
+
+/*
+ * Unlinks an expired item the wheel came to. Returns false, leaving it be,
+ * if its item lock is busy. Caller holds the class's LRU lock.
+ */
+static bool do_item_expire(item *it) {
+    void *hold_lock;
+
+    if ((hold_lock = item_trylock(it->hv)) == NULL)
+        return false;
+    item_count_expired(it);
+    do_item_unlink_nolock(it, it->hv);
+    item_trylock_unlock(hold_lock);
+    return true;
+}
+
+/*
+ * Turns the wheel of class id towards current_time: spreads out the upper
+ * level slots that come up and unlinks what expires, one second at a time.
+ * Stops after WHEEL_BATCH items or seconds and carries on from there next
+ * time. Returns the number of items moved or unlinked.
+ */
+static int wheel_turn(const int id) {
+    expiry_wheel_t *w = &wheels[id];
+    rel_time_t target = current_time;
+    unsigned int level, shift, slot;
+    int budget = WHEEL_BATCH, done = 0;
+    item *it, **head;
+
+    pthread_mutex_lock(&lru_locks[id]);
+    for (;;) {
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            while ((it = w->cascade[level]) != NULL && budget > 0) {
+                do_item_wheel_unlink(it);
+                do_item_wheel_link(it);
+                budget--;
+                done++;
+            }
+        }
+        slot = w->now & (WHEEL_L0_SLOTS - 1);
+        while ((it = w->slots[slot]) != NULL && budget > 0) {
+            budget--;
+            if (do_item_expire(it)) {
+                done++;
+                continue;
+            }
+            /* Busy: try again next second. */
+            do_item_wheel_unlink(it);
+            wheel_link_at(it, &w->slots[(slot + 1) & (WHEEL_L0_SLOTS - 1)]);
+        }
+        if (budget <= 0 || (int32_t)(target - w->now) <= 0)
+            break;
+        if (w->items == 0) {
+            w->now = target;
+            break;
+        }
+
+        w->now++;
+        budget--;
+        /* The slot of each level the one below just wrapped around into. */
+        shift = WHEEL_L0_BITS;
+        slot = WHEEL_L0_SLOTS;
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if ((w->now & ((1u << shift) - 1)) != 0)
+                break;
+            head = &w->slots[slot + ((w->now >> shift) & (WHEEL_LN_SLOTS - 1))];
+            if ((w->cascade[level] = *head) != NULL)
+                w->cascade[level]->e_pprev = &w->cascade[level];
+            *head = NULL;
+            shift += WHEEL_LN_BITS;
+            slot += WHEEL_LN_SLOTS;
+        }
+    }
+    pthread_mutex_unlock(&lru_locks[id]);
+    return done;
+}
+
+int item_lru_maintain(void) {
+    int id, moved = 0;
+
+    for (id = POWER_SMALLEST; id < LARGEST_ID; id++) {
+        if (settings.lru_policy == LRU_POLICY_SEGMENTED)
+            moved += lru_maintainer_juggle(id);
+        moved += wheel_turn(id);
+    }
+    return moved;
+}
+
+/*
+ * Background thread keeping every class's segments at their target sizes,
+ * so COLD always has tails for do_item_alloc() to evict, and unlinking
+ * expired items. Sleeps longer while there is nothing to do.
+ */
+static void *lru_maintainer_thread(void *arg) {
+    useconds_t to_sleep = MIN_LRU_MAINTAINER_SLEEP;
+
+    for (;;) {
+        int moved;
+
+        usleep(to_sleep);
+        moved = item_lru_maintain();
+
+        if (moved == 0) {
+            if (to_sleep < MAX_LRU_MAINTAINER_SLEEP)
+                to_sleep += 1000;
+        } else {
+            to_sleep /= 2;
+            if (to_sleep < MIN_LRU_MAINTAINER_SLEEP)
+                to_sleep = MIN_LRU_MAINTAINER_SLEEP;
+        }
+    }
+    return NULL;
+}
+
+int start_lru_maintainer_thread(void) {
+    int ret;
+
+    if ((ret = pthread_create(&lru_maintainer_tid, NULL,
+                              lru_maintainer_thread, NULL)) != 0) {
+        fprintf(stderr, "Can't create LRU maintainer thread: %s\n",
+                strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Visits up to CRAWLER_BATCH items of segment seg of class id, from where
+ * its crawl got to towards the head. Returns false once it is there.
+ */
+static bool lru_crawl_step(const int id, const int seg) {
+    item *it;
+    bool more;
+    int i;
+
+    pthread_mutex_lock(&lru_locks[id]);
+    for (i = 0; i < CRAWLER_BATCH && (it = crawl_next[id][seg]) != NULL; i++) {
+        crawl_next[id][seg] = it->prev;
+        if (it->exptime != 0 && it->exptime <= current_time && do_item_expire(it))
+            __sync_add_and_fetch(&crawler_reclaimed, 1);
+    }
+    more = crawl_next[id][seg] != NULL;
+    pthread_mutex_unlock(&lru_locks[id]);
+    return more;
+}
+
+/*
+ * Sweeps every segment of every class, a batch at a time with a pause in
+ * between, so the LRU lock is never held long enough to show in request
+ * latency; then rests until the next sweep.
+ */
+static void *lru_crawler_thread(void *arg) {
+    int id, seg;
+
+    for (;;) {
+        for (id = POWER_SMALLEST; id < LARGEST_ID; id++) {
+            for (seg = 0; seg < NUM_LRU_SEGMENTS; seg++) {
+                pthread_mutex_lock(&lru_locks[id]);
+                crawl_next[id][seg] = tails[id][seg];
+                pthread_mutex_unlock(&lru_locks[id]);
+                while (lru_crawl_step(id, seg))
+                    usleep(CRAWLER_STEP_SLEEP);
+            }
+        }
+        __sync_add_and_fetch(&crawler_sweeps, 1);
+        sleep(CRAWLER_INTERVAL);
+    }
+    return NULL;
+}
+
+int start_lru_crawler_thread(void) {
+    int ret;
+
+    if ((ret = pthread_create(&lru_crawler_tid, NULL,
+                              lru_crawler_thread, NULL)) != 0) {
+        fprintf(stderr, "Can't create LRU crawler thread: %s\n",
+                strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+void item_lru_get_stats(item_lru_stats_t *ls) {
+    int id;
+
+    memset(ls, 0, sizeof(*ls));
+    for (id = POWER_SMALLEST; id < LARGEST_ID; id++) {
+        pthread_mutex_lock(&lru_locks[id]);
+        ls->hot_items += sizes[id][HOT_LRU];
+        ls->warm_items += sizes[id][WARM_LRU];
+        ls->cold_items += sizes[id][COLD_LRU];
+        pthread_mutex_unlock(&lru_locks[id]);
+    }
+    ls->moves_to_cold = __atomic_load_n(&moves_to_cold, __ATOMIC_RELAXED);
+    ls->moves_to_warm = __atomic_load_n(&moves_to_warm, __ATOMIC_RELAXED);
+    ls->moves_within_warm = __atomic_load_n(&moves_within_warm, __ATOMIC_RELAXED);
+    ls->evictions = __atomic_load_n(&evictions, __ATOMIC_RELAXED);
+    ls->clock_second_chances = __atomic_load_n(&clock_second_chances, __ATOMIC_RELAXED);
+    ls->admission_admitted = __atomic_load_n(&admission_admitted, __ATOMIC_RELAXED);
+    ls->admission_rejected = __atomic_load_n(&admission_rejected, __ATOMIC_RELAXED);
+    ls->admission_probation = __atomic_load_n(&admission_probation, __ATOMIC_RELAXED);
+    ls->expired_reclaimed = __atomic_load_n(&expired_reclaimed, __ATOMIC_RELAXED);
+    ls->expired_unfetched = __atomic_load_n(&expired_unfetched, __ATOMIC_RELAXED);
+    ls->crawler_sweeps = __atomic_load_n(&crawler_sweeps, __ATOMIC_RELAXED);
+    ls->crawler_reclaimed = __atomic_load_n(&crawler_reclaimed, __ATOMIC_RELAXED);
+}
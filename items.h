@@ -1,16 +1,52 @@
-item *do_item_alloc(char *key, const size_t nkey, const int flags, const rel_time_t exptime, const int nbytes);
-void item_free(item *it);
-bool item_size_ok(const size_t nkey, const int flags, const int nbytes);
-
-int  do_item_link(item *it, const uint32_t hv);     /** may fail if transgresses limits */
-void do_item_unlink(item *it, const uint32_t hv);
-void do_item_remove(item *it);
-void do_item_update(item *it);   /** update LRU time to current and reposition */
-int  do_item_replace(item *it, item *new_it, const uint32_t hv);
-
-
-item *do_item_get(const char *key, const size_t nkey, const uint32_t hv);
-item *do_item_touch(const char *key, const size_t nkey, uint32_t exptime, const uint32_t hv);
-
-
-
+void item_lru_init(void);
+int start_lru_maintainer_thread(void);
+int start_lru_crawler_thread(void);
+
+/* One pass of the maintainer thread's work, for callers that run without
+   it and need evictions and expiry to depend on nothing but their own
+   requests. */
+int item_lru_maintain(void);
+
+typedef struct {
+    uint64_t hot_items;
+    uint64_t warm_items;
+    uint64_t cold_items;
+    uint64_t moves_to_cold;
+    uint64_t moves_to_warm;
+    uint64_t moves_within_warm;
+    uint64_t evictions;
+    uint64_t clock_second_chances;      /* CLOCK policy only */
+    uint64_t admission_admitted;        /* newcomer beat the victim */
+    uint64_t admission_rejected;        /* write dropped */
+    uint64_t admission_probation;       /* newcomer linked into COLD */
+    uint64_t expired_reclaimed;         /* expired items freed or reused */
+    uint64_t expired_unfetched;         /* of those, never fetched */
+    uint64_t crawler_sweeps;            /* LRU crawler passes completed */
+    uint64_t crawler_reclaimed;         /* expired items it unlinked */
+} item_lru_stats_t;
+
+void item_lru_get_stats(item_lru_stats_t *ls);
+
+/* For the slab rebalancer, see slab.c. */
+void item_lru_lock(const unsigned int id);
+void item_lru_unlock(const unsigned int id);
+uint64_t do_item_lru_evictions(const unsigned int id);
+void do_item_evacuate(item *it, item *new_it);
+item *do_item_alloc(char *key, const size_t nkey, const uint32_t flags, const rel_time_t exptime, const int nbytes,
+                    bool *rejected);   /** *rejected: NULL because admission said no */
+void item_free(item *it);
+bool item_size_ok(const size_t nkey, const uint32_t flags, const int nbytes);
+
+int  do_item_link(item *it, const uint32_t hv);     /** may fail if transgresses limits */
+void do_item_unlink(item *it, const uint32_t hv);
+void do_item_remove(item *it);
+void do_item_update(item *it);   /** update LRU time to current and reposition */
+int  do_item_replace(item *it, item *new_it, const uint32_t hv);
+int  do_store_item(item *it, const uint32_t hv);  /** link it, replacing any item with the same key */
+
+
+item *do_item_get(const char *key, const size_t nkey, const uint32_t hv);
+item *do_item_touch(const char *key, const size_t nkey, uint32_t exptime, const uint32_t hv);
+
+
+
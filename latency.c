@@ -0,0 +1,100 @@
+/*
+ * Latency histogram arithmetic, see latency.h. Recording happens inline in
+ * the callers through LATENCY_RECORD(); this file only reads histograms.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "latency.h"
+
+const char *latency_op_names[LATENCY_OPS] = {
+    "get", "set", "delete", "hash_lookup", "slab_alloc", "eviction",
+    "hash_expand"
+};
+
+uint64_t latency_tsc_mult = 0;
+
+#if defined(__x86_64__)
+static bool kernel_uses_tsc(void) {
+    char name[32] = "";
+    FILE *f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+
+    if (f == NULL)
+        return false;
+    if (fgets(name, sizeof(name), f) == NULL)
+        name[0] = '\0';
+    fclose(f);
+    return strcmp(name, "tsc\n") == 0;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+void latency_init(void) {
+#if defined(__x86_64__)
+    const struct timespec wait = { 0, 10000000 };
+    uint64_t ns, cycles;
+
+    if (!kernel_uses_tsc())
+        return;
+    /* Rate the TSC against the kernel's clock over 10ms. */
+    ns = monotonic_ns();
+    cycles = __rdtsc();
+    nanosleep(&wait, NULL);
+    ns = monotonic_ns() - ns;
+    cycles = __rdtsc() - cycles;
+    if (cycles > 0)
+        latency_tsc_mult = ((unsigned __int128)ns << 32) / cycles;
+#endif
+}
+
+uint64_t latency_bucket_low(const unsigned int b) {
+    unsigned int group = b / LATENCY_SUB_BUCKETS;
+    unsigned int sub = b % LATENCY_SUB_BUCKETS;
+
+    if (group == 0)
+        return sub;
+    return (uint64_t)(LATENCY_SUB_BUCKETS + sub) << (group - 1);
+}
+
+uint64_t latency_bucket_high(const unsigned int b) {
+    if (b == LATENCY_BUCKETS - 1)
+        return UINT64_MAX;
+    return latency_bucket_low(b + 1) - 1;
+}
+
+uint64_t latency_count(const latency_hist_t *h) {
+    uint64_t n = 0;
+    size_t b;
+
+    for (b = 0; b < LATENCY_BUCKETS; b++)
+        n += h->buckets[b];
+    return n;
+}
+
+uint64_t latency_quantile(const latency_hist_t *h, const double q) {
+    uint64_t total = latency_count(h);
+    uint64_t rank, seen = 0;
+    size_t b;
+
+    if (total == 0)
+        return 0;
+    /* The smallest value with at least q of all values at or below it. */
+    rank = (uint64_t)(q * total);
+    if (rank < q * total || rank == 0)
+        rank++;
+    for (b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank)
+            return latency_bucket_high(b);
+    }
+    return latency_bucket_high(LATENCY_BUCKETS - 1);
+}
@@ -0,0 +1,97 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * Log-linear latency histograms, in the manner of HdrHistogram. Values are
+ * nanoseconds. Below 2^LATENCY_SUB_BITS every value has a bucket of its own;
+ * above, each power of two is split into 2^LATENCY_SUB_BITS equal buckets, so
+ * a bucket is never wider than 1/16 of the values it holds. Anything from
+ * 2^LATENCY_MAX_BITS ns (about 69 seconds) up lands in the last bucket.
+ *
+ * Histograms live in the per-thread stats blocks and are merged on read
+ * like every other counter there, see thread_stats_t.
+ */
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/* What is timed. Keep latency_op_names in latency.c in the same order. */
+enum latency_op {
+    LATENCY_GET,            /* get command, all of its keys */
+    LATENCY_SET,            /* set command, header parsed to value stored,
+                               including any wait for the rest of the value */
+    LATENCY_DELETE,         /* delete command */
+    LATENCY_HASH_LOOKUP,    /* item lock plus hashtable lookup, per key */
+    LATENCY_SLAB_ALLOC,     /* slabs_alloc(), lock wait included */
+    LATENCY_EVICTION,       /* item allocations that had to evict */
+    LATENCY_HASH_EXPAND,    /* expansion setup and each bucket migration */
+    LATENCY_OPS
+};
+
+typedef struct {
+    uint64_t sum_ns;
+    uint64_t buckets[LATENCY_BUCKETS];
+} latency_hist_t;
+
+extern const char *latency_op_names[LATENCY_OPS];
+
+/*
+ * Timestamps are taken in ticks: TSC cycles where the kernel itself keeps
+ * time with the TSC, which makes it constant-rate and synchronized across
+ * CPUs, otherwise CLOCK_MONOTONIC nanoseconds. Reading the TSC costs a
+ * fraction of a clock_gettime() call, and a request takes several readings.
+ */
+extern uint64_t latency_tsc_mult;   /* ns per cycle << 32, 0 without TSC */
+
+// Picks the clock; until it's called, ticks are nanoseconds
+void latency_init(void);
+
+static inline uint64_t latency_ticks(void) {
+    struct timespec ts;
+
+#if defined(__x86_64__)
+    if (latency_tsc_mult != 0)
+        return __rdtsc();
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t latency_ns(const uint64_t ticks) {
+    if (latency_tsc_mult == 0)
+        return ticks;
+    return ((unsigned __int128)ticks * latency_tsc_mult) >> 32;
+}
+
+static inline unsigned int latency_bucket(const uint64_t ns) {
+    unsigned int msb;
+
+    if (ns < LATENCY_SUB_BUCKETS)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    if (msb >= LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+    return (msb - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS
+        + ((ns >> (msb - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Smallest and largest value counted in bucket b
+uint64_t latency_bucket_low(const unsigned int b);
+uint64_t latency_bucket_high(const unsigned int b);
+
+// Number of values recorded in h
+uint64_t latency_count(const latency_hist_t *h);
+
+// Upper bound of the bucket holding the value at quantile q (0 < q <= 1),
+// 0 for an empty histogram
+uint64_t latency_quantile(const latency_hist_t *h, const double q);
+
+#endif
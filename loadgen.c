@@ -0,0 +1,464 @@
+/*
+ * Load generator for the server, built on the client library in client.c.
+ *
+ * Worker threads each drive their share of the connections. Every round,
+ * a connection sends a pipeline of requests (gets of one or more keys, or
+ * sets) and waits for all of their replies, so the load is closed-loop:
+ * each connection has at most one pipeline outstanding. Keys are drawn
+ * uniformly or from a Zipf distribution, value sizes uniformly from a
+ * range.
+ *
+ * With a target rate, pipelines are sent on a fixed schedule instead of
+ * back to back. Latency is measured from the scheduled send time, so a
+ * server that falls behind is charged for the requests it delayed, not
+ * only for the ones it answered.
+ *
+ * Build: make loadgen
+ * Usage: loadgen [-s host] [-p port] [-t threads] [-c connections]
+ *                [-d seconds] [-k keys] [-z skew] [-v size[-max]]
+ *                [-r gets:sets] [-g keys per get] [-q depth] [-R rate] [-P]
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "client.h"
+#include "latency.h"
+
+#define KEY_BUFFER 32
+#define GET_KEYS_MAX 100
+#define PREFILL_DEPTH 100
+
+typedef struct {
+    mc_conn_t *conn;
+    uint64_t next;          /* scheduled send time of the next pipeline, ns */
+} lg_conn_t;
+
+typedef struct {
+    pthread_t tid;
+    lg_conn_t *conns;
+    int nconns;
+    uint64_t rng;
+    /* Written by the thread, read by the progress reports. */
+    uint64_t ops;           /* requests answered */
+    uint64_t gets;
+    uint64_t sets;
+    uint64_t keys;          /* keys asked for by gets */
+    uint64_t hits;
+    uint64_t errors;
+    latency_hist_t hist;
+} lg_thread_t;
+
+static const char *host = "127.0.0.1";
+static int port = 11211;
+static int nthreads = 2;
+static int nconns = 8;
+static int duration = 10;
+static uint32_t nkeys = 100000;
+static double skew = 0.99;
+static size_t value_min = 100, value_max = 100;
+static double get_share = 0.9;
+static int keys_per_get = 1;
+static int depth = 1;
+static double rate = 0;             /* requests per second, 0 for no limit */
+static bool prefill = false;
+
+static char *value;
+static uint64_t start_ns, end_ns;
+
+/* Zipf draws after Gray et al., "Quickly generating billion-record
+   synthetic databases": O(n) setup, O(1) per draw. */
+static double zipf_zetan, zipf_alpha, zipf_eta;
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, one generator per thread. */
+static inline uint64_t next_rand(uint64_t *state) {
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static inline double next_unit(uint64_t *state) {
+    return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(void) {
+    double zeta2 = 1.0 + pow(0.5, skew);
+    uint32_t i;
+
+    zipf_zetan = 0;
+    for (i = 1; i <= nkeys; i++)
+        zipf_zetan += 1.0 / pow((double)i, skew);
+    zipf_alpha = 1.0 / (1.0 - skew);
+    zipf_eta = (1.0 - pow(2.0 / nkeys, 1.0 - skew)) / (1.0 - zeta2 / zipf_zetan);
+}
+
+static uint32_t draw_key(uint64_t *rng) {
+    double u, uz;
+    uint32_t k;
+
+    if (skew == 0)
+        return next_rand(rng) % nkeys;
+    u = next_unit(rng);
+    uz = u * zipf_zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, skew))
+        return 1;
+    k = (uint32_t)(nkeys * pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+    return k < nkeys ? k : nkeys - 1;
+}
+
+static size_t draw_value_size(uint64_t *rng) {
+    if (value_max == value_min)
+        return value_min;
+    return value_min + next_rand(rng) % (value_max - value_min + 1);
+}
+
+static inline void count(uint64_t *counter, const uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* Queues one pipeline on c. */
+static int queue_pipeline(lg_thread_t *me, mc_conn_t *c) {
+    char keybuf[GET_KEYS_MAX][KEY_BUFFER];
+    const char *keys[GET_KEYS_MAX];
+    size_t lens[GET_KEYS_MAX];
+    int i, j;
+
+    for (i = 0; i < depth; i++) {
+        if (next_unit(&me->rng) < get_share) {
+            for (j = 0; j < keys_per_get; j++) {
+                lens[j] = snprintf(keybuf[j], KEY_BUFFER, "key:%u", draw_key(&me->rng));
+                keys[j] = keybuf[j];
+            }
+            if (mc_queue_get(c, keys, lens, keys_per_get) != 0)
+                return -1;
+        } else {
+            size_t n = snprintf(keybuf[0], KEY_BUFFER, "key:%u", draw_key(&me->rng));
+            if (mc_queue_set(c, keybuf[0], n, 0, 0, value,
+                             draw_value_size(&me->rng)) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* Reads the replies to a pipeline sent at sent, counting them. */
+static int collect_pipeline(lg_thread_t *me, mc_conn_t *c, const uint64_t sent) {
+    mc_reply_t r;
+    uint64_t hits = 0, gets = 0, sets = 0, errors = 0;
+    int ret;
+
+    while ((ret = mc_read_reply(c, &r)) == 1) {
+        switch (r.type) {
+        case MC_REPLY_VALUE:
+            hits++;
+            continue;       /* not a whole reply yet */
+        case MC_REPLY_END:
+            gets++;
+            break;
+        case MC_REPLY_STORED:
+        case MC_REPLY_NOT_STORED:
+            sets++;
+            break;
+        default:
+            errors++;
+            break;
+        }
+        {
+            uint64_t ns = now_nsec() - sent;
+            unsigned int b = latency_bucket(ns);
+            count(&me->hist.sum_ns, ns);
+            count(&me->hist.buckets[b], 1);
+        }
+    }
+    count(&me->hits, hits);
+    count(&me->gets, gets);
+    count(&me->keys, gets * keys_per_get);
+    count(&me->sets, sets);
+    count(&me->errors, errors);
+    count(&me->ops, gets + sets + errors);
+    return ret;
+}
+
+static void *lg_thread(void *arg) {
+    lg_thread_t *me = arg;
+    /* Each connection sends one pipeline per interval. */
+    uint64_t interval = rate > 0 ? (uint64_t)(1e9 * depth * nconns / rate) : 0;
+    uint64_t *sent = calloc(me->nconns, sizeof(uint64_t));
+    int i;
+
+    for (i = 0; i < me->nconns; i++)
+        me->conns[i].next = start_ns + (interval > 0 ? next_rand(&me->rng) % interval : 0);
+
+    for (;;) {
+        uint64_t now = now_nsec(), wake = UINT64_MAX;
+        int nsent = 0;
+
+        if (now >= end_ns)
+            break;
+        for (i = 0; i < me->nconns; i++) {
+            lg_conn_t *lc = &me->conns[i];
+
+            sent[i] = 0;
+            if (lc->conn == NULL)
+                continue;
+            if (interval > 0 && lc->next > now) {
+                if (lc->next < wake)
+                    wake = lc->next;
+                continue;
+            }
+            if (queue_pipeline(me, lc->conn) != 0 || mc_flush(lc->conn) != 0) {
+                fprintf(stderr, "connection failed\n");
+                mc_close(lc->conn);
+                lc->conn = NULL;
+                continue;
+            }
+            sent[i] = interval > 0 ? lc->next : now;
+            lc->next += interval;
+            nsent++;
+        }
+        if (nsent == 0) {
+            if (wake == UINT64_MAX)
+                break;      /* every connection failed */
+            if (wake > now) {
+                struct timespec ts = { (wake - now) / 1000000000, (wake - now) % 1000000000 };
+                nanosleep(&ts, NULL);
+            }
+            continue;
+        }
+        for (i = 0; i < me->nconns; i++) {
+            lg_conn_t *lc = &me->conns[i];
+
+            if (sent[i] == 0)
+                continue;
+            if (collect_pipeline(me, lc->conn, sent[i]) != 0) {
+                fprintf(stderr, "bad reply or connection failed\n");
+                mc_close(lc->conn);
+                lc->conn = NULL;
+            }
+        }
+    }
+    free(sent);
+    return NULL;
+}
+
+static int do_prefill(void) {
+    mc_conn_t *c = mc_connect(host, port);
+    uint64_t rng = 1;
+    mc_reply_t r;
+    char key[KEY_BUFFER];
+    uint32_t k;
+    int ret;
+
+    if (c == NULL)
+        return -1;
+    for (k = 0; k < nkeys; k++) {
+        size_t n = snprintf(key, sizeof(key), "key:%u", k);
+        if (mc_queue_set(c, key, n, 0, 0, value, draw_value_size(&rng)) != 0)
+            break;
+        if (k % PREFILL_DEPTH == PREFILL_DEPTH - 1 || k == nkeys - 1) {
+            if (mc_flush(c) != 0)
+                break;
+            while ((ret = mc_read_reply(c, &r)) == 1)
+                ;
+            if (ret != 0)
+                break;
+        }
+    }
+    mc_close(c);
+    return k == nkeys ? 0 : -1;
+}
+
+static void report(lg_thread_t *threads, const double secs) {
+    latency_hist_t total;
+    uint64_t ops = 0, gets = 0, sets = 0, keys = 0, hits = 0, errors = 0, n;
+    int i, b;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nthreads; i++) {
+        ops += threads[i].ops;
+        gets += threads[i].gets;
+        sets += threads[i].sets;
+        keys += threads[i].keys;
+        hits += threads[i].hits;
+        errors += threads[i].errors;
+        total.sum_ns += threads[i].hist.sum_ns;
+        for (b = 0; b < LATENCY_BUCKETS; b++)
+            total.buckets[b] += threads[i].hist.buckets[b];
+    }
+    n = latency_count(&total);
+
+    printf("requests   %lu in %.2fs: %.0f/s (gets %.0f/s, sets %.0f/s)\n",
+           ops, secs, ops / secs, gets / secs, sets / secs);
+    printf("hit ratio  %.4f of %lu keys\n", keys > 0 ? (double)hits / keys : 0.0, keys);
+    printf("latency us mean %.1f p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f\n",
+           n > 0 ? total.sum_ns / 1000.0 / n : 0.0,
+           latency_quantile(&total, 0.5) / 1000.0,
+           latency_quantile(&total, 0.9) / 1000.0,
+           latency_quantile(&total, 0.99) / 1000.0,
+           latency_quantile(&total, 0.999) / 1000.0,
+           latency_quantile(&total, 1.0) / 1000.0);
+    printf("errors     %lu\n", errors);
+}
+
+static void usage(void) {
+    printf("loadgen\n"
+           "-s <host>     server (default: 127.0.0.1)\n"
+           "-p <num>      port (default: 11211)\n"
+           "-t <num>      threads (default: 2)\n"
+           "-c <num>      connections, spread over the threads (default: 8)\n"
+           "-d <secs>     run time (default: 10)\n"
+           "-k <num>      distinct keys (default: 100000)\n"
+           "-z <skew>     Zipf skew of key popularity, below 1; 0 for\n"
+           "              uniform (default: 0.99)\n"
+           "-v <size>     value bytes, or <min>-<max> for a uniform range\n"
+           "              (default: 100)\n"
+           "-r <g>:<s>    ratio of gets to sets (default: 9:1)\n"
+           "-g <num>      keys per get (default: 1)\n"
+           "-q <num>      requests pipelined per connection (default: 1)\n"
+           "-R <num>      target requests per second, all connections\n"
+           "              together (default: as fast as replies come)\n"
+           "-P            set every key once before starting\n");
+}
+
+int main(int argc, char **argv) {
+    lg_thread_t *threads;
+    mc_pool_t *pool;
+    double g, s, secs;
+    uint64_t last_ops = 0;
+    int c, i, j;
+
+    while (-1 != (c = getopt(argc, argv, "s:p:t:c:d:k:z:v:r:g:q:R:Ph"))) {
+        switch (c) {
+        case 's':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'k':
+            nkeys = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            skew = atof(optarg);
+            break;
+        case 'v':
+            if (sscanf(optarg, "%zu-%zu", &value_min, &value_max) != 2)
+                value_max = value_min = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%lf:%lf", &g, &s) != 2 || g < 0 || s < 0 || g + s == 0) {
+                usage();
+                return 1;
+            }
+            get_share = g / (g + s);
+            break;
+        case 'g':
+            keys_per_get = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'R':
+            rate = atof(optarg);
+            break;
+        case 'P':
+            prefill = true;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (nthreads <= 0 || nconns < nthreads || duration <= 0 || nkeys == 0 ||
+        skew < 0 || skew >= 1 || value_min > value_max || value_max > 1024 * 1024 ||
+        keys_per_get <= 0 || keys_per_get > GET_KEYS_MAX || depth <= 0 || rate < 0) {
+        usage();
+        return 1;
+    }
+
+    value = malloc(value_max + 1);
+    threads = calloc(nthreads, sizeof(lg_thread_t));
+    pool = mc_pool_new(host, port, nconns);
+    if (value == NULL || threads == NULL || pool == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memset(value, 'x', value_max);
+    if (skew > 0)
+        zipf_init();
+    if (prefill && do_prefill() != 0) {
+        fprintf(stderr, "prefill failed\n");
+        return 1;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        threads[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+        threads[i].conns = calloc(threads[i].nconns, sizeof(lg_conn_t));
+        threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        for (j = 0; j < threads[i].nconns; j++) {
+            if ((threads[i].conns[j].conn = mc_pool_get(pool)) == NULL) {
+                fprintf(stderr, "can't connect to %s:%d\n", host, port);
+                return 1;
+            }
+        }
+    }
+
+    start_ns = now_nsec();
+    end_ns = start_ns + (uint64_t)duration * 1000000000;
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i].tid, NULL, lg_thread, &threads[i]);
+
+    /* A line per second while it runs. */
+    for (j = 1; j <= duration; j++) {
+        uint64_t ops = 0;
+
+        sleep(1);
+        for (i = 0; i < nthreads; i++)
+            ops += __atomic_load_n(&threads[i].ops, __ATOMIC_RELAXED);
+        fprintf(stderr, "%3ds %10lu requests/s\n", j, ops - last_ops);
+        last_ops = ops;
+    }
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i].tid, NULL);
+    secs = (now_nsec() - start_ns) / 1e9;
+    report(threads, secs);
+
+    for (i = 0; i < nthreads; i++) {
+        for (j = 0; j < threads[i].nconns; j++) {
+            if (threads[i].conns[j].conn != NULL)
+                mc_pool_put(pool, threads[i].conns[j].conn, false);
+        }
+    }
+    mc_pool_free(pool);
+    return 0;
+}
@@ -0,0 +1,355 @@
+/*
+ * Benchmark for the eviction policies in items.c.
+ *
+ * Worker threads run a cache-aside loop straight against the item layer:
+ * GET a key drawn from a Zipf distribution, and on a miss allocate and
+ * store it. With -A, requests feed the TinyLFU sketch and new items have
+ * to pass admission. Each policy runs in its own child process, since the engine
+ * keeps its state in globals, and reports GET throughput and hit ratio
+ * once the cache has filled up. It then reads every key and checks that
+ * stores into the full cache still find victims.
+ *
+ * Build: make lru_bench
+ * Usage: lru_bench [-e policy] [-A admission] [-P memory] [-t threads]
+ *                  [-m megabytes] [-k keys] [-n ops] [-z skew] [-s scan%]
+ *                  2>/dev/null
+ *
+ * The engine's startup messages go to stderr.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "simple_memcached.h"
+
+#define VALUE_BYTES 100
+
+typedef struct {
+    pthread_t tid;
+    uint32_t *keys;         /* key numbers, drawn up front */
+    size_t nops;
+    uint64_t hits;
+    uint64_t gets;
+} bench_thread_t;
+
+static enum slab_arena_type arena = SLAB_ARENA_MALLOC;
+static pthread_barrier_t start_barrier;
+static pthread_barrier_t warm_barrier;
+static char value[VALUE_BYTES + 2];
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Cumulative Zipf(skew) distribution over nkeys ranks. */
+static double *zipf_cdf(size_t nkeys, double skew) {
+    double *cdf = malloc(nkeys * sizeof(double));
+    double sum = 0;
+    size_t i;
+
+    if (cdf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < nkeys; i++) {
+        sum += 1.0 / pow((double)(i + 1), skew);
+        cdf[i] = sum;
+    }
+    for (i = 0; i < nkeys; i++)
+        cdf[i] /= sum;
+    return cdf;
+}
+
+static uint32_t zipf_draw(const double *cdf, size_t nkeys, unsigned int *seed) {
+    double u = (double)rand_r(seed) / ((double)RAND_MAX + 1);
+    size_t lo = 0, hi = nkeys - 1;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* One cache-aside request; returns true on a hit. */
+static bool bench_request(uint32_t keynum) {
+    char key[KEY_MAX_LENGTH];
+    size_t nkey = snprintf(key, sizeof(key), "key:%u", keynum);
+    uint32_t hv = hash(key, nkey);
+    item *it;
+
+    if (settings.admission != ADMISSION_NONE)
+        tinylfu_record(hv);
+    item_lock(hv);
+    it = do_item_get(key, nkey, hv);
+    item_unlock(hv);
+    if (it != NULL) {
+        item_remove(it);
+        return true;
+    }
+
+    it = do_item_alloc(key, nkey, 0, 0, sizeof(value), NULL);
+    if (it != NULL) {
+        memcpy(ITEM_data(it), value, sizeof(value));
+        item_lock(it->hv);
+        do_store_item(it, it->hv);
+        item_unlock(it->hv);
+        item_remove(it);
+    }
+    return false;
+}
+
+/*
+ * Reads every key, so that all resident items are referenced, then stores
+ * new ones into the full cache. Each store has to find a victim; returns
+ * how many failed for any reason but admission.
+ */
+static size_t set_after_read_check(size_t nkeys, uint32_t first_new) {
+    char key[KEY_MAX_LENGTH];
+    size_t nkey, i, failed = 0;
+    bool rejected;
+    uint32_t hv;
+    item *it;
+
+    for (i = 0; i < nkeys; i++) {
+        nkey = snprintf(key, sizeof(key), "key:%zu", i);
+        hv = hash(key, nkey);
+        item_lock(hv);
+        it = do_item_get(key, nkey, hv);
+        item_unlock(hv);
+        if (it != NULL)
+            item_remove(it);
+    }
+    for (i = 0; i < 1000; i++) {
+        nkey = snprintf(key, sizeof(key), "key:%zu", first_new + i);
+        it = do_item_alloc(key, nkey, 0, 0, sizeof(value), &rejected);
+        if (it == NULL) {
+            failed += !rejected;
+            continue;
+        }
+        memcpy(ITEM_data(it), value, sizeof(value));
+        item_lock(it->hv);
+        do_store_item(it, it->hv);
+        item_unlock(it->hv);
+        item_remove(it);
+    }
+    return failed;
+}
+
+/* Runs the first half of the draws untimed to fill the cache. */
+static void *bench_thread(void *arg) {
+    bench_thread_t *me = arg;
+    size_t warm = me->nops / 2;
+    size_t i;
+
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < warm; i++)
+        bench_request(me->keys[i]);
+    pthread_barrier_wait(&warm_barrier);
+    for (; i < me->nops; i++) {
+        me->hits += bench_request(me->keys[i]);
+        me->gets++;
+    }
+    return NULL;
+}
+
+static void run(enum lru_policy_type policy, enum admission_type admission,
+                int nthreads, size_t megabytes, size_t nkeys, size_t nops,
+                double skew, int scan_pct) {
+    bench_thread_t *threads = calloc(nthreads, sizeof(bench_thread_t));
+    double *cdf = zipf_cdf(nkeys, skew);
+    uint32_t scan_next = nkeys;
+    uint64_t hits = 0, gets = 0, start, elapsed;
+    size_t j, failed;
+    int i;
+
+    engine_settings_default();
+    settings.maxbytes = megabytes * 1024 * 1024;
+    settings.num_threads = nthreads;
+    settings.lru_policy = policy;
+    settings.admission = admission;
+    settings.slab_arena = arena;
+
+    if (engine_init(NULL) != 0)
+        exit(1);
+    if (start_hash_maintenance_thread() != 0)
+        exit(1);
+    if (policy == LRU_POLICY_SEGMENTED && start_lru_maintainer_thread() != 0)
+        exit(1);
+
+    memset(value, 'v', VALUE_BYTES);
+    memcpy(value + VALUE_BYTES, "\r\n", 2);
+
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    pthread_barrier_init(&warm_barrier, NULL, nthreads + 1);
+    for (i = 0; i < nthreads; i++) {
+        unsigned int seed = i + 1;
+
+        threads[i].nops = nops;
+        threads[i].keys = malloc(nops * sizeof(uint32_t));
+        if (threads[i].keys == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        for (j = 0; j < nops; j++) {
+            /* Scan keys are never requested twice. */
+            if (scan_pct > 0 && rand_r(&seed) % 100 < scan_pct)
+                threads[i].keys[j] = scan_next++;
+            else
+                threads[i].keys[j] = zipf_draw(cdf, nkeys, &seed);
+        }
+        pthread_create(&threads[i].tid, NULL, bench_thread, &threads[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    pthread_barrier_wait(&warm_barrier);
+    start = now_nsec();
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        hits += threads[i].hits;
+        gets += threads[i].gets;
+    }
+    elapsed = now_nsec() - start;
+    failed = set_after_read_check(nkeys, scan_next);
+
+    printf("%-10s admission=%-9s threads=%-3d %8.2f Mgets/s  hit_ratio=%.4f"
+           "  set_failures=%zu\n",
+           policy == LRU_POLICY_CLOCK ? "clock" : "segmented",
+           admission == ADMISSION_REJECT ? "reject" :
+           admission == ADMISSION_PROBATION ? "probation" : "none", nthreads,
+           (double)gets * 1000.0 / elapsed, (double)hits / gets, failed);
+    fflush(stdout);
+    if (failed != 0) {
+        fprintf(stderr, "SETs failed after the working set was read\n");
+        exit(1);
+    }
+}
+
+static void usage(void) {
+    printf("lru_bench\n"
+           "-e <name>     policy to run: segmented, clock (default: both)\n"
+           "-A <name>     admission: none, reject, probation (default: none)\n"
+           "-P <name>     item memory: malloc, mmap, thp, hugetlb (default: malloc)\n"
+           "-t <num>      worker threads (default: 4)\n"
+           "-m <num>      item memory in megabytes (default: 64)\n"
+           "-k <num>      distinct keys (default: 1000000)\n"
+           "-n <num>      requests per thread, half of them warmup (default: 4000000)\n"
+           "-z <skew>     Zipf skew of key popularity (default: 0.99)\n"
+           "-s <pct>      share of requests for one-shot scan keys (default: 0)\n");
+}
+
+int main(int argc, char **argv) {
+    enum lru_policy_type policies[] = { LRU_POLICY_SEGMENTED, LRU_POLICY_CLOCK };
+    int npolicies = 2;
+    int nthreads = 4;
+    size_t megabytes = 64;
+    size_t nkeys = 1000000;
+    size_t nops = 4000000;
+    double skew = 0.99;
+    int scan_pct = 0;
+    enum admission_type admission = ADMISSION_NONE;
+    int c, p;
+
+    while (-1 != (c = getopt(argc, argv, "e:A:P:t:m:k:n:z:s:h"))) {
+        switch (c) {
+        case 'e':
+            npolicies = 1;
+            if (strcmp(optarg, "segmented") == 0) {
+                policies[0] = LRU_POLICY_SEGMENTED;
+            } else if (strcmp(optarg, "clock") == 0) {
+                policies[0] = LRU_POLICY_CLOCK;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'A':
+            if (strcmp(optarg, "none") == 0) {
+                admission = ADMISSION_NONE;
+            } else if (strcmp(optarg, "reject") == 0) {
+                admission = ADMISSION_REJECT;
+            } else if (strcmp(optarg, "probation") == 0) {
+                admission = ADMISSION_PROBATION;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'P':
+            if (strcmp(optarg, "malloc") == 0) {
+                arena = SLAB_ARENA_MALLOC;
+            } else if (strcmp(optarg, "mmap") == 0) {
+                arena = SLAB_ARENA_MMAP;
+            } else if (strcmp(optarg, "thp") == 0) {
+                arena = SLAB_ARENA_THP;
+            } else if (strcmp(optarg, "hugetlb") == 0) {
+                arena = SLAB_ARENA_HUGETLB;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'm':
+            megabytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            nkeys = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            nops = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            skew = atof(optarg);
+            break;
+        case 's':
+            scan_pct = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (nthreads <= 0 || megabytes == 0 || nkeys == 0 || nops < 2 ||
+        scan_pct < 0 || scan_pct > 100) {
+        usage();
+        return 1;
+    }
+
+    for (p = 0; p < npolicies; p++) {
+        pid_t pid = fork();
+        int status;
+
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            run(policies[p], admission, nthreads, megabytes, nkeys, nops,
+                skew, scan_pct);
+            _exit(0);
+        }
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "run failed\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,318 @@
+/*
+ * SHARDS miss ratio curve, see mrc.h.
+ *
+ * The sampled keys are kept in access order as slots of a Fenwick tree
+ * that holds each key's size at its latest slot, so the bytes accessed
+ * since a key's last access are a prefix sum away. Slots are handed out
+ * in increasing order; when they run out, the live ones are packed to the
+ * front. A hash table finds a key's record by its priority, which as a
+ * bijection of the hash value identifies the key, and a max-heap on
+ * priority finds the key to drop when the sample is full.
+ *
+ * Everything is under one lock. Only sampled accesses take it, a small
+ * fraction of all of them once the sample has filled.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "mrc.h"
+#include "latency.h"
+
+/*
+ * The sample gets a key per MRC_KEY_BYTES of item memory, about 1/200 of
+ * it at the 80 or so bytes a key costs here, within these bounds.
+ */
+#define MRC_KEY_BYTES 16384
+#define MRC_KEYS_MIN 256
+#define MRC_KEYS_MAX 16384
+
+/* Slots per key; packing runs once per (MRC_SLOTS_PER_KEY - 1) * keys. */
+#define MRC_SLOTS_PER_KEY 4
+
+/* Rate before the sample first fills, which caps what it costs. */
+#define MRC_INITIAL_RATE_DIV 64
+
+typedef struct {
+    uint32_t prio;
+    uint32_t size;      /* bytes of the item, 0 until seen */
+    uint32_t slot;      /* latest access, an index into slot_key */
+} mrc_key_t;
+
+uint32_t mrc_threshold = 0;     /* nothing is sampled before mrc_init() */
+
+static pthread_mutex_t mrc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static mrc_key_t *keys;
+static unsigned int max_keys;
+static unsigned int nkeys;
+static int32_t *free_keys;      /* stack of unused records */
+static unsigned int nfree;
+
+static int32_t *table;          /* record per priority, -1 for empty */
+static uint32_t table_mask;
+
+static uint64_t *fenwick;       /* 1-based, over nslots slots */
+static int32_t *slot_key;       /* record per slot, -1 for none */
+static uint32_t nslots;
+static uint32_t next_slot;
+static uint64_t total_bytes;    /* sum of sizes in the tree */
+
+static int32_t *heap;           /* records, highest priority first */
+
+static uint64_t hist[LATENCY_BUCKETS];
+static uint64_t gets;
+static uint64_t cold_misses;
+
+static void *mrc_calloc(size_t n, size_t size) {
+    void *p = calloc(n, size);
+
+    if (p == NULL) {
+        fprintf(stderr, "Failed to allocate the miss ratio curve sampler\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+void mrc_init(const size_t maxbytes) {
+    uint32_t tsize = 1;
+    unsigned int i;
+
+    max_keys = maxbytes / MRC_KEY_BYTES;
+    if (max_keys < MRC_KEYS_MIN)
+        max_keys = MRC_KEYS_MIN;
+    if (max_keys > MRC_KEYS_MAX)
+        max_keys = MRC_KEYS_MAX;
+
+    /* One more than the cap: a new key gets in before the top one leaves. */
+    keys = mrc_calloc(max_keys + 1, sizeof(mrc_key_t));
+    free_keys = mrc_calloc(max_keys + 1, sizeof(int32_t));
+    for (i = 0; i <= max_keys; i++)
+        free_keys[nfree++] = max_keys - i;
+
+    while (tsize < 2 * (max_keys + 1))
+        tsize *= 2;
+    table = mrc_calloc(tsize, sizeof(int32_t));
+    memset(table, 0xff, tsize * sizeof(int32_t));
+    table_mask = tsize - 1;
+
+    nslots = MRC_SLOTS_PER_KEY * (max_keys + 1);
+    fenwick = mrc_calloc(nslots + 1, sizeof(uint64_t));
+    slot_key = mrc_calloc(nslots, sizeof(int32_t));
+    memset(slot_key, 0xff, nslots * sizeof(int32_t));
+
+    heap = mrc_calloc(max_keys + 1, sizeof(int32_t));
+
+    __atomic_store_n(&mrc_threshold, UINT32_MAX / MRC_INITIAL_RATE_DIV,
+                     __ATOMIC_RELAXED);
+}
+
+/******************************** FENWICK TREE ******************************/
+
+static void fenwick_add(uint32_t slot, const uint64_t delta) {
+    for (slot++; slot <= nslots; slot += slot & -slot)
+        fenwick[slot] += delta;
+}
+
+/* Sum over slots [0, n). */
+static uint64_t fenwick_sum(uint32_t n) {
+    uint64_t sum = 0;
+
+    for (; n > 0; n -= n & -n)
+        sum += fenwick[n];
+    return sum;
+}
+
+/* Moves the live slots to the front, in order, and rebuilds the tree. */
+static void slots_pack(void) {
+    uint32_t s, n = 0, p;
+
+    for (s = 0; s < next_slot; s++) {
+        int32_t k = slot_key[s];
+
+        if (k < 0)
+            continue;
+        slot_key[s] = -1;
+        slot_key[n] = k;
+        keys[k].slot = n++;
+    }
+    next_slot = n;
+
+    memset(fenwick, 0, (nslots + 1) * sizeof(uint64_t));
+    for (s = 0; s < n; s++)
+        fenwick[s + 1] = keys[slot_key[s]].size;
+    for (s = 1; s <= nslots; s++) {
+        p = s + (s & -s);
+        if (p <= nslots)
+            fenwick[p] += fenwick[s];
+    }
+}
+
+/* Gives record k the newest slot. */
+static void slot_take(const int32_t k) {
+    if (next_slot == nslots)
+        slots_pack();
+    keys[k].slot = next_slot++;
+    slot_key[keys[k].slot] = k;
+    fenwick_add(keys[k].slot, keys[k].size);
+    total_bytes += keys[k].size;
+}
+
+static void slot_release(const int32_t k) {
+    slot_key[keys[k].slot] = -1;
+    fenwick_add(keys[k].slot, -(uint64_t)keys[k].size);
+    total_bytes -= keys[k].size;
+}
+
+/******************************** HASH TABLE ********************************/
+
+static int32_t table_find(const uint32_t prio) {
+    uint32_t i;
+
+    for (i = prio & table_mask; table[i] >= 0; i = (i + 1) & table_mask) {
+        if (keys[table[i]].prio == prio)
+            return table[i];
+    }
+    return -1;
+}
+
+static void table_insert(const int32_t k) {
+    uint32_t i;
+
+    for (i = keys[k].prio & table_mask; table[i] >= 0; i = (i + 1) & table_mask)
+        ;
+    table[i] = k;
+}
+
+/* Backward-shift deletion: no tombstones to slow down later probes. */
+static void table_delete(const int32_t k) {
+    uint32_t i = keys[k].prio & table_mask, j, home;
+
+    while (table[i] != k)
+        i = (i + 1) & table_mask;
+    for (j = (i + 1) & table_mask; table[j] >= 0; j = (j + 1) & table_mask) {
+        home = keys[table[j]].prio & table_mask;
+        /* Entry j may fill the hole at i unless its home lies in (i, j]. */
+        if (((j - home) & table_mask) >= ((j - i) & table_mask)) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i] = -1;
+}
+
+/********************************** HEAP ************************************/
+
+static void heap_up(uint32_t pos) {
+    int32_t k = heap[pos];
+
+    while (pos > 0 && keys[heap[(pos - 1) / 2]].prio < keys[k].prio) {
+        heap[pos] = heap[(pos - 1) / 2];
+        pos = (pos - 1) / 2;
+    }
+    heap[pos] = k;
+}
+
+static void heap_down(uint32_t pos, const uint32_t n) {
+    int32_t k = heap[pos];
+    uint32_t child;
+
+    while ((child = 2 * pos + 1) < n) {
+        if (child + 1 < n && keys[heap[child + 1]].prio > keys[heap[child]].prio)
+            child++;
+        if (keys[heap[child]].prio <= keys[k].prio)
+            break;
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = k;
+}
+
+/********************************* SAMPLER **********************************/
+
+/* Drops the key with the highest priority and samples below it from now. */
+static void drop_top(void) {
+    int32_t k = heap[0];
+
+    __atomic_store_n(&mrc_threshold, keys[k].prio, __ATOMIC_RELAXED);
+    nkeys--;
+    if (nkeys > 0) {
+        heap[0] = heap[nkeys];
+        heap_down(0, nkeys);
+    }
+    slot_release(k);
+    table_delete(k);
+    free_keys[nfree++] = k;
+}
+
+void mrc_access(const uint32_t prio, const uint32_t size, const bool get) {
+    unsigned __int128 scaled;
+    uint64_t distance;
+    int32_t k;
+
+    pthread_mutex_lock(&mrc_lock);
+    /* The threshold may have dropped since the caller looked. */
+    if (prio >= mrc_threshold) {
+        pthread_mutex_unlock(&mrc_lock);
+        return;
+    }
+
+    k = table_find(prio);
+    if (k >= 0 && get && size == 0 && keys[k].size == 0) {
+        /* Only ever missed: no cache size would have held it. */
+        gets++;
+        cold_misses++;
+        slot_release(k);
+        slot_take(k);
+    } else if (k >= 0) {
+        if (get) {
+            /* Bytes of the keys accessed since, and of the key itself. */
+            distance = total_bytes - fenwick_sum(keys[k].slot + 1) +
+                (size > 0 ? size : keys[k].size);
+            scaled = ((unsigned __int128)distance << 32) / mrc_threshold;
+            distance = scaled > UINT64_MAX ? UINT64_MAX : scaled;
+            hist[latency_bucket(distance)]++;
+            gets++;
+        }
+        slot_release(k);
+        if (size > 0)
+            keys[k].size = size;
+        slot_take(k);
+    } else {
+        if (get) {
+            gets++;
+            cold_misses++;
+        }
+        k = free_keys[--nfree];
+        keys[k].prio = prio;
+        keys[k].size = size;
+        table_insert(k);
+        heap[nkeys] = k;
+        heap_up(nkeys++);
+        slot_take(k);
+        if (nkeys > max_keys)
+            drop_top();
+    }
+    pthread_mutex_unlock(&mrc_lock);
+}
+
+void mrc_get_stats(mrc_stats_t *ms, uint64_t *hits) {
+    pthread_mutex_lock(&mrc_lock);
+    ms->sample_rate = (double)mrc_threshold / 4294967296.0;
+    ms->keys = nkeys;
+    ms->max_keys = max_keys;
+    ms->gets = gets;
+    ms->cold_misses = cold_misses;
+    memcpy(hits, hist, sizeof(hist));
+    pthread_mutex_unlock(&mrc_lock);
+}
+
+void mrc_reset(void) {
+    pthread_mutex_lock(&mrc_lock);
+    memset(hist, 0, sizeof(hist));
+    gets = 0;
+    cold_misses = 0;
+    pthread_mutex_unlock(&mrc_lock);
+}
@@ -0,0 +1,67 @@
+#ifndef MRC_H
+#define MRC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Miss ratio curve estimation after SHARDS (Waldspurger et al., FAST '15):
+ * the hit ratio an LRU cache of any size would have had on the gets seen
+ * so far.
+ *
+ * A key is sampled when a hash of its hash value falls below a threshold,
+ * so a sampled key has every one of its accesses seen. For each sampled get
+ * the sampler measures the reuse distance, the bytes of distinct sampled
+ * keys accessed since the last access to the same key, and scales it by
+ * the sampling rate. A cache holds the key at that get if and only if it
+ * is larger than that distance.
+ *
+ * The sample is capped at a fixed number of keys: when it is full, the
+ * key with the highest hash leaves and the threshold drops to its hash, so
+ * the rate adapts to the number of distinct keys.
+ */
+
+// Size the sampler for a cache of maxbytes
+void mrc_init(const size_t maxbytes);
+
+extern uint32_t mrc_threshold;
+
+void mrc_access(const uint32_t prio, const uint32_t size, const bool get);
+
+static inline uint32_t mrc_priority(uint32_t hv) {
+    /* hv decides the hashtable bucket too; mix it so the sample isn't a
+       set of buckets. */
+    hv ^= hv >> 16;
+    hv *= 0x85ebca6b;
+    hv ^= hv >> 13;
+    hv *= 0xc2b2ae35;
+    hv ^= hv >> 16;
+    return hv;
+}
+
+// A get of the key with hash value hv, finding an item of size bytes or,
+// with size 0, missing; or a set of an item of size bytes
+static inline void mrc_record(const uint32_t hv, const uint32_t size, const bool get) {
+    uint32_t prio = mrc_priority(hv);
+
+    if (prio < __atomic_load_n(&mrc_threshold, __ATOMIC_RELAXED))
+        mrc_access(prio, size, get);
+}
+
+typedef struct {
+    double sample_rate;
+    unsigned int keys;          /* keys in the sample */
+    unsigned int max_keys;
+    uint64_t gets;              /* sampled gets */
+    uint64_t cold_misses;       /* of keys never seen stored before */
+} mrc_stats_t;
+
+// Sampler state, and in hits[b] the sampled gets with a scaled reuse
+// distance in latency_bucket() b, in bytes rather than nanoseconds here
+void mrc_get_stats(mrc_stats_t *ms, uint64_t *hits);
+
+// Forget the gets counted so far, keeping the sample
+void mrc_reset(void);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef PROTOCOL_BINARY_H
+#define PROTOCOL_BINARY_H
+
+#include <stdint.h>
+
+/*
+ * Wire format of the memcached binary protocol. Every packet starts with a
+ * fixed 24-byte header giving the lengths of the extras, key and value that
+ * follow it, in that order. Multi-byte fields are in network byte order.
+ */
+
+#define PROTOCOL_BINARY_REQ 0x80
+#define PROTOCOL_BINARY_RES 0x81
+
+typedef enum {
+    PROTOCOL_BINARY_RESPONSE_SUCCESS = 0x00,
+    PROTOCOL_BINARY_RESPONSE_KEY_ENOENT = 0x01,
+    PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS = 0x02,
+    PROTOCOL_BINARY_RESPONSE_E2BIG = 0x03,
+    PROTOCOL_BINARY_RESPONSE_EINVAL = 0x04,
+    PROTOCOL_BINARY_RESPONSE_NOT_STORED = 0x05,
+    PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND = 0x81,
+    PROTOCOL_BINARY_RESPONSE_ENOMEM = 0x82
+} protocol_binary_response_status;
+
+/*
+ * The subset of commands we serve. The Q variants are quiet: GETQ and
+ * GETKQ say nothing on a miss, SETQ and DELETEQ nothing on success.
+ */
+typedef enum {
+    PROTOCOL_BINARY_CMD_GET = 0x00,
+    PROTOCOL_BINARY_CMD_SET = 0x01,
+    PROTOCOL_BINARY_CMD_DELETE = 0x04,
+    PROTOCOL_BINARY_CMD_QUIT = 0x07,
+    PROTOCOL_BINARY_CMD_GETQ = 0x09,
+    PROTOCOL_BINARY_CMD_NOOP = 0x0a,
+    PROTOCOL_BINARY_CMD_GETK = 0x0c,
+    PROTOCOL_BINARY_CMD_GETKQ = 0x0d,
+    PROTOCOL_BINARY_CMD_STAT = 0x10,
+    PROTOCOL_BINARY_CMD_SETQ = 0x11,
+    PROTOCOL_BINARY_CMD_DELETEQ = 0x14,
+    PROTOCOL_BINARY_CMD_QUITQ = 0x17
+} protocol_binary_command;
+
+typedef struct {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t keylen;
+    uint8_t extlen;
+    uint8_t datatype;
+    uint16_t vbucket;   /* unused */
+    uint32_t bodylen;   /* extras + key + value */
+    uint32_t opaque;    /* copied into the response untouched */
+    uint64_t cas;
+} protocol_binary_request_header;
+
+typedef struct {
+    uint8_t magic;
+    uint8_t opcode;
+    uint16_t keylen;
+    uint8_t extlen;
+    uint8_t datatype;
+    uint16_t status;
+    uint32_t bodylen;
+    uint32_t opaque;
+    uint64_t cas;
+} protocol_binary_response_header;
+
+_Static_assert(sizeof(protocol_binary_request_header) == 24,
+               "binary request header must be 24 bytes");
+_Static_assert(sizeof(protocol_binary_response_header) == 24,
+               "binary response header must be 24 bytes");
+
+/* Extras of a SET request. */
+typedef struct {
+    uint32_t flags;
+    uint32_t expiration;
+} protocol_binary_request_set_extras;
+
+#endif
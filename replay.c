@@ -0,0 +1,437 @@
+/*
+ * Replays a command trace captured with -T (see trace.h), to try a cache
+ * configuration on real traffic.
+ *
+ * By default the trace is fed straight into an engine set up in this
+ * process, through item_get() and item_alloc() as the server's commands
+ * are. The engine's clock follows the trace's timestamps and the LRU
+ * maintainer runs in step with the records rather than in a thread of its
+ * own, so replaying a trace with the same options gives the same hits and
+ * evictions every time. With -p the records go to a running server
+ * instead, pipelined on one connection, and evictions are read from its
+ * stats.
+ *
+ * Records are replayed as fast as they can be, or with -x at the recorded
+ * pace or a multiple of it. A sampled trace holds 1/sample of the keys, so
+ * the engine gets 1/sample of the memory asked for with -m.
+ *
+ * Keys are rebuilt from their hashes: 16 hex digits, cut or padded to the
+ * recorded length but never shorter than 8 bytes. Values are filler.
+ *
+ * Build: make replay
+ * Usage: replay [-m megabytes] [-f factor] [-e policy] [-A admission]
+ *               [-x speed] [-s host] [-p port] [-q depth] trace 2>/dev/null
+ *
+ * The engine's startup messages go to stderr.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "simple_memcached.h"
+#include "client.h"
+
+#define KEY_MIN_LENGTH 8
+#define READ_RECORDS 4096
+
+/* Engine mode runs the LRU maintainer once per this many records. */
+#define MAINTAIN_EVERY 64
+
+/* Socket mode drains the pipeline once this much is queued. */
+#define PIPELINE_BYTES 65536
+
+typedef struct {
+    uint64_t records;
+    uint64_t gets;
+    uint64_t sets;
+    uint64_t deletes;
+    uint64_t hits;
+    uint64_t traced_hits;       /* gets the server that captured found */
+    uint64_t errors;            /* socket mode: error replies */
+} replay_stats_t;
+
+static size_t megabytes = 64;
+static double speed = 0;        /* multiple of the recorded pace, 0 for none */
+static const char *host = "127.0.0.1";
+static int port = 0;            /* 0 for engine mode */
+static int depth = 16;
+
+static trace_header_t header;
+static replay_stats_t rs;
+static uint64_t start_ns;
+
+static char *value;             /* filler for sets over sockets */
+static size_t value_size;
+
+/* Gets, sets and deletes in the pipeline, in order. */
+static uint8_t *pipeline_ops;
+static int pipeline_n;
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t make_key(char *key, const trace_record_t *r) {
+    size_t nkey = r->nkey > KEY_MIN_LENGTH ? r->nkey : KEY_MIN_LENGTH;
+    char hex[17];
+
+    snprintf(hex, sizeof(hex), "%016lx", r->key);
+    memset(key, '-', nkey);
+    memcpy(key, hex, nkey < 16 ? nkey : 16);
+    return nkey;
+}
+
+/* Nanoseconds until r is due, 0 if it is. */
+static uint64_t time_to_wait(const trace_record_t *r) {
+    uint64_t due, now;
+
+    if (speed <= 0)
+        return 0;
+    due = start_ns + (uint64_t)(r->time_ns / speed);
+    now = now_nsec();
+    return due > now ? due - now : 0;
+}
+
+static void sleep_nsec(const uint64_t ns) {
+    struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+    nanosleep(&ts, NULL);
+}
+
+/******************************* ENGINE MODE ********************************/
+
+static void engine_start(enum lru_policy_type policy, enum admission_type admission,
+                         double factor) {
+    engine_settings_default();
+    settings.maxbytes = megabytes * 1024 * 1024 / header.sample;
+    if (settings.maxbytes < MEM_LIMIT_MIN) {
+        fprintf(stderr, "%zu MB sampled 1 in %u is below the minimum, using %d MB\n",
+                megabytes, header.sample, MEM_LIMIT_MIN / (1024 * 1024));
+        settings.maxbytes = MEM_LIMIT_MIN;
+    }
+    settings.factor = factor;
+    settings.num_threads = 1;
+    settings.lru_policy = policy;
+    settings.admission = admission;
+
+    if (engine_init(NULL) != 0)
+        exit(1);
+    /* Only moves items between tables, which changes no result. */
+    if (start_hash_maintenance_thread() != 0)
+        exit(1);
+    current_time = TIME_BASE;
+}
+
+/* The engine's expiry time for a set's exptime, as sent. */
+static rel_time_t engine_exptime(const int32_t exptime) {
+    if (exptime == 0)
+        return 0;
+    if (exptime < 0)
+        return 1;           /* already past */
+    if (exptime > REALTIME_MAXDELTA) {
+        if ((uint64_t)exptime <= header.start_time)
+            return 1;
+        return exptime - header.start_time + TIME_BASE;
+    }
+    return exptime + current_time;
+}
+
+static bool engine_get(const char *key, const size_t nkey) {
+    item *it = item_get(key, nkey);
+
+    if (it == NULL)
+        return false;
+    item_remove(it);
+    return true;
+}
+
+static void engine_set(char *key, const size_t nkey, const trace_record_t *r) {
+    bool rejected;
+    item *it = item_alloc(key, nkey, 0, engine_exptime(r->exptime),
+                          r->nbytes + 2, &rejected);
+
+    if (it == NULL) {
+        item_unlink_key(key, nkey);
+        return;
+    }
+    memcpy(ITEM_data(it) + r->nbytes, "\r\n", 2);
+    item_store(it);
+    item_remove(it);
+}
+
+static void engine_replay(const trace_record_t *r) {
+    char key[KEY_MAX_LENGTH];
+    size_t nkey = make_key(key, r);
+    uint64_t wait = time_to_wait(r);
+
+    rel_time_t now = TIME_BASE + r->time_ns / 1000000000;
+
+    if (wait > 0)
+        sleep_nsec(wait);
+    /* Buffers of different threads overlap a little in time. */
+    if (now > current_time)
+        current_time = now;
+
+    switch (r->op) {
+    case TRACE_GET:
+        rs.hits += engine_get(key, nkey);
+        break;
+    case TRACE_SET:
+        engine_set(key, nkey, r);
+        break;
+    case TRACE_DELETE:
+        item_unlink_key(key, nkey);
+        break;
+    }
+    if (rs.records % MAINTAIN_EVERY == 0)
+        item_lru_maintain();
+}
+
+/******************************* SOCKET MODE ********************************/
+
+/* The server's evictions counter, or 0 if it can't be had. */
+static uint64_t server_evictions(mc_conn_t *c) {
+    uint64_t evictions = 0;
+    mc_reply_t r;
+
+    if (mc_queue_stats(c) != 0 || mc_flush(c) != 0)
+        return 0;
+    while (mc_read_reply(c, &r) == 1 && r.type == MC_REPLY_STAT) {
+        if (r.nkey == 9 && memcmp(r.key, "evictions", 9) == 0)
+            evictions = strtoull(r.value, NULL, 10);
+    }
+    return evictions;
+}
+
+/* Sends the queued records and reads their replies. */
+static int drain(mc_conn_t *c) {
+    mc_reply_t r;
+    int i, ret;
+
+    if (mc_flush(c) != 0)
+        return -1;
+    for (i = 0; i < pipeline_n; i++) {
+        bool found = false;
+
+        while ((ret = mc_read_reply(c, &r)) == 1 && r.type == MC_REPLY_VALUE)
+            found = true;
+        if (ret != 1)
+            return -1;
+        if (r.type == MC_REPLY_ERROR)
+            rs.errors++;
+        else if (pipeline_ops[i] == TRACE_GET)
+            rs.hits += found;
+    }
+    pipeline_n = 0;
+    return 0;
+}
+
+static int socket_replay(mc_conn_t *c, const trace_record_t *r) {
+    char key[KEY_MAX_LENGTH];
+    size_t nkey = make_key(key, r);
+    const char *keys[1] = { key };
+    uint64_t wait = time_to_wait(r);
+    int ret = -1;
+
+    /* Nothing sits in the pipeline while we wait. */
+    if (wait > 0) {
+        if (pipeline_n > 0 && drain(c) != 0)
+            return -1;
+        wait = time_to_wait(r);
+        if (wait > 0)
+            sleep_nsec(wait);
+    }
+
+    switch (r->op) {
+    case TRACE_GET:
+        ret = mc_queue_get(c, keys, &nkey, 1);
+        break;
+    case TRACE_SET:
+        if (r->nbytes > value_size) {
+            char *v = realloc(value, r->nbytes);
+
+            if (v == NULL)
+                return -1;
+            memset(v, 'v', r->nbytes);
+            value = v;
+            value_size = r->nbytes;
+        }
+        ret = mc_queue_set(c, key, nkey, 0, r->exptime, value, r->nbytes);
+        break;
+    case TRACE_DELETE:
+        ret = mc_queue_delete(c, key, nkey);
+        break;
+    }
+    if (ret != 0)
+        return -1;
+    pipeline_ops[pipeline_n++] = r->op;
+    if (pipeline_n == depth || c->wused >= PIPELINE_BYTES)
+        return drain(c);
+    return 0;
+}
+
+/********************************* DRIVER ***********************************/
+
+static void usage(void) {
+    printf("replay [options] trace\n"
+           "-m <num>      item memory in megabytes of the cache modelled; the\n"
+           "              engine gets 1/sample of it (default: 64)\n"
+           "-f <factor>   chunk size growth factor (default: %2.2f)\n"
+           "-e <name>     eviction policy: segmented, clock (default: segmented)\n"
+           "-A <name>     TinyLFU admission: none, reject, probation (default: none)\n"
+           "-x <speed>    replay at speed times the recorded pace; 0 for as fast\n"
+           "              as possible (default: 0)\n"
+           "-p <port>     send to a server on this port instead of replaying\n"
+           "              into an engine in this process\n"
+           "-s <host>     server host (default: 127.0.0.1)\n"
+           "-q <num>      requests pipelined to the server (default: 16)\n",
+           FACTOR_DEFAULT);
+}
+
+int main(int argc, char **argv) {
+    enum lru_policy_type policy = LRU_POLICY_SEGMENTED;
+    enum admission_type admission = ADMISSION_NONE;
+    double factor = FACTOR_DEFAULT;
+    trace_record_t *records;
+    uint64_t evictions, elapsed;
+    mc_conn_t *conn = NULL;
+    item_lru_stats_t ls;
+    size_t n, i;
+    FILE *f;
+    int c;
+
+    while (-1 != (c = getopt(argc, argv, "m:f:e:A:x:p:s:q:h"))) {
+        switch (c) {
+        case 'm':
+            megabytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            factor = atof(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "segmented") == 0) {
+                policy = LRU_POLICY_SEGMENTED;
+            } else if (strcmp(optarg, "clock") == 0) {
+                policy = LRU_POLICY_CLOCK;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'A':
+            if (strcmp(optarg, "none") == 0) {
+                admission = ADMISSION_NONE;
+            } else if (strcmp(optarg, "reject") == 0) {
+                admission = ADMISSION_REJECT;
+            } else if (strcmp(optarg, "probation") == 0) {
+                admission = ADMISSION_PROBATION;
+            } else {
+                usage();
+                return 1;
+            }
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            host = optarg;
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || megabytes == 0 || factor <= 1.0 || speed < 0 ||
+        depth <= 0) {
+        usage();
+        return 1;
+    }
+
+    if ((f = trace_open(argv[optind], &header)) == NULL)
+        return 1;
+    records = malloc(READ_RECORDS * sizeof(trace_record_t));
+    pipeline_ops = malloc(depth);
+    if (records == NULL || pipeline_ops == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    if (port == 0) {
+        engine_start(policy, admission, factor);
+    } else if ((conn = mc_connect(host, port)) == NULL) {
+        fprintf(stderr, "can't connect to %s:%d\n", host, port);
+        return 1;
+    }
+    evictions = conn != NULL ? server_evictions(conn) : 0;
+
+    start_ns = now_nsec();
+    while ((n = fread(records, sizeof(trace_record_t), READ_RECORDS, f)) > 0) {
+        for (i = 0; i < n; i++) {
+            const trace_record_t *r = &records[i];
+
+            rs.records++;
+            if (r->op == TRACE_GET) {
+                rs.gets++;
+                rs.traced_hits += r->hit;
+            } else if (r->op == TRACE_SET) {
+                rs.sets++;
+            } else if (r->op == TRACE_DELETE) {
+                rs.deletes++;
+            } else {
+                continue;
+            }
+            if (conn == NULL) {
+                engine_replay(r);
+            } else if (socket_replay(conn, r) != 0) {
+                fprintf(stderr, "connection failed\n");
+                return 1;
+            }
+        }
+    }
+    if (conn != NULL && pipeline_n > 0 && drain(conn) != 0) {
+        fprintf(stderr, "connection failed\n");
+        return 1;
+    }
+    elapsed = now_nsec() - start_ns;
+    fclose(f);
+    free(records);
+    free(pipeline_ops);
+    free(value);
+
+    if (conn != NULL) {
+        evictions = server_evictions(conn) - evictions;
+        mc_close(conn);
+    } else {
+        item_lru_get_stats(&ls);
+        evictions = ls.evictions;
+    }
+
+    printf("records    %lu in %.2fs: %.0f/s (gets %lu, sets %lu, deletes %lu)\n",
+           rs.records, elapsed / 1e9, rs.records * 1e9 / elapsed, rs.gets,
+           rs.sets, rs.deletes);
+    printf("hit ratio  %.4f (traced %.4f)\n",
+           rs.gets > 0 ? (double)rs.hits / rs.gets : 0.0,
+           rs.gets > 0 ? (double)rs.traced_hits / rs.gets : 0.0);
+    printf("evictions  %lu\n", evictions);
+    if (port == 0)
+        printf("expired    %lu reclaimed, %lu of them never fetched\n",
+               ls.expired_reclaimed, ls.expired_unfetched);
+    if (port != 0)
+        printf("errors     %lu\n", rs.errors);
+    return 0;
+}
@@ -1,337 +1,2150 @@
-
-#include <stdarg.h>
-#include <errno.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <time.h>
-#include <assert.h>
-#include <limits.h>
-#include <stddef.h>
-#include <stdbool.h>
-#include <stdint.h>
-#include "simple_memcached.h"
-
-
-#define COMMAND_TOKEN 0
-#define SUBCOMMAND_TOKEN 1
-#define KEY_TOKEN 1
-
-#define MAX_TOKENS 8
-
-typedef struct token_s {
-    char *value;
-    size_t length;
-} token_t;
-
-uint32_t hash(const char *key, const int nkey)
-{
-  const char *p;
-  int i;
-  uint32_t hv = 5381;
-
-  for(i = 0, p = key; i < nkey; p++, i++) {
-    hv = (hv << 5) + hv + *p;
-  }
-
-  return hv;
-}
-/*dsds*/
-
-/*
- * Tokenize the command string by replacing whitespace with '\0' and update
- * the token array tokens with pointer to start of each token and length.
- * Returns total number of tokens.  The last valid token is the terminal
- * token (value points to the first unprocessed character of the string and
- * length zero).
- *
- * Usage example:
- *
- *  while(tokenize_command(command, ncommand, tokens, max_tokens) > 0) {
- *      for(int ix = 0; tokens[ix].length != 0; ix++) {
- *          ...
- *      }
- *      ncommand = tokens[ix].value - command;
- *      command  = tokens[ix].value;
- *   }
- */
-
-static size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
-    char *s, *e;
-    size_t ntokens = 0;
-    size_t len = strlen(command);
-    unsigned int i = 0;
-
-    assert(command != NULL && tokens != NULL && max_tokens > 1);
-
-    s = e = command;
-    for (i = 0; i < len; i++) {
-        if (*e == ' ') {
-            if (s != e) {
-                tokens[ntokens].value = s;
-                tokens[ntokens].length = e - s;
-                ntokens++;
-                *e = '\0';
-                if (ntokens == max_tokens - 1) {
-                    e++;
-                    s = e; /* so we don't add an extra token */
-                    break;
-                }
-            }
-            s = e + 1;
-        }
-        e++;
-    }
-
-    if (s != e) {
-        tokens[ntokens].value = s;
-        tokens[ntokens].length = e - s;
-        ntokens++;
-    }
-
-    /*
-     * If we scanned the whole string, the terminal value pointer is null,
-     * otherwise it is the first unprocessed character.
-     */
-    tokens[ntokens].value =  *e == '\0' ? NULL : e;
-    tokens[ntokens].length = 0;
-    ntokens++;
-
-    return ntokens;
-}
-
-
-item * Command_process_set(token_t *tokens, stat* stats){
-
-    item* it;
-    if(tokens[KEY_TOKEN].length > 200){
-        fprintf(stderr, "The length for the key is too long\n");
-        return NULL;
-    }
-    else if(tokens[2].value !='0'){
-        fprintf(stderr, "Invalid flag\n" );
-        return NULL;
-    }
-    else if(tokens[3].value !='0' && atoi(tokens[3].value) == 0){
-        fprintf(stderr, "Invalid exptime\n" );
-        return NULL;
-    }
-    else if(atoi(tokens[4].value)==0){
-        fprintf(stderr, "Invaid nbytes\n" );
-        return NULL;
-    } 
-    else if(atoi(tokens[5].value)==0 && tokens[5].value !='0'){
-        fprintf(stderr, "Invalid values\n");
-        return NULL;
-    }
-    else{
-        it = item_alloc(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length, atoi(tokens[2].value), atoi(tokens[3].value), atoi(tokens[4].value), stats);
-        return it;
-    }
-}
-
-item * Command_process_get(token_t *tokens, stat* stats){
-
-    item* it;
-    if(tokens[KEY_TOKEN].length > 200){
-        fprintf(stderr, "The length for the key is too long\n");
-        return NULL;
-    }
-    else{
-        it = item_get(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length, stats);
-        return it;
-    }
-}
-
-
-void Command_process_delete(token_t *tokens, stat* stats){
-    if(tokens[KEY_TOKEN].length > 200){
-        fprintf(stderr, "The length for the key is too long\n" );
-        return;
-    }
-    else{
-        item* it;
-        it = item_get(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length, stats);
-        if(it ==NULL){
-            fprintf(stderr, "Invalid key value\n");
-            return;
-        }
-        else{
-            item_unlink(it);
-            return;
-        }
-    }   
-}
-
-
-void stat_print(stat* stats) {
-    printf("hash_power_value: %lu\n", stats->hash_power_value);
-    printf("slab_factor: %u\n", stats->slab_factor);
-
-    printf("current_bytes: %lu\n", stats->current_bytes);
-    printf("total_items: %lu\n", stats->total_items);
-    printf("current_items: %lu\n", stats->current_items);
-
-    printf("put_cmds: %lu\n", stats->put_cmds);
-    printf("put_hits: %lu\n", stats->put_hits);
-    printf("put_misses: %lu\n", stats->put_misses);
-
-    printf("get_cmds: %lu\n", stats->get_cmds);
-    printf("get_hits: %lu\n", stats->get_hits);
-    printf("get_misses: %lu\n", stats->get_misses);
-
-    printf("del_cmds: %lu\n", stats->del_cmds);
-    printf("del_hits: %lu\n", stats->del_hits);
-    printf("del_misses: %lu\n", stats->del_misses);
-
-}
-
-static stat* stats_initial(uint64_t hash_power_value){
-    stat* stats;
-    stat stats_ = {0, false, 0,0,0,0,0,0,0,0,0,0,0,0,0};
-    stats = &stats_;
-    stats->hash_power_value= hash_power_value ;
-    stats->slab_factor = 1.2 ;
-
-    if(stats != NULL ){
-        printf("Stats initialization success.\n");
-
-    }
-
-}
-
-void Command_process_stats(stat* stats){
-    stat_print(stats);
-    printf("Successful\n");
-    return;
-}
-
-
-item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbytes, stat* stats){
-    item* it;
-    it= do_item_alloc(key, nkey, flags, exptime, nbytes);
-    stats-> put_cmds++;
-    if (it !=NULL){
-        stats->current_items ++;
-        stats->put_hits ++;
-    }
-    else{
-        stats->put_misses ++;
-    }
-    return it;
-
-
-}
-
-item *item_get(const char *key, const size_t nkey, stat* stats){
-    item* it;
-    uint32_t hv = hash(key, nkey);
-    it = do_item_get(key, nkey, hv);
-    stats->get_cmds ++;
-    if(it !=NULL){
-        stats->get_hits ++;
-    }
-    else{
-        stats->get_misses ++;
-    }
-
-    return it;
-}
-
-item *item_touch(const char *key, const size_t nkey, uint32_t exptime){
-    item* it;
-    uint32_t hv = hash(key, nkey);
-    it = do_item_touch( key, nkey, exptime, hv);
-    return it;
-}
-
-int item_link(item *it , stat * stats){
-    uint32_t hv = hash(ITEM_key(it), it->nkey);
-    int link_success;
-    link_success = do_item_link(it, hv);
-    if(link_success == 1 || 2){
-        printf("Successful link an item\n");
-        stats->current_bytes += ITEM_ntotal(it);
-        stats->current_items += 1;
-        stats->total_items += 1;
-        if(link_success ==2){
-            stats->hash_power_value +=1;
-        }
-        return 1;
-    }
-    else{
-        return 0;
-    }
-}
-
-void  item_remove(item *it){
-      do_item_remove(it);
-
-}
-
-int item_replace(item *it, item *new_it, const uint32_t hv){
-    int ret;
-    ret= do_item_replace(it, new_it, hv);
-    if (ret){
-        printf("Successful replace an item\n");
-        return ret;
-    }
-    else{
-        return ret;
-    }
-}
-
-void  item_unlink(item *it){
-    uint32_t hv = hash(ITEM_key(it), it->nkey);
-    do_item_unlink(it, hv);
-}
-
-void  item_update(item *it){
-    do_item_update(it);
-}
-
-
-unsigned short refcount_incr(unsigned short *refcount) {
-    unsigned short res;
-    (*refcount)++;
-    res = *refcount;
-    return res;
-}
-
-unsigned short refcount_decr(unsigned short *refcount) {
-    unsigned short res;
-    (*refcount)--;
-    res = *refcount;
-     return res;
-
-}
-
-void hash_init(uint64_t hash_power_value, stat* stats){
-    do_hash_init(hash_power_value);
-    stats->hash_power_value =hash_power_value;
-}
-
-/*
- * We keep the current time of day in a global variable that's updated by a
- * timer event. This saves us a bunch of time() system calls (we really only
- * need to get the time once a second, whereas there can be tens of thousands
- * of requests a second) and allows us to use server-start-relative timestamps
- * rather than absolute UNIX timestamps, a space savings on systems where
- * sizeof(time_t) > sizeof(unsigned int).
- */
-volatile rel_time_t current_time;
-
-
-int main (int argc, char **argv) {
-    bool preallocate = false;
-    uint64_t maxbytes = MAX_BYTES_DEFAULT;
-    double factor = FACTOR_DEFAULT;
-    uint64_t hash_power_value = HASHPOWER_DEFAULT;
-    stat* stats;
-
-    printf("Welcome to simple_memcached\n");
-    stats = stats_initial(hash_power_value);
-    hash_init(hash_power_value, stats);
-    slabs_init(maxbytes, factor, preallocate);
-    return 0;
-}
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <pthread.h>
+#include "simple_memcached.h"
+#include "tokenize.h"
+
+
+#define COMMAND_TOKEN 0
+#define SUBCOMMAND_TOKEN 1
+#define KEY_TOKEN 1
+
+#define MAX_TOKENS 8
+
+
+/* Avoid warnings on solaris, where isspace() is an index into an array */
+static bool safe_strtol(const char *str, int32_t *out) {
+    char *endptr;
+    long l;
+    assert(out != NULL);
+    errno = 0;
+    *out = 0;
+    l = strtol(str, &endptr, 10);
+    if ((errno == ERANGE) || (str == endptr) || l > INT_MAX || l < INT_MIN) {
+        return false;
+    }
+
+    if (isspace(*endptr) || (*endptr == '\0' && endptr != str)) {
+        *out = l;
+        return true;
+    }
+    return false;
+}
+
+/* The Unix time current_time counts from. */
+static time_t process_started;
+
+static struct timespec clock_started;
+static pthread_t clock_tid;
+
+/*
+ * An item's expiry time for an exptime as clients send it: 0 for never,
+ * seconds from now up to REALTIME_MAXDELTA, a Unix time above, and already
+ * past if negative.
+ */
+static rel_time_t realtime(const int32_t exptime) {
+    if (exptime == 0)
+        return 0;
+    if (exptime < 0)
+        return 1;
+    if (exptime > REALTIME_MAXDELTA) {
+        if (exptime <= process_started)
+            return 1;
+        return exptime - process_started;
+    }
+    return exptime + current_time;
+}
+
+/*
+ * Ticks current_time once a second. It counts on the monotonic clock, read
+ * through the vDSO, so setting the time of day doesn't move expiry times;
+ * sleeping to absolute deadlines keeps the ticks from drifting.
+ */
+static void *clock_thread(void *arg) {
+    struct timespec now, next = clock_started;
+    time_t elapsed;
+
+    for (;;) {
+        next.tv_sec++;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+            ;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = now.tv_sec - clock_started.tv_sec -
+            (now.tv_nsec < clock_started.tv_nsec);
+        current_time = TIME_BASE + elapsed;
+        /* After a stall, the next tick is the next whole second, not the
+           ones missed. */
+        next.tv_sec = clock_started.tv_sec + elapsed;
+    }
+    return NULL;
+}
+
+static int start_clock_thread(void) {
+    int ret;
+
+    process_started = time(NULL) - TIME_BASE;
+    clock_gettime(CLOCK_MONOTONIC, &clock_started);
+    current_time = TIME_BASE;
+    if ((ret = pthread_create(&clock_tid, NULL, clock_thread, NULL)) != 0) {
+        fprintf(stderr, "Can't create clock thread: %s\n", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+static int curr_conns = 0;
+static uint64_t conn_yields = 0;    /* times a pipelining client gave up its turn */
+
+static void conn_set_state(conn *c, enum conn_states state);
+static bool add_bin_header(conn *c, const uint16_t status, const uint8_t extlen,
+                           const uint16_t keylen, const uint32_t bodylen);
+
+/*
+ * A reply is a list of iovecs written with one writev(): text we generate
+ * is appended to wbuf, large values are pointed at where they lie in their
+ * item. wbuf only grows until everything queued has been written, then
+ * the pinned items are released and it starts over.
+ */
+
+static bool add_iov(conn *c, const char *buf, int len) {
+    if (c->iovused == c->iovsize) {
+        struct iovec *new_iov = realloc(c->iov, sizeof(struct iovec) * c->iovsize * 2);
+
+        if (new_iov == NULL)
+            return false;
+        c->iov = new_iov;
+        c->iovsize *= 2;
+    }
+
+    c->iov[c->iovused].iov_base = (void *)buf;
+    c->iov[c->iovused].iov_len = len;
+    c->iovused++;
+    c->wbytes += len;
+    return true;
+}
+
+/*
+ * Appends len bytes of buf to the connection's output buffer, growing it if
+ * needed. Returns false if we ran out of memory.
+ */
+static bool add_output(conn *c, const char *buf, int len) {
+    struct iovec *last;
+    char *tail;
+
+    if (c->wused + len > c->wsize) {
+        uintptr_t old_wbuf = (uintptr_t)c->wbuf;
+        int new_size = c->wsize;
+        char *new_wbuf;
+        int i;
+
+        while (c->wused + len > new_size)
+            new_size *= 2;
+        new_wbuf = realloc(c->wbuf, new_size);
+        if (new_wbuf == NULL)
+            return false;
+
+        /* Queued pieces of wbuf move with it. */
+        for (i = c->iovcurr; i < c->iovused; i++) {
+            uintptr_t off = (uintptr_t)c->iov[i].iov_base - old_wbuf;
+
+            if (off < (uintptr_t)c->wused)
+                c->iov[i].iov_base = new_wbuf + off;
+        }
+        c->wbuf = new_wbuf;
+        c->wsize = new_size;
+    }
+
+    tail = c->wbuf + c->wused;
+    memcpy(tail, buf, len);
+    c->wused += len;
+
+    /* Text right after the last piece just extends it. */
+    if (c->iovused > c->iovcurr) {
+        last = &c->iov[c->iovused - 1];
+        if ((char *)last->iov_base + last->iov_len == tail) {
+            last->iov_len += len;
+            c->wbytes += len;
+            return true;
+        }
+    }
+    return add_iov(c, tail, len);
+}
+
+/*
+ * Queues len bytes at buf, inside it, taking over the caller's reference
+ * to it. Values of ITEM_ZEROCOPY_MIN bytes or more aren't copied: the iovec
+ * points into the item, which stays pinned until they have been written.
+ */
+static bool add_item_output(conn *c, item *it, const char *buf, int len) {
+    bool queued;
+
+    if (len < ITEM_ZEROCOPY_MIN) {
+        queued = add_output(c, buf, len);
+        item_remove(it);
+        return queued;
+    }
+
+    if (c->ileft == c->isize) {
+        item **new_ilist = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+
+        if (new_ilist == NULL) {
+            item_remove(it);
+            return false;
+        }
+        c->ilist = new_ilist;
+        c->isize *= 2;
+    }
+    if (!add_iov(c, buf, len)) {
+        item_remove(it);
+        return false;
+    }
+    c->ilist[c->ileft++] = it;
+    return true;
+}
+
+/* Once a reply has been written: drops its items and empties wbuf. */
+static void conn_release_output(conn *c) {
+    while (c->ileft > 0)
+        item_remove(c->ilist[--c->ileft]);
+    c->iovused = c->iovcurr = 0;
+    c->wused = c->wbytes = 0;
+}
+
+/*
+ * Queues a one-line reply (CRLF is appended) and switches the connection to
+ * the write state.
+ */
+static void out_string(conn *c, const char *str) {
+    if (settings.verbose > 1)
+        fprintf(stderr, ">%d %s\n", c->sfd, str);
+
+    if (!add_output(c, str, strlen(str)) || !add_output(c, "\r\n", 2)) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+
+    conn_set_state(c, conn_write);
+    c->write_and_go = conn_new_cmd;
+}
+
+static void Command_process_set(conn *c, token_t *tokens){
+
+    item* it;
+    char *key = tokens[KEY_TOKEN].value;
+    size_t nkey = tokens[KEY_TOKEN].length;
+    uint32_t flags;
+    int32_t exptime, vlen;
+    bool rejected;
+
+    c->cmd_start = latency_ticks();
+    if(nkey > KEY_MAX_LENGTH){
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    if (! (token_to_uint32(&tokens[2], &flags)
+           && token_to_int32(&tokens[3], &exptime)
+           && token_to_int32(&tokens[4], &vlen))) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    if (vlen < 0 || vlen > (INT_MAX - 2)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    vlen += 2;   /* the value is followed by \r\n */
+
+    it = item_alloc(key, nkey, flags, realtime(exptime), vlen, &rejected);
+    trace_command(TRACE_SET, key, nkey, vlen - 2, exptime, it != NULL);
+    if (it == NULL) {
+        if (! item_size_ok(nkey, flags, vlen))
+            out_string(c, "SERVER_ERROR object too large for cache");
+        else if (rejected)
+            out_string(c, "NOT_STORED");
+        else
+            out_string(c, "SERVER_ERROR out of memory storing object");
+        /* Avoid stale data persisting in cache because we failed alloc. */
+        item_unlink_key(key, nkey);
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen;
+        return;
+    }
+
+    c->item = it;
+    c->ritem = ITEM_data(it);
+    c->rlbytes = it->nbytes;
+    conn_set_state(c, conn_nread);
+}
+
+/*
+ * Queues a VALUE reply for every key found among the len bytes at keys,
+ * which are tokenized and looked up GET_BATCH_MAX at a time. Returns the
+ * error line to send instead of continuing, or NULL.
+ */
+static const char *process_get_keys(conn *c, char *keys, size_t len) {
+    token_t tokens[GET_BATCH_MAX + 1];
+    char *batch_keys[GET_BATCH_MAX];
+    size_t batch_nkeys[GET_BATCH_MAX];
+    item *its[GET_BATCH_MAX];
+    size_t ntokens;
+    int i, n;
+
+    for (;;) {
+        ntokens = tokenize_command(keys, len, tokens, GET_BATCH_MAX + 1);
+        n = ntokens - 1;
+        for (i = 0; i < n; i++) {
+            if (tokens[i].length > KEY_MAX_LENGTH)
+                return "CLIENT_ERROR bad command line format";
+            batch_keys[i] = tokens[i].value;
+            batch_nkeys[i] = tokens[i].length;
+        }
+
+        /* A lone key has no misses to overlap with. */
+        if (n == 1)
+            its[0] = item_get(batch_keys[0], batch_nkeys[0]);
+        else if (n > 1)
+            item_get_batch(batch_keys, batch_nkeys, n, its);
+        for (i = 0; i < n; i++)
+            trace_command(TRACE_GET, batch_keys[i], batch_nkeys[i], 0, 0, its[i] != NULL);
+
+        for (i = 0; i < n; i++) {
+            item *it = its[i];
+
+            if (it == NULL)
+                continue;
+            /* The suffix runs straight into the data. */
+            if (!add_output(c, "VALUE ", 6) ||
+                !add_output(c, ITEM_key(it), it->nkey)) {
+                item_remove(it);
+                it = NULL;
+            } else if (!add_item_output(c, it, ITEM_suffix(it),
+                                        it->nsuffix + it->nbytes)) {
+                it = NULL;
+            }
+            if (it == NULL) {
+                while (++i < n) {
+                    if (its[i] != NULL)
+                        item_remove(its[i]);
+                }
+                return "SERVER_ERROR out of memory writing get response";
+            }
+        }
+
+        /* A full batch stops early, leaving the rest of the line. */
+        if (tokens[n].value == NULL)
+            return NULL;
+        len -= tokens[n].value - keys;
+        keys = tokens[n].value;
+    }
+}
+
+static void Command_process_get(conn *c, char *keys, size_t len){
+    uint64_t start = latency_ticks();
+    const char *err = process_get_keys(c, keys, len);
+
+    out_string(c, err != NULL ? err : "END");
+    LATENCY_RECORD(LATENCY_GET, start);
+}
+
+
+/* Unlinks the item stored under key. Returns false if there was none. */
+static bool delete_key(const char *key, const size_t nkey) {
+    uint64_t start = latency_ticks();
+    bool found = item_unlink_key(key, nkey);
+
+    trace_command(TRACE_DELETE, key, nkey, 0, 0, found);
+    STATS_INCR(del_cmds);
+    if (found)
+        STATS_INCR(del_hits);
+    else
+        STATS_INCR(del_misses);
+    LATENCY_RECORD(LATENCY_DELETE, start);
+    return found;
+}
+
+static void Command_process_delete(conn *c, token_t *tokens){
+    if(tokens[KEY_TOKEN].length > KEY_MAX_LENGTH){
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    if (delete_key(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length))
+        out_string(c, "DELETED");
+    else
+        out_string(c, "NOT_FOUND");
+}
+
+
+static const char *slab_arena_names[] = { "malloc", "mmap", "thp", "hugetlb" };
+
+static void append_stat(conn *c, const char *name, const char *fmt, ...) {
+    char val_str[128];
+    char line[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    vsnprintf(val_str, sizeof(val_str), fmt, ap);
+    va_end(ap);
+
+    /* Binary clients get one packet per stat, keyed by its name. */
+    if (c->protocol == binary_prot) {
+        size_t nlen = strlen(name), vlen = strlen(val_str);
+
+        if (add_bin_header(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, nlen, nlen + vlen) &&
+            add_output(c, name, nlen))
+            add_output(c, val_str, vlen);
+        return;
+    }
+
+    len = snprintf(line, sizeof(line), "STAT %s %s\r\n", name, val_str);
+    add_output(c, line, len);
+}
+
+void stat_print(conn *c) {
+    rel_time_t now = current_time;
+    thread_stats_t ts;
+    hash_stats_t hs;
+    item_lru_stats_t ls;
+    slabs_rebalance_stats_t rs;
+    slabs_arena_stats_t as;
+
+    stats_since_reset(&ts);
+    hash_get_stats(&hs);
+    item_lru_get_stats(&ls);
+    slabs_get_rebalance_stats(&rs);
+    slabs_get_arena_stats(&as);
+    append_stat(c, "uptime", "%u", now - TIME_BASE);
+    append_stat(c, "time", "%ld", (long)(now + process_started));
+    append_stat(c, "hash_algorithm", "%s",
+                hash_algorithm_name(settings.hash_algorithm));
+    append_stat(c, "hash_index", "%s",
+                settings.hash_index == HASH_INDEX_BUCKETED ? "bucketed" : "chained");
+    append_stat(c, "hash_power_value", "%u", hs.hashpower);
+    append_stat(c, "hash_is_expanding", "%d", hs.expanding);
+    append_stat(c, "hash_items", "%u", hs.hash_items);
+    append_stat(c, "hash_expand_progress", "%u/%u",
+                hs.expand_bucket, hs.expand_buckets_total);
+    append_stat(c, "hash_expansions", "%lu", hs.expansions);
+    append_stat(c, "hash_expand_last_usec", "%lu", hs.expand_last_usec);
+    append_stat(c, "hash_expand_max_step_usec", "%lu", hs.expand_max_step_usec);
+    append_stat(c, "hash_overflow_buckets", "%u", hs.overflow_buckets);
+    append_stat(c, "hash_bytes", "%lu", hs.bytes);
+    append_stat(c, "slab_factor", "%.2f", settings.factor);
+    append_stat(c, "slab_automove", "%d", settings.slab_automove);
+    append_stat(c, "slab_reassign_running", "%d", rs.running);
+    append_stat(c, "slabs_moved", "%lu", rs.slabs_moved);
+    append_stat(c, "slab_reassign_rescues", "%lu", rs.rescues);
+    append_stat(c, "slab_reassign_evictions", "%lu", rs.evictions);
+    append_stat(c, "slab_reassign_busy_items", "%lu", rs.busy_items);
+    append_stat(c, "slab_compact", "%d", settings.slab_compact);
+    append_stat(c, "slabs_compacted", "%lu", rs.slabs_compacted);
+    append_stat(c, "slabs_released", "%lu", rs.slabs_released);
+    append_stat(c, "limit_maxbytes", "%lu", rs.mem_limit);
+    append_stat(c, "total_malloced", "%lu", rs.mem_malloced);
+    append_stat(c, "slab_arena", "%s", slab_arena_names[as.type]);
+    append_stat(c, "slab_arena_page_size", "%lu", as.page_size);
+    append_stat(c, "slab_arena_huge_bytes", "%lu", as.huge_bytes);
+    append_stat(c, "numa_policy", "%s",
+                settings.numa_policy == NUMA_POLICY_INTERLEAVE ? "interleave" :
+                settings.numa_policy == NUMA_POLICY_BIND ? "bind" : "none");
+    append_stat(c, "lru_policy", "%s",
+                settings.lru_policy == LRU_POLICY_CLOCK ? "clock" : "segmented");
+    append_stat(c, "lru_hot_items", "%lu", ls.hot_items);
+    append_stat(c, "lru_warm_items", "%lu", ls.warm_items);
+    append_stat(c, "lru_cold_items", "%lu", ls.cold_items);
+    append_stat(c, "lru_moves_to_cold", "%lu", ls.moves_to_cold);
+    append_stat(c, "lru_moves_to_warm", "%lu", ls.moves_to_warm);
+    append_stat(c, "lru_moves_within_warm", "%lu", ls.moves_within_warm);
+    append_stat(c, "lru_clock_second_chances", "%lu", ls.clock_second_chances);
+    append_stat(c, "evictions", "%lu", ls.evictions);
+    append_stat(c, "expired_reclaimed", "%lu", ls.expired_reclaimed);
+    append_stat(c, "expired_unfetched", "%lu", ls.expired_unfetched);
+    append_stat(c, "lru_crawler_sweeps", "%lu", ls.crawler_sweeps);
+    append_stat(c, "lru_crawler_reclaimed", "%lu", ls.crawler_reclaimed);
+    if (settings.admission != ADMISSION_NONE) {
+        append_stat(c, "admission", "%s",
+                    settings.admission == ADMISSION_REJECT ? "reject" : "probation");
+        append_stat(c, "admission_admitted", "%lu", ls.admission_admitted);
+        append_stat(c, "admission_rejected", "%lu", ls.admission_rejected);
+        append_stat(c, "admission_probation", "%lu", ls.admission_probation);
+        append_stat(c, "admission_sketch_resets", "%lu", tinylfu_resets());
+    }
+    if (settings.trace_file != NULL) {
+        uint64_t records, dropped;
+
+        trace_get_stats(&records, &dropped);
+        append_stat(c, "trace_active", "%d", trace_active);
+        append_stat(c, "trace_sample", "%u", settings.trace_sample);
+        append_stat(c, "trace_records", "%lu", records);
+        append_stat(c, "trace_dropped", "%lu", dropped);
+    }
+
+    append_stat(c, "current_bytes", "%ld", (int64_t)ts.current_bytes);
+    append_stat(c, "total_items", "%lu", ts.total_items);
+    append_stat(c, "current_items", "%u", hs.hash_items);
+
+    append_stat(c, "put_cmds", "%lu", ts.put_cmds);
+    append_stat(c, "put_hits", "%lu", ts.put_hits);
+    append_stat(c, "put_misses", "%lu", ts.put_misses);
+
+    append_stat(c, "get_cmds", "%lu", ts.get_cmds);
+    append_stat(c, "get_hits", "%lu", ts.get_hits);
+    append_stat(c, "get_misses", "%lu", ts.get_misses);
+    append_stat(c, "get_batches", "%lu", ts.get_batches);
+    append_stat(c, "get_batch_keys", "%lu", ts.get_batch_keys);
+
+    append_stat(c, "del_cmds", "%lu", ts.del_cmds);
+    append_stat(c, "del_hits", "%lu", ts.del_hits);
+    append_stat(c, "del_misses", "%lu", ts.del_misses);
+
+    append_stat(c, "curr_connections", "%d",
+                __atomic_load_n(&curr_conns, __ATOMIC_RELAXED));
+    append_stat(c, "threads", "%d", settings.num_threads);
+    append_stat(c, "reqs_per_event", "%d", settings.reqs_per_event);
+    append_stat(c, "conn_yields", "%lu",
+                __atomic_load_n(&conn_yields, __ATOMIC_RELAXED));
+}
+
+static void Command_process_stats(conn *c){
+    stat_print(c);
+    out_string(c, "END");
+}
+
+/*
+ * Latency percentiles since the last reset, in nanoseconds, then the raw
+ * histogram: one <op>_bucket_<low>_<high> line per non-empty bucket.
+ */
+void stat_print_latency(conn *c) {
+    static const struct { const char *name; double q; } quantiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 },
+        { "max", 1.0 }
+    };
+    thread_stats_t ts;
+    char name[80];
+    unsigned int op, b, i;
+
+    stats_since_reset(&ts);
+    for (op = 0; op < LATENCY_OPS; op++) {
+        const latency_hist_t *h = &ts.latency[op];
+        const char *opname = latency_op_names[op];
+        uint64_t count = latency_count(h);
+
+        snprintf(name, sizeof(name), "%s_count", opname);
+        append_stat(c, name, "%lu", count);
+        snprintf(name, sizeof(name), "%s_mean_ns", opname);
+        append_stat(c, name, "%lu", count > 0 ? h->sum_ns / count : 0);
+        for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            snprintf(name, sizeof(name), "%s_%s_ns", opname, quantiles[i].name);
+            append_stat(c, name, "%lu", latency_quantile(h, quantiles[i].q));
+        }
+    }
+    for (op = 0; op < LATENCY_OPS; op++) {
+        for (b = 0; b < LATENCY_BUCKETS; b++) {
+            if (ts.latency[op].buckets[b] == 0)
+                continue;
+            if (b == LATENCY_BUCKETS - 1)
+                snprintf(name, sizeof(name), "%s_bucket_%lu_inf",
+                         latency_op_names[op], latency_bucket_low(b));
+            else
+                snprintf(name, sizeof(name), "%s_bucket_%lu_%lu",
+                         latency_op_names[op], latency_bucket_low(b),
+                         latency_bucket_high(b));
+            append_stat(c, name, "%lu", ts.latency[op].buckets[b]);
+        }
+    }
+}
+
+/*
+ * Estimated hit ratio of an LRU cache by size, from the gets sampled since
+ * the last reset: an mrc_hit_ratio_<bytes> line at every quarter of a power
+ * of two where the estimate went up. Sizes count item bytes, not the slab
+ * chunks they take.
+ */
+void stat_print_mrc(conn *c) {
+    uint64_t hits[LATENCY_BUCKETS], seen = 0, printed = 0, at_limit = 0;
+    mrc_stats_t ms;
+    char name[64];
+    unsigned int b;
+
+    mrc_get_stats(&ms, hits);
+    append_stat(c, "mrc_sample_rate", "%.6f", ms.sample_rate);
+    append_stat(c, "mrc_keys", "%u", ms.keys);
+    append_stat(c, "mrc_max_keys", "%u", ms.max_keys);
+    append_stat(c, "mrc_gets", "%lu", ms.gets);
+    append_stat(c, "mrc_cold_misses", "%lu", ms.cold_misses);
+    if (ms.gets == 0)
+        return;
+    /* The last bucket has no upper bound to name a size by. */
+    for (b = 0; b < LATENCY_BUCKETS - 1; b++) {
+        seen += hits[b];
+        if (latency_bucket_high(b) < settings.maxbytes)
+            at_limit = seen;
+        if (seen == printed || (b + 1) % (LATENCY_SUB_BUCKETS / 4) != 0)
+            continue;
+        printed = seen;
+        snprintf(name, sizeof(name), "mrc_hit_ratio_%lu", latency_bucket_high(b) + 1);
+        append_stat(c, name, "%.4f", (double)seen / ms.gets);
+    }
+    append_stat(c, "mrc_hit_ratio_limit_maxbytes", "%.4f", (double)at_limit / ms.gets);
+}
+
+static void Command_process_stats_mrc(conn *c){
+    stat_print_mrc(c);
+    out_string(c, "END");
+}
+
+static void Command_process_stats_latency(conn *c){
+    stat_print_latency(c);
+    out_string(c, "END");
+}
+
+/* Counters start over from zero; gauges such as current_bytes are kept. */
+static void Command_process_stats_reset(conn *c){
+    stats_reset();
+    out_string(c, "RESET");
+}
+
+static void Command_process_slabs_reassign(conn *c, token_t *tokens) {
+    int32_t src, dst;
+
+    if (!token_to_int32(&tokens[2], &src) ||
+        !token_to_int32(&tokens[3], &dst)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    switch (slabs_reassign(src, dst)) {
+    case REASSIGN_OK:
+        out_string(c, "OK");
+        break;
+    case REASSIGN_RUNNING:
+        out_string(c, "BUSY currently processing reassign request");
+        break;
+    case REASSIGN_BADCLASS:
+        out_string(c, "BADCLASS invalid src or dst class id");
+        break;
+    case REASSIGN_NOSPARE:
+        out_string(c, "NOSPARE source class has no spare pages");
+        break;
+    case REASSIGN_SRC_DST_SAME:
+        out_string(c, "SAME src and dst class are identical");
+        break;
+    }
+}
+
+static void Command_process_memlimit(conn *c, token_t *tokens) {
+    uint64_t limit;
+
+    if (!token_to_uint64(&tokens[1], &limit)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    if (limit != 0 && limit < MEM_LIMIT_MIN) {
+        out_string(c, "CLIENT_ERROR memory limit too small");
+        return;
+    }
+
+    settings.maxbytes = limit;
+    slabs_set_mem_limit(limit);
+    out_string(c, "OK");
+}
+
+/* Captures restart into the -T file, replacing what it held. */
+static void Command_process_trace(conn *c, token_t *tokens) {
+    char msg[128];
+
+    if (settings.trace_file == NULL) {
+        out_string(c, "SERVER_ERROR no trace file, see -T");
+    } else if (token_is(&tokens[1], "stop")) {
+        trace_stop();
+        out_string(c, "OK");
+    } else if (!token_is(&tokens[1], "start")) {
+        out_string(c, "ERROR");
+    } else if (trace_start(settings.trace_file, settings.trace_sample) == 0) {
+        out_string(c, "OK");
+    } else if (errno == EBUSY) {
+        out_string(c, "BUSY trace already running");
+    } else {
+        snprintf(msg, sizeof(msg), "SERVER_ERROR %s", strerror(errno));
+        out_string(c, msg);
+    }
+}
+
+/*
+ * Serves the command line of len bytes at command, without its line end.
+ * The line is left as it is in the read buffer, so it isn't NUL-terminated.
+ */
+static void process_command(conn *c, char *command, const size_t len) {
+
+    token_t tokens[MAX_TOKENS];
+    size_t ntokens;
+
+    assert(c != NULL);
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "<%d %.*s\n", c->sfd, (int)len, command);
+
+    ntokens = tokenize_command(command, len, tokens, MAX_TOKENS);
+    if (ntokens < 2) {
+        out_string(c, "ERROR");
+        return;
+    }
+
+    if (ntokens >= 3 && token_is(&tokens[COMMAND_TOKEN], "get")) {
+
+        Command_process_get(c, tokens[KEY_TOKEN].value,
+                            command + len - tokens[KEY_TOKEN].value);
+
+    } else if (ntokens == 6 && token_is(&tokens[COMMAND_TOKEN], "set")) {
+
+        Command_process_set(c, tokens);
+
+    } else if (ntokens == 3 && token_is(&tokens[COMMAND_TOKEN], "delete")) {
+
+        Command_process_delete(c, tokens);
+
+    } else if (ntokens == 2 && token_is(&tokens[COMMAND_TOKEN], "stats")) {
+
+        Command_process_stats(c);
+
+    } else if (ntokens == 3 && token_is(&tokens[COMMAND_TOKEN], "stats") &&
+               token_is(&tokens[1], "reset")) {
+
+        Command_process_stats_reset(c);
+
+    } else if (ntokens == 3 && token_is(&tokens[COMMAND_TOKEN], "stats") &&
+               token_is(&tokens[1], "latency")) {
+
+        Command_process_stats_latency(c);
+
+    } else if (ntokens == 3 && token_is(&tokens[COMMAND_TOKEN], "stats") &&
+               token_is(&tokens[1], "mrc")) {
+
+        Command_process_stats_mrc(c);
+
+    } else if (ntokens == 5 && token_is(&tokens[COMMAND_TOKEN], "slabs") &&
+               token_is(&tokens[1], "reassign")) {
+
+        Command_process_slabs_reassign(c, tokens);
+
+    } else if (ntokens == 3 && token_is(&tokens[COMMAND_TOKEN], "memlimit")) {
+
+        Command_process_memlimit(c, tokens);
+
+    } else if (ntokens == 3 && token_is(&tokens[COMMAND_TOKEN], "trace")) {
+
+        Command_process_trace(c, tokens);
+
+    } else if (ntokens == 2 && token_is(&tokens[COMMAND_TOKEN], "quit")) {
+
+        /* Replies still held back for earlier commands go out first. */
+        conn_set_state(c, conn_write);
+        c->write_and_go = conn_closing;
+
+    } else {
+        out_string(c, "ERROR");
+    }
+}
+
+
+/*
+ * Binary protocol, see protocol_binary.h. A request states the lengths of
+ * its parts up front, so nothing is scanned for delimiters: the extras and
+ * key are used straight out of the read buffer, and a SET value is read
+ * into the new item through conn_nread just like a text one.
+ */
+
+static bool add_bin_header(conn *c, const uint16_t status, const uint8_t extlen,
+                           const uint16_t keylen, const uint32_t bodylen) {
+    protocol_binary_response_header res;
+
+    memset(&res, 0, sizeof(res));
+    res.magic = PROTOCOL_BINARY_RES;
+    res.opcode = c->binary_header.opcode;
+    res.keylen = htons(keylen);
+    res.extlen = extlen;
+    res.status = htons(status);
+    res.bodylen = htonl(bodylen);
+    res.opaque = htonl(c->binary_header.opaque);
+    return add_output(c, (const char *)&res, sizeof(res));
+}
+
+/* Starts writing a response, or closes if it couldn't be queued. */
+static void write_bin_response(conn *c, const bool queued) {
+    if (!queued) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    conn_set_state(c, conn_write);
+    c->write_and_go = conn_new_cmd;
+}
+
+/*
+ * Answers with err and a short message, then throws away the swallow bytes
+ * of the request that are still unread. Errors are sent for quiet commands
+ * too.
+ */
+static void write_bin_error(conn *c, const protocol_binary_response_status err,
+                            const int swallow) {
+    const char *msg;
+    size_t len;
+
+    switch (err) {
+    case PROTOCOL_BINARY_RESPONSE_KEY_ENOENT:
+        msg = "Not found";
+        break;
+    case PROTOCOL_BINARY_RESPONSE_E2BIG:
+        msg = "Too large";
+        break;
+    case PROTOCOL_BINARY_RESPONSE_EINVAL:
+        msg = "Invalid arguments";
+        break;
+    case PROTOCOL_BINARY_RESPONSE_NOT_STORED:
+        msg = "Not stored";
+        break;
+    case PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND:
+        msg = "Unknown command";
+        break;
+    case PROTOCOL_BINARY_RESPONSE_ENOMEM:
+        msg = "Out of memory";
+        break;
+    default:
+        msg = "Error";
+        break;
+    }
+    len = strlen(msg);
+
+    if (settings.verbose > 1)
+        fprintf(stderr, ">%d %s\n", c->sfd, msg);
+
+    if (!add_bin_header(c, err, 0, 0, len) || !add_output(c, msg, len)) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    conn_set_state(c, conn_write);
+    if (swallow > 0) {
+        c->write_and_go = conn_swallow;
+        c->sbytes = swallow;
+    } else {
+        c->write_and_go = conn_new_cmd;
+    }
+}
+
+/* Empty success response; nothing at all for a quiet command. */
+static void write_bin_ok(conn *c) {
+    if (c->noreply) {
+        conn_set_state(c, conn_new_cmd);
+        return;
+    }
+    write_bin_response(c, add_bin_header(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, 0, 0));
+}
+
+static void process_bin_get(conn *c, const char *key, const size_t nkey) {
+    bool with_key = c->binary_header.opcode == PROTOCOL_BINARY_CMD_GETK ||
+                    c->binary_header.opcode == PROTOCOL_BINARY_CMD_GETKQ;
+    uint64_t start = latency_ticks();
+    uint32_t flags;
+    size_t nret;
+    bool queued;
+    item *it;
+
+    it = item_get(key, nkey);
+    trace_command(TRACE_GET, key, nkey, 0, 0, it != NULL);
+    if (it == NULL) {
+        if (c->noreply)
+            conn_set_state(c, conn_new_cmd);
+        else
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
+        LATENCY_RECORD(LATENCY_GET, start);
+        return;
+    }
+
+    /* Items keep their flags as text, in the suffix. */
+    flags = htonl(strtoul(ITEM_suffix(it), NULL, 10));
+    nret = with_key ? it->nkey : 0;
+    if (add_bin_header(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, sizeof(flags), nret,
+                       sizeof(flags) + nret + it->nbytes - 2) &&
+        add_output(c, (const char *)&flags, sizeof(flags)) &&
+        add_output(c, ITEM_key(it), nret)) {
+        queued = add_item_output(c, it, ITEM_data(it), it->nbytes - 2);
+    } else {
+        item_remove(it);
+        queued = false;
+    }
+    write_bin_response(c, queued);
+    LATENCY_RECORD(LATENCY_GET, start);
+}
+
+static void process_bin_update(conn *c, char *key, const size_t nkey,
+                               const char *extras, const int vlen) {
+    protocol_binary_request_set_extras ext;
+    uint32_t flags;
+    int32_t exptime;
+    bool rejected;
+    item *it;
+
+    c->cmd_start = latency_ticks();
+    memcpy(&ext, extras, sizeof(ext));
+    flags = ntohl(ext.flags);
+    exptime = (int32_t)ntohl(ext.expiration);
+
+    /* Binary values come without the \r\n items end with. */
+    it = item_alloc(key, nkey, flags, realtime(exptime), vlen + 2, &rejected);
+    trace_command(TRACE_SET, key, nkey, vlen, exptime, it != NULL);
+    if (it == NULL) {
+        protocol_binary_response_status err;
+
+        if (!item_size_ok(nkey, flags, vlen + 2))
+            err = PROTOCOL_BINARY_RESPONSE_E2BIG;
+        else if (rejected)
+            err = PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+        else
+            err = PROTOCOL_BINARY_RESPONSE_ENOMEM;
+        /* Avoid stale data persisting in cache because we failed alloc. */
+        item_unlink_key(key, nkey);
+        write_bin_error(c, err, vlen);
+        return;
+    }
+
+    c->item = it;
+    c->ritem = ITEM_data(it);
+    c->rlbytes = vlen;
+    conn_set_state(c, conn_nread);
+}
+
+static void process_bin_delete(conn *c, const char *key, const size_t nkey) {
+    if (delete_key(key, nkey))
+        write_bin_ok(c);
+    else
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0);
+}
+
+static void process_bin_stat(conn *c, const char *key, const size_t nkey) {
+    if (nkey == 5 && memcmp(key, "reset", 5) == 0) {
+        stats_reset();
+        write_bin_ok(c);
+        return;
+    }
+    if (nkey == 7 && memcmp(key, "latency", 7) == 0)
+        stat_print_latency(c);
+    else if (nkey == 3 && memcmp(key, "mrc", 3) == 0)
+        stat_print_mrc(c);
+    else
+        stat_print(c);
+    /* An empty packet ends the list. */
+    write_bin_response(c, add_bin_header(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, 0, 0));
+}
+
+/*
+ * Serves the binary request at rcurr once its header, extras and key are
+ * all buffered, consuming them; a SET value is left for conn_nread, and a
+ * value sent with any other command gets EINVAL and is swallowed. Returns
+ * 0 if more data is needed, like try_read_command().
+ */
+static int try_read_command_binary(conn *c) {
+    protocol_binary_request_header *req = &c->binary_header;
+    char *extras, *key;
+    int nkey, vlen;
+
+    if (c->rbytes < (int)sizeof(*req))
+        return 0;
+
+    memcpy(req, c->rcurr, sizeof(*req));
+    req->keylen = ntohs(req->keylen);
+    req->bodylen = ntohl(req->bodylen);
+    req->opaque = ntohl(req->opaque);
+    req->cas = be64toh(req->cas);
+
+    /* Past a malformed header we can't find the next request. */
+    if (req->magic != PROTOCOL_BINARY_REQ || req->bodylen > INT_MAX ||
+        (uint32_t)req->extlen + req->keylen > req->bodylen) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "<%d invalid binary request header\n", c->sfd);
+        conn_set_state(c, conn_closing);
+        return 1;
+    }
+
+    if (req->keylen > KEY_MAX_LENGTH) {
+        c->rcurr += sizeof(*req);
+        c->rbytes -= sizeof(*req);
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, req->bodylen);
+        return 1;
+    }
+    if (c->rbytes < (int)sizeof(*req) + req->extlen + req->keylen)
+        return 0;
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "<%d binary opcode 0x%02x, %u body bytes\n",
+                c->sfd, req->opcode, req->bodylen);
+
+    extras = c->rcurr + sizeof(*req);
+    key = extras + req->extlen;
+    nkey = req->keylen;
+    vlen = req->bodylen - req->extlen - nkey;
+    c->rcurr = key + nkey;
+    c->rbytes -= sizeof(*req) + req->extlen + nkey;
+    c->noreply = false;
+
+    switch (req->opcode) {
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+        c->noreply = true;
+        /* fall through */
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETK:
+        if (nkey == 0 || req->extlen != 0 || vlen != 0)
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, vlen);
+        else
+            process_bin_get(c, key, nkey);
+        break;
+
+    case PROTOCOL_BINARY_CMD_SETQ:
+        c->noreply = true;
+        /* fall through */
+    case PROTOCOL_BINARY_CMD_SET:
+        if (nkey == 0 || req->extlen != sizeof(protocol_binary_request_set_extras))
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, vlen);
+        else
+            process_bin_update(c, key, nkey, extras, vlen);
+        break;
+
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        c->noreply = true;
+        /* fall through */
+    case PROTOCOL_BINARY_CMD_DELETE:
+        if (nkey == 0 || req->extlen != 0 || vlen != 0)
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, vlen);
+        else
+            process_bin_delete(c, key, nkey);
+        break;
+
+    case PROTOCOL_BINARY_CMD_NOOP:
+        if (vlen != 0)
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, vlen);
+        else
+            write_bin_ok(c);
+        break;
+
+    case PROTOCOL_BINARY_CMD_STAT:
+        if (vlen != 0)
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, vlen);
+        else
+            process_bin_stat(c, key, nkey);
+        break;
+
+    case PROTOCOL_BINARY_CMD_QUITQ:
+        if (vlen != 0) {
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, vlen);
+            break;
+        }
+        conn_set_state(c, conn_write);
+        c->write_and_go = conn_closing;
+        break;
+
+    case PROTOCOL_BINARY_CMD_QUIT:
+        if (vlen != 0) {
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_EINVAL, vlen);
+            break;
+        }
+        write_bin_ok(c);
+        if (c->state == conn_write)
+            c->write_and_go = conn_closing;
+        break;
+
+    default:
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND, vlen);
+        break;
+    }
+    return 1;
+}
+
+
+
+/*
+ * Connection handling. Every socket, including the listening one, is a conn
+ * registered with an epoll instance; drive_machine() advances it through its
+ * states whenever epoll reports it ready, never blocking on the socket.
+ */
+
+enum try_read_result {
+    READ_DATA_RECEIVED,
+    READ_NO_DATA_RECEIVED,
+    READ_ERROR,            /** an error occurred (on the socket) (or client closed connection) */
+    READ_MEMORY_ERROR      /** failed to allocate more memory */
+};
+
+enum transmit_result {
+    TRANSMIT_COMPLETE,   /** All done writing. */
+    TRANSMIT_INCOMPLETE, /** More data remaining to write. */
+    TRANSMIT_SOFT_ERROR, /** Can't write any more right now. */
+    TRANSMIT_HARD_ERROR  /** Can't write (c->state is set to conn_closing) */
+};
+
+static const char *state_text(enum conn_states state) {
+    const char* const statenames[] = { "conn_listening",
+                                       "conn_new_cmd",
+                                       "conn_waiting",
+                                       "conn_read",
+                                       "conn_parse_cmd",
+                                       "conn_nread",
+                                       "conn_swallow",
+                                       "conn_write",
+                                       "conn_closing" };
+    return statenames[state];
+}
+
+static void conn_set_state(conn *c, enum conn_states state) {
+    assert(c != NULL);
+    assert(state >= conn_listening && state < conn_max_state);
+
+    if (state != c->state) {
+        if (settings.verbose > 2) {
+            fprintf(stderr, "%d: going from %s to %s\n",
+                    c->sfd, state_text(c->state),
+                    state_text(state));
+        }
+        c->state = state;
+    }
+}
+
+/*
+ * Changes the set of events epoll reports for this connection.
+ */
+static bool update_event(conn *c, const uint32_t new_flags) {
+    struct epoll_event ev;
+
+    assert(c != NULL);
+    if (c->ev_flags == new_flags)
+        return true;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = new_flags;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->sfd, &ev) == -1)
+        return false;
+    c->ev_flags = new_flags;
+    return true;
+}
+
+/* Frees a connection and its buffers, any of which may be NULL. */
+static void conn_free(conn *c) {
+    free(c->rbuf);
+    free(c->wbuf);
+    free(c->iov);
+    free(c->ilist);
+    free(c);
+}
+
+conn *conn_new(const int sfd, enum conn_states init_state, const int epfd,
+               worker_thread_t *thread) {
+    struct epoll_event ev;
+    conn *c = calloc(1, sizeof(conn));
+
+    if (c == NULL) {
+        fprintf(stderr, "Failed to allocate connection object\n");
+        return NULL;
+    }
+
+    c->rsize = c->wsize = DATA_BUFFER_SIZE;
+    c->iovsize = IOV_LIST_INITIAL;
+    c->isize = ITEM_LIST_INITIAL;
+    /* rsize doesn't count the tokenizer's padding. */
+    c->rbuf = malloc((size_t)c->rsize + TOKENIZE_PADDING);
+    c->wbuf = malloc((size_t)c->wsize);
+    c->iov = malloc(sizeof(struct iovec) * c->iovsize);
+    c->ilist = malloc(sizeof(item *) * c->isize);
+    if (c->rbuf == NULL || c->wbuf == NULL || c->iov == NULL || c->ilist == NULL) {
+        conn_free(c);
+        fprintf(stderr, "Failed to allocate buffers for connection\n");
+        return NULL;
+    }
+
+    c->sfd = sfd;
+    c->epfd = epfd;
+    c->state = init_state;
+    c->rcurr = c->rbuf;
+    c->write_and_go = init_state;
+    c->thread = thread;
+    c->protocol = negotiating_prot;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = c->ev_flags = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev) == -1) {
+        perror("epoll_ctl()");
+        conn_free(c);
+        return NULL;
+    }
+
+    if (init_state != conn_listening)
+        __sync_add_and_fetch(&curr_conns, 1);
+
+    if (settings.verbose > 1) {
+        if (init_state == conn_listening)
+            fprintf(stderr, "<%d server listening\n", sfd);
+        else
+            fprintf(stderr, "<%d new client connection\n", sfd);
+    }
+
+    return c;
+}
+
+static void conn_close(conn *c) {
+    assert(c != NULL);
+
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->sfd, NULL);
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "<%d connection closed.\n", c->sfd);
+
+    close(c->sfd);
+
+    if (c->item) {
+        item_remove(c->item);
+    }
+    conn_release_output(c);
+    if (c->state != conn_listening)
+        __sync_sub_and_fetch(&curr_conns, 1);
+
+    conn_free(c);
+}
+
+/*
+ * Shrinks a buffer that a single large request blew up back to its initial
+ * size, so idle connections don't pin memory.
+ */
+static void conn_shrink(conn *c) {
+    assert(c != NULL);
+
+    if (c->rsize > DATA_BUFFER_SIZE * 8 && c->rbytes < DATA_BUFFER_SIZE) {
+        char *newbuf;
+
+        if (c->rcurr != c->rbuf)
+            memmove(c->rbuf, c->rcurr, (size_t)c->rbytes);
+
+        newbuf = (char *)realloc((void *)c->rbuf, DATA_BUFFER_SIZE + TOKENIZE_PADDING);
+
+        if (newbuf) {
+            c->rbuf = newbuf;
+            c->rsize = DATA_BUFFER_SIZE;
+        }
+        /* If realloc failed, the big buffer stays and is tried again next
+           time; either way the unread bytes are at its start now. */
+        c->rcurr = c->rbuf;
+    }
+
+    if (c->wsize > DATA_BUFFER_SIZE * 8 && c->wbytes == 0) {
+        char *newbuf = (char *)realloc((void *)c->wbuf, DATA_BUFFER_SIZE);
+
+        if (newbuf) {
+            c->wbuf = newbuf;
+            c->wsize = DATA_BUFFER_SIZE;
+        }
+    }
+
+    if (c->iovsize > IOV_LIST_INITIAL * 8 && c->wbytes == 0) {
+        struct iovec *newiov = realloc(c->iov, sizeof(struct iovec) * IOV_LIST_INITIAL);
+
+        if (newiov) {
+            c->iov = newiov;
+            c->iovsize = IOV_LIST_INITIAL;
+        }
+    }
+
+    if (c->isize > ITEM_LIST_INITIAL * 8 && c->ileft == 0) {
+        item **newlist = realloc(c->ilist, sizeof(item *) * ITEM_LIST_INITIAL);
+
+        if (newlist) {
+            c->ilist = newlist;
+            c->isize = ITEM_LIST_INITIAL;
+        }
+    }
+}
+
+static void reset_cmd_handler(conn *c) {
+    if (c->item != NULL) {
+        item_remove(c->item);
+        c->item = NULL;
+    }
+    conn_shrink(c);
+    if (c->rbytes > 0) {
+        conn_set_state(c, conn_parse_cmd);
+    } else {
+        conn_set_state(c, conn_waiting);
+    }
+}
+
+/*
+ * Called once the value of a set has been read in full.
+ */
+static void complete_nread(conn *c) {
+    item *it = c->item;
+
+    assert(c != NULL);
+
+    if (c->protocol == binary_prot) {
+        memcpy(ITEM_data(it) + it->nbytes - 2, "\r\n", 2);
+        if (item_store(it))
+            write_bin_ok(c);
+        else
+            write_bin_error(c, PROTOCOL_BINARY_RESPONSE_NOT_STORED, 0);
+    } else if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
+        out_string(c, "CLIENT_ERROR bad data chunk");
+    } else if (item_store(it)) {
+        out_string(c, "STORED");
+    } else {
+        out_string(c, "NOT_STORED");
+    }
+
+    item_remove(c->item);       /* release the reference from item_alloc */
+    c->item = NULL;
+    LATENCY_RECORD(LATENCY_SET, c->cmd_start);
+}
+
+/*
+ * if we have a complete line in the buffer, process it.
+ */
+static int try_read_command(conn *c) {
+    char *el, *cont;
+
+    assert(c != NULL);
+    assert(c->rcurr <= (c->rbuf + c->rsize));
+
+    if (c->rbytes == 0)
+        return 0;
+
+    if (c->protocol == negotiating_prot) {
+        c->protocol = (unsigned char)*c->rcurr == PROTOCOL_BINARY_REQ ?
+                      binary_prot : ascii_prot;
+        if (settings.verbose > 1)
+            fprintf(stderr, "<%d %s protocol\n", c->sfd,
+                    c->protocol == binary_prot ? "binary" : "text");
+    }
+    if (c->protocol == binary_prot)
+        return try_read_command_binary(c);
+
+    el = memchr(c->rcurr, '\n', c->rbytes);
+    if (!el) {
+        if (c->rbytes > KEY_MAX_LINE) {
+            /*
+             * We didn't have a '\n' in the first few k. This _has_ to be a
+             * large multiget, if not we should just nuke the connection.
+             * A multiget is served up to its last complete key, and "get "
+             * is written in front of the rest, which stays in the buffer.
+             */
+            char *last = memrchr(c->rcurr, ' ', c->rbytes);
+
+            if (memcmp(c->rcurr, "get ", 4) == 0 && last > c->rcurr + 3) {
+                const char *err = process_get_keys(c, c->rcurr + 4,
+                                                   last - (c->rcurr + 4));
+                if (err != NULL) {
+                    out_string(c, err);
+                    c->write_and_go = conn_closing;
+                    return 1;
+                }
+                last -= 3;
+                memcpy(last, "get ", 4);
+                c->rbytes -= last - c->rcurr;
+                c->rcurr = last;
+                return 0;
+            }
+
+            if (settings.verbose > 0)
+                fprintf(stderr, "<%d command line too long\n", c->sfd);
+            conn_set_state(c, conn_closing);
+            return 1;
+        }
+
+        return 0;
+    }
+    cont = el + 1;
+    if ((el - c->rcurr) > 1 && *(el - 1) == '\r') {
+        el--;
+    }
+
+    assert(cont <= (c->rcurr + c->rbytes));
+
+    process_command(c, c->rcurr, el - c->rcurr);
+
+    c->rbytes -= (cont - c->rcurr);
+    c->rcurr = cont;
+
+    assert(c->rcurr <= (c->rbuf + c->rsize));
+
+    return 1;
+}
+
+/*
+ * read from network as much as we can, handle buffer overflow and connection
+ * close.
+ * before reading, move the remaining incomplete fragment of a command
+ * (if any) to the beginning of the buffer.
+ *
+ * To protect us from someone flooding a connection with bogus data causing
+ * the connection to eat up all available memory, break out and start looking
+ * at the data I've got after a number of reallocs...
+ */
+static enum try_read_result try_read_network(conn *c) {
+    enum try_read_result gotdata = READ_NO_DATA_RECEIVED;
+    int res;
+    int num_allocs = 0;
+    assert(c != NULL);
+
+    if (c->rcurr != c->rbuf) {
+        if (c->rbytes != 0) /* otherwise there's nothing to copy */
+            memmove(c->rbuf, c->rcurr, c->rbytes);
+        c->rcurr = c->rbuf;
+    }
+
+    while (1) {
+        if (c->rbytes >= c->rsize) {
+            if (num_allocs == 4) {
+                return gotdata;
+            }
+            ++num_allocs;
+            char *new_rbuf = realloc(c->rbuf, c->rsize * 2 + TOKENIZE_PADDING);
+            if (!new_rbuf) {
+                if (settings.verbose > 0)
+                    fprintf(stderr, "Couldn't realloc input buffer\n");
+                c->rbytes = 0; /* ignore what we read */
+                out_string(c, "SERVER_ERROR out of memory reading request");
+                c->write_and_go = conn_closing;
+                return READ_MEMORY_ERROR;
+            }
+            c->rcurr = c->rbuf = new_rbuf;
+            c->rsize *= 2;
+        }
+
+        int avail = c->rsize - c->rbytes;
+        res = read(c->sfd, c->rbuf + c->rbytes, avail);
+        if (res > 0) {
+            gotdata = READ_DATA_RECEIVED;
+            c->rbytes += res;
+            if (res == avail) {
+                continue;
+            } else {
+                break;
+            }
+        }
+        if (res == 0) {
+            return READ_ERROR;
+        }
+        if (res == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return READ_ERROR;
+        }
+    }
+    return gotdata;
+}
+
+/*
+ * Writes as much of the pending output as the socket will take, releasing
+ * the items it pinned once all of it is out.
+ */
+static enum transmit_result transmit(conn *c) {
+    ssize_t res;
+
+    assert(c != NULL);
+
+    if (c->wbytes == 0) {
+        conn_release_output(c);
+        return TRANSMIT_COMPLETE;
+    }
+
+    res = writev(c->sfd, c->iov + c->iovcurr,
+                 c->iovused - c->iovcurr > IOV_MAX ? IOV_MAX : c->iovused - c->iovcurr);
+    if (res > 0) {
+        c->wbytes -= res;
+        if (c->wbytes == 0) {
+            conn_release_output(c);
+            return TRANSMIT_COMPLETE;
+        }
+        /* Skip the pieces that went out, trimming one written in part. */
+        while (res > 0) {
+            struct iovec *v = &c->iov[c->iovcurr];
+
+            if ((size_t)res < v->iov_len) {
+                v->iov_base = (char *)v->iov_base + res;
+                v->iov_len -= res;
+                break;
+            }
+            res -= v->iov_len;
+            c->iovcurr++;
+        }
+        return TRANSMIT_INCOMPLETE;
+    }
+    if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (!update_event(c, EPOLLOUT)) {
+            if (settings.verbose > 0)
+                fprintf(stderr, "Couldn't update event\n");
+            conn_set_state(c, conn_closing);
+            return TRANSMIT_HARD_ERROR;
+        }
+        return TRANSMIT_SOFT_ERROR;
+    }
+    /* if res == 0 or res == -1 and error is not EAGAIN or EWOULDBLOCK,
+       we have a real error, on which we close the connection */
+    if (settings.verbose > 0)
+        perror("Failed to write, and not due to blocking");
+
+    conn_set_state(c, conn_closing);
+    return TRANSMIT_HARD_ERROR;
+}
+
+/*
+ * Pipelined commands are served back to back from the read buffer. The
+ * reply to each one is held back in wbuf while the next is complete and
+ * the batch is still small, so a whole batch of replies leaves in a single
+ * write. After reqs_per_event commands the connection yields: epoll is
+ * asked for writability, which comes back at once, but behind the other
+ * connections that are ready.
+ */
+static void drive_machine(conn *c) {
+    bool stop = false;
+    int nreqs = settings.reqs_per_event;
+    int sfd;
+    int res;
+    const char *str;
+
+    assert(c != NULL);
+
+    while (!stop) {
+
+        switch(c->state) {
+        case conn_listening:
+            sfd = accept4(c->sfd, NULL, NULL, SOCK_NONBLOCK);
+            if (sfd == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    if (errno == EMFILE) {
+                        if (settings.verbose > 0)
+                            fprintf(stderr, "Too many open connections\n");
+                    } else {
+                        perror("accept()");
+                    }
+                }
+                stop = true;
+                break;
+            }
+
+            if (__atomic_load_n(&curr_conns, __ATOMIC_RELAXED) >= settings.maxconns) {
+                str = "ERROR Too many open connections\r\n";
+                res = write(sfd, str, strlen(str));
+                close(sfd);
+            } else {
+                dispatch_conn_new(sfd, conn_new_cmd);
+            }
+            break;
+
+        case conn_waiting:
+            /* Held back replies go out before we sleep. */
+            if (c->wbytes > 0) {
+                conn_set_state(c, conn_write);
+                c->write_and_go = conn_waiting;
+                break;
+            }
+
+            if (!update_event(c, EPOLLIN)) {
+                if (settings.verbose > 0)
+                    fprintf(stderr, "Couldn't update event\n");
+                conn_set_state(c, conn_closing);
+                break;
+            }
+
+            conn_set_state(c, conn_read);
+            stop = true;
+            break;
+
+        case conn_read:
+            res = try_read_network(c);
+
+            switch (res) {
+            case READ_NO_DATA_RECEIVED:
+                conn_set_state(c, conn_waiting);
+                break;
+            case READ_DATA_RECEIVED:
+                conn_set_state(c, conn_parse_cmd);
+                break;
+            case READ_ERROR:
+                conn_set_state(c, conn_closing);
+                break;
+            case READ_MEMORY_ERROR: /* Failed to allocate more memory */
+                /* State already set by try_read_network */
+                break;
+            }
+            break;
+
+        case conn_parse_cmd :
+            if (try_read_command(c) == 0) {
+                /* we need more data! */
+                conn_set_state(c, conn_waiting);
+            }
+
+            break;
+
+        case conn_new_cmd:
+            if (--nreqs >= 0) {
+                reset_cmd_handler(c);
+                break;
+            }
+
+            if (c->rbytes > 0 || c->wbytes > 0) {
+                if (!update_event(c, EPOLLOUT)) {
+                    if (settings.verbose > 0)
+                        fprintf(stderr, "Couldn't update event\n");
+                    conn_set_state(c, conn_closing);
+                    break;
+                }
+                __atomic_add_fetch(&conn_yields, 1, __ATOMIC_RELAXED);
+            }
+            stop = true;
+            break;
+
+        case conn_nread:
+            if (c->rlbytes == 0) {
+                complete_nread(c);
+                break;
+            }
+
+            /* first check if we have leftovers in the conn_read buffer */
+            if (c->rbytes > 0) {
+                int tocopy = c->rbytes > c->rlbytes ? c->rlbytes : c->rbytes;
+                if (c->ritem != c->rcurr) {
+                    memmove(c->ritem, c->rcurr, tocopy);
+                }
+                c->ritem += tocopy;
+                c->rlbytes -= tocopy;
+                c->rcurr += tocopy;
+                c->rbytes -= tocopy;
+                if (c->rlbytes == 0) {
+                    break;
+                }
+            }
+
+            /*  now try reading from the socket */
+            res = read(c->sfd, c->ritem, c->rlbytes);
+            if (res > 0) {
+                c->ritem += res;
+                c->rlbytes -= res;
+                break;
+            }
+            if (res == 0) { /* end of stream */
+                conn_set_state(c, conn_closing);
+                break;
+            }
+            if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!update_event(c, EPOLLIN)) {
+                    if (settings.verbose > 0)
+                        fprintf(stderr, "Couldn't update event\n");
+                    conn_set_state(c, conn_closing);
+                    break;
+                }
+                stop = true;
+                break;
+            }
+            /* otherwise we have a real error, on which we close the connection */
+            if (settings.verbose > 0) {
+                fprintf(stderr, "Failed to read, and not due to blocking:\n"
+                        "errno: %d %s \n"
+                        "rcurr=%lx ritem=%lx rbuf=%lx rlbytes=%d rsize=%d\n",
+                        errno, strerror(errno),
+                        (long)c->rcurr, (long)c->ritem, (long)c->rbuf,
+                        (int)c->rlbytes, (int)c->rsize);
+            }
+            conn_set_state(c, conn_closing);
+            break;
+
+        case conn_swallow:
+            /* we are reading sbytes and throwing them away */
+            if (c->sbytes == 0) {
+                conn_set_state(c, conn_new_cmd);
+                break;
+            }
+
+            /* first check if we have leftovers in the conn_read buffer */
+            if (c->rbytes > 0) {
+                int tocopy = c->rbytes > c->sbytes ? c->sbytes : c->rbytes;
+                c->sbytes -= tocopy;
+                c->rcurr += tocopy;
+                c->rbytes -= tocopy;
+                break;
+            }
+
+            /*  now try reading from the socket */
+            res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
+            if (res > 0) {
+                c->sbytes -= res;
+                break;
+            }
+            if (res == 0) { /* end of stream */
+                conn_set_state(c, conn_closing);
+                break;
+            }
+            if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (!update_event(c, EPOLLIN)) {
+                    if (settings.verbose > 0)
+                        fprintf(stderr, "Couldn't update event\n");
+                    conn_set_state(c, conn_closing);
+                    break;
+                }
+                stop = true;
+                break;
+            }
+            /* otherwise we have a real error, on which we close the connection */
+            if (settings.verbose > 0)
+                fprintf(stderr, "Failed to read, and not due to blocking\n");
+            conn_set_state(c, conn_closing);
+            break;
+
+        case conn_write:
+            if (c->write_and_go == conn_new_cmd && c->rbytes > 0 && nreqs > 0 &&
+                c->wbytes < WRITE_BATCH_BYTES) {
+                conn_set_state(c, conn_new_cmd);
+                break;
+            }
+
+            switch (transmit(c)) {
+            case TRANSMIT_COMPLETE:
+                conn_set_state(c, c->write_and_go);
+                break;
+
+            case TRANSMIT_INCOMPLETE:
+            case TRANSMIT_HARD_ERROR:
+                break;                   /* Continue in state machine. */
+
+            case TRANSMIT_SOFT_ERROR:
+                stop = true;
+                break;
+            }
+            break;
+
+        case conn_closing:
+            conn_close(c);
+            stop = true;
+            break;
+
+        case conn_max_state:
+            assert(false);
+            break;
+        }
+    }
+}
+
+static int server_socket(const char *interface, int port, const int epfd) {
+    int sfd;
+    struct addrinfo *ai;
+    struct addrinfo *next;
+    struct addrinfo hints = { .ai_flags = AI_PASSIVE,
+                              .ai_family = AF_UNSPEC,
+                              .ai_socktype = SOCK_STREAM };
+    char port_buf[NI_MAXSERV];
+    int error;
+    int success = 0;
+    int flags = 1;
+
+    snprintf(port_buf, sizeof(port_buf), "%d", port);
+    error = getaddrinfo(interface, port_buf, &hints, &ai);
+    if (error != 0) {
+        if (error != EAI_SYSTEM)
+            fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+        else
+            perror("getaddrinfo()");
+        return 1;
+    }
+
+    for (next = ai; next; next = next->ai_next) {
+        conn *listen_conn;
+
+        sfd = socket(next->ai_family, next->ai_socktype | SOCK_NONBLOCK,
+                     next->ai_protocol);
+        if (sfd == -1) {
+            /* getaddrinfo can return "junk" addresses,
+             * we make sure at least one works before erroring.
+             */
+            continue;
+        }
+
+#ifdef IPV6_V6ONLY
+        if (next->ai_family == AF_INET6) {
+            error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+            if (error != 0) {
+                perror("setsockopt");
+                close(sfd);
+                continue;
+            }
+        }
+#endif
+
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+        setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+
+        if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1) {
+            if (errno != EADDRINUSE) {
+                perror("bind()");
+                close(sfd);
+                freeaddrinfo(ai);
+                return 1;
+            }
+            close(sfd);
+            continue;
+        }
+        if (listen(sfd, settings.backlog) == -1) {
+            perror("listen()");
+            close(sfd);
+            freeaddrinfo(ai);
+            return 1;
+        }
+
+        if (!(listen_conn = conn_new(sfd, conn_listening, epfd, NULL))) {
+            fprintf(stderr, "failed to create listening connection\n");
+            exit(EXIT_FAILURE);
+        }
+        success++;
+    }
+
+    freeaddrinfo(ai);
+
+    /* Return zero iff we detected no errors in starting up connections */
+    return success == 0;
+}
+
+/*
+ * Waits for readiness on every registered connection and runs each ready
+ * one through its state machine. An event with a NULL data pointer is the
+ * owning thread's notify pipe and is passed to notify(arg). Never returns.
+ */
+void event_loop(const int epfd, void (*notify)(void *), void *arg) {
+    struct epoll_event events[EVENTS_PER_WAIT];
+    int i, n;
+
+    for (;;) {
+        n = epoll_wait(epfd, events, EVENTS_PER_WAIT, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait()");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                notify(arg);
+            } else {
+                drive_machine((conn *)events[i].data.ptr);
+            }
+        }
+    }
+}
+
+/*
+ * Startup time per phase, printed once the server is listening so a slow
+ * cold start can be pinned on the phase responsible.
+ */
+#define STARTUP_PHASES_MAX 8
+static struct {
+    const char *name;
+    double msec;
+} startup_phases[STARTUP_PHASES_MAX];
+static int startup_nphases = 0;
+static struct timespec startup_last;
+
+static void startup_phase_done(const char *name) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (name != NULL && startup_nphases < STARTUP_PHASES_MAX) {
+        startup_phases[startup_nphases].name = name;
+        startup_phases[startup_nphases].msec =
+            (now.tv_sec - startup_last.tv_sec) * 1e3 +
+            (now.tv_nsec - startup_last.tv_nsec) / 1e6;
+        startup_nphases++;
+    }
+    startup_last = now;
+}
+
+static void startup_report(void) {
+    double total = 0;
+    int i;
+
+    for (i = 0; i < startup_nphases; i++)
+        total += startup_phases[i].msec;
+    fprintf(stderr, "Startup took %.1f ms:", total);
+    for (i = 0; i < startup_nphases; i++)
+        fprintf(stderr, "%s %s %.1f", i ? "," : "", startup_phases[i].name,
+                startup_phases[i].msec);
+    fprintf(stderr, " ms\n");
+}
+
+static void usage(void) {
+    printf("simple_memcached\n"
+           "-p <num>      TCP port number to listen on (default: %d)\n"
+           "-l <addr>     interface to listen on (default: INADDR_ANY)\n"
+           "-c <num>      max simultaneous connections (default: %d)\n"
+           "-m <num>      item memory in megabytes (default: %lu)\n"
+           "-f <factor>   chunk size growth factor (default: %2.2f)\n"
+           "-H <num>      initial hash table power (default: %d)\n"
+           "-b <num>      listen backlog (default: %d)\n"
+           "-t <num>      number of worker threads to use (default: %d)\n"
+           "-r <num>      pipelined commands a connection may run before\n"
+           "              yielding to other connections (default: %d)\n"
+           "-a <name>     key hash: djb, murmur3, xxh64, siphash (default: %s)\n"
+           "-i <name>     hashtable layout: chained, bucketed (default: chained)\n"
+           "-e <name>     eviction policy: segmented, clock (default: segmented)\n"
+           "-A <name>     TinyLFU admission when evicting: reject (drop the\n"
+           "              write) or probation (store it in COLD) (default: off)\n"
+           "-R            move slab pages to classes that keep evicting\n"
+           "-C            compact sparsely used slab pages and return them\n"
+           "              to the OS\n"
+           "-P <name>     item memory: malloc, mmap, thp, hugetlb; all but\n"
+           "              malloc map the whole limit at startup (default: malloc)\n"
+           "-N <policy>   NUMA placement of item memory: interleave, or a node\n"
+           "              number to bind to; implies -P mmap (default: none)\n"
+           "-L            preallocate all item memory at startup\n"
+           "-T <file>     capture gets, sets and deletes to file from startup;\n"
+           "              `trace stop` ends the capture, `trace start`\n"
+           "              starts it over\n"
+           "-S <num>      trace one key in num (default: 1)\n"
+           "-v            verbose (print errors/warnings while in event loop)\n"
+           "-vv           very verbose (also print client commands/responses)\n"
+           "-h            print this help and exit\n",
+           PORT_DEFAULT, MAXCONNS_DEFAULT,
+           (unsigned long)MAX_BYTES_DEFAULT / (1024 * 1024), FACTOR_DEFAULT,
+           HASHPOWER_DEFAULT, BACKLOG_DEFAULT, NUM_THREADS_DEFAULT, REQS_PER_EVENT_DEFAULT,
+           hash_algorithm_name(HASH_ALGORITHM_DEFAULT));
+}
+
+int main (int argc, char **argv) {
+    int c, i;
+    int epfd;
+    struct sigaction sa;
+
+    engine_settings_default();
+
+    while (-1 != (c = getopt(argc, argv, "p:l:c:m:f:H:b:t:r:a:i:e:A:RCP:N:LT:S:vh"))) {
+        switch (c) {
+        case 'p':
+            settings.port = atoi(optarg);
+            break;
+        case 'l':
+            settings.inter = strdup(optarg);
+            break;
+        case 'c':
+            settings.maxconns = atoi(optarg);
+            break;
+        case 'm':
+            settings.maxbytes = ((size_t)atoi(optarg)) * 1024 * 1024;
+            break;
+        case 'f':
+            settings.factor = atof(optarg);
+            if (settings.factor <= 1.0) {
+                fprintf(stderr, "Factor must be greater than 1\n");
+                return 1;
+            }
+            break;
+        case 'H':
+            settings.hashpower_init = atoi(optarg);
+            if (settings.hashpower_init < HASHPOWER_MIN ||
+                settings.hashpower_init > HASHPOWER_MAX) {
+                fprintf(stderr, "Initial hashtable power must be between %d and %d\n",
+                        HASHPOWER_MIN, HASHPOWER_MAX);
+                return 1;
+            }
+            break;
+        case 'b':
+            settings.backlog = atoi(optarg);
+            break;
+        case 't':
+            settings.num_threads = atoi(optarg);
+            if (settings.num_threads <= 0) {
+                fprintf(stderr, "Number of threads must be greater than 0\n");
+                return 1;
+            }
+            break;
+        case 'r':
+            settings.reqs_per_event = atoi(optarg);
+            if (settings.reqs_per_event <= 0) {
+                fprintf(stderr, "Number of requests per event must be greater than 0\n");
+                return 1;
+            }
+            break;
+        case 'a':
+            if (hash_algorithm_parse(optarg, &settings.hash_algorithm) != 0) {
+                fprintf(stderr, "Unknown hash algorithm: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "chained") == 0) {
+                settings.hash_index = HASH_INDEX_CHAINED;
+            } else if (strcmp(optarg, "bucketed") == 0) {
+                settings.hash_index = HASH_INDEX_BUCKETED;
+            } else {
+                fprintf(stderr, "Unknown hashtable layout: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (strcmp(optarg, "segmented") == 0) {
+                settings.lru_policy = LRU_POLICY_SEGMENTED;
+            } else if (strcmp(optarg, "clock") == 0) {
+                settings.lru_policy = LRU_POLICY_CLOCK;
+            } else {
+                fprintf(stderr, "Unknown eviction policy: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'A':
+            if (strcmp(optarg, "reject") == 0) {
+                settings.admission = ADMISSION_REJECT;
+            } else if (strcmp(optarg, "probation") == 0) {
+                settings.admission = ADMISSION_PROBATION;
+            } else {
+                fprintf(stderr, "Unknown admission mode: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            settings.slab_automove = true;
+            break;
+        case 'C':
+            settings.slab_compact = true;
+            break;
+        case 'P':
+            for (i = 0; i <= SLAB_ARENA_HUGETLB; i++) {
+                if (strcmp(optarg, slab_arena_names[i]) == 0)
+                    break;
+            }
+            if (i > SLAB_ARENA_HUGETLB) {
+                fprintf(stderr, "Unknown item memory type: %s\n", optarg);
+                return 1;
+            }
+            settings.slab_arena = i;
+            break;
+        case 'N':
+            if (strcmp(optarg, "interleave") == 0) {
+                settings.numa_policy = NUMA_POLICY_INTERLEAVE;
+            } else if (safe_strtol(optarg, &settings.numa_node) &&
+                       settings.numa_node >= 0 && settings.numa_node < 64) {
+                settings.numa_policy = NUMA_POLICY_BIND;
+            } else {
+                fprintf(stderr, "Unknown NUMA policy: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'L':
+            settings.preallocate = true;
+            break;
+        case 'T':
+            settings.trace_file = strdup(optarg);
+            break;
+        case 'S':
+            i = atoi(optarg);
+            if (i <= 0) {
+                fprintf(stderr, "Trace sample must be greater than 0\n");
+                return 1;
+            }
+            settings.trace_sample = i;
+            break;
+        case 'v':
+            settings.verbose++;
+            break;
+        case 'h':
+            usage();
+            exit(EXIT_SUCCESS);
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            return 1;
+        }
+    }
+
+    /*
+     * ignore SIGPIPE signals; we can use errno == EPIPE if we
+     * need that information
+     */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    if (sigemptyset(&sa.sa_mask) == -1 || sigaction(SIGPIPE, &sa, 0) == -1) {
+        perror("failed to ignore SIGPIPE; sigaction");
+        exit(EXIT_FAILURE);
+    }
+
+    /* A NUMA policy needs a mapping to apply to. */
+    if (settings.numa_policy != NUMA_POLICY_NONE &&
+        settings.slab_arena == SLAB_ARENA_MALLOC) {
+        settings.slab_arena = SLAB_ARENA_MMAP;
+    }
+
+    if (start_clock_thread() == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Welcome to simple_memcached\n");
+    if (engine_init(startup_phase_done) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    mrc_init(settings.maxbytes);
+
+    /* start up worker threads */
+    thread_init(settings.num_threads);
+
+    if (start_hash_maintenance_thread() == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (start_lru_maintainer_thread() == -1 ||
+        start_lru_crawler_thread() == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (start_slab_rebalance_thread() == -1) {
+        exit(EXIT_FAILURE);
+    }
+    startup_phase_done("threads");
+
+    epfd = epoll_create1(0);
+    if (epfd == -1) {
+        perror("epoll_create1()");
+        exit(EXIT_FAILURE);
+    }
+
+    if (server_socket(settings.inter, settings.port, epfd)) {
+        fprintf(stderr, "failed to listen on TCP port %d: %s\n",
+                settings.port, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    startup_phase_done("listen");
+    startup_report();
+
+    if (settings.trace_file != NULL &&
+        trace_start(settings.trace_file, settings.trace_sample) != 0) {
+        fprintf(stderr, "failed to start trace %s: %s\n",
+                settings.trace_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    event_loop(epfd, NULL, NULL);
+    return 0;
+}
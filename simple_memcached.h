@@ -1,136 +1,466 @@
-/** Maximum length of a key. */
-#define KEY_MAX_LENGTH 250
-
-/* Initial power multiplier for the hash table */
-#define HASHPOWER_DEFAULT 16
-/*
- * We only reposition items in the LRU queue if they haven't been repositioned
- * in this many seconds. That saves us from churning on frequently-accessed
- * items.
- */
-#define ITEM_UPDATE_INTERVAL 60
-
-/* Slab sizing definitions. */
-#define POWER_SMALLEST 1
-#define POWER_LARGEST  200
-#define CHUNK_ALIGN_BYTES 8
-#define MAX_NUMBER_OF_SLAB_CLASSES (POWER_LARGEST + 1)
-#define FACTOR_DEFAULT 1.25
-
-#define MAX_BYTES_DEFAULT 1024* 1024
-
-
-#define ITEM_key(item) (((char*)&((item)->data)) \
-         + ((item)->it_flags ? sizeof(uint64_t) : 0))
-
-#define ITEM_suffix(item) ((char*)&((item)->data) + (item)->nkey + 1 \
-         + ((item)->it_flags ? sizeof(uint64_t) : 0))
-
-#define ITEM_data(item) ((char*)&((item)->data) + (item)->nkey + 1 \
-         + (item)->nsuffix \
-         + ((item)->it_flags ? sizeof(uint64_t) : 0))
-
-#define ITEM_ntotal(item) (sizeof(struct _stritem) + (item)->nkey + 1 \
-         + (item)->nsuffix + (item)->nbytes \
-         + ((item)->it_flags ? sizeof(uint64_t) : 0))
-
-/** Time relative to server start. Smaller than time_t on 64-bit systems. */
-typedef unsigned int rel_time_t;
-
-/* current time of day (updated periodically) */
-extern volatile rel_time_t current_time;
-
-
-
-#define ITEM_LINKED 1
-
-/* temp */
-#define ITEM_SLABBED 4
-
-
-#define ITEM_FETCHED 8
-
-/**
- * Structure for storing items within memcached.
- */
-typedef struct _stritem {
-    struct _stritem *next;
-    struct _stritem *prev;
-    struct _stritem *h_next;    /* hash chain next */
-
-    rel_time_t      time;       /* least recent access */
-
-    rel_time_t      exptime;    /* expire time */
-
-    int             nbytes;     /* size of data */
-
-    unsigned short  refcount;
-
-    uint8_t         nsuffix;    /* length of flags-and-length string */
-    uint8_t         it_flags;   /* ITEM_* above */
-
-    uint8_t         slabs_clsid;/* which slab class we're in */
-
-    uint8_t         nkey;       /* key length, w/terminating null and padding */
-
-    char         data[];
-
-
-} item;
-
-typedef struct stat_{
-    
-    uint64_t hash_power_value;
-    bool hash_is_expanding;
-
-    uint8_t slab_factor;
-    
-
-    uint64_t current_bytes;
-    uint64_t total_items;
-    uint64_t current_items;
-
-    uint64_t put_cmds;
-    uint64_t put_hits;
-    uint64_t put_misses;
-
-    uint64_t get_cmds;
-    uint64_t get_hits;
-    uint64_t get_misses;
-
-    uint64_t del_cmds;
-    uint64_t del_hits;
-    uint64_t del_misses;
-
-} stat;
-
-
-
-
-
-
-
-
-#include "slab.h"
-#include "hash_functions.h"
-#include "items.h"
-
-
-uint32_t hash(const char *key, const int nkey);
-
-item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbytes, stat* stats );
-item *item_get(const char *key, const size_t nkey, stat* stats);
-item *item_touch(const char *key, const size_t nkey, uint32_t exptime);
-int   item_link(item *it, stat* stats);
-void  item_remove(item *it);
-int   item_replace(item *it, item *new_it, const uint32_t hv);
-void  item_unlink(item *it);
-void  item_update(item *it);
-
-unsigned short refcount_incr(unsigned short *refcount);
-unsigned short refcount_decr(unsigned short *refcount);
-
-void hash_init(uint64_t hash_power_value, stat* stats);
-
-
-
+/** Maximum length of a key. */
+#define KEY_MAX_LENGTH 250
+
+/* Initial power multiplier for the hash table */
+#define HASHPOWER_DEFAULT 16
+/*
+ * Largest the table gets: buckets are picked by the low bits of a 32-bit
+ * hash, and the load limit is a 32-bit count of items.
+ */
+#define HASHPOWER_MIN 12
+#define HASHPOWER_MAX 30
+/*
+ * We only reposition items in the LRU queue if they haven't been repositioned
+ * in this many seconds. That saves us from churning on frequently-accessed
+ * items.
+ */
+#define ITEM_UPDATE_INTERVAL 60
+
+/* Slab sizing definitions. */
+#define POWER_SMALLEST 1
+#define POWER_LARGEST  200
+#define CHUNK_ALIGN_BYTES 8
+#define MAX_NUMBER_OF_SLAB_CLASSES (POWER_LARGEST + 1)
+#define FACTOR_DEFAULT 1.25
+
+#define MAX_BYTES_DEFAULT 1024* 1024
+
+/* The memlimit command won't go below one slab page. */
+#define MEM_LIMIT_MIN 1048576
+
+/* Network defaults. */
+#define PORT_DEFAULT 11211
+#define MAXCONNS_DEFAULT 1024
+#define BACKLOG_DEFAULT 1024
+
+/*
+ * Pipelined commands one connection may run per event before the others get
+ * a turn, and the reply bytes it may hold back to send in one write.
+ */
+#define REQS_PER_EVENT_DEFAULT 20
+#define WRITE_BATCH_BYTES 65536
+
+/* Keys of a multi-get that are looked up together. */
+#define GET_BATCH_MAX 32
+
+/* Initial size of the per-connection read and write buffers. */
+#define DATA_BUFFER_SIZE 2048
+
+/* Initial number of reply pieces and pinned items per connection. */
+#define IOV_LIST_INITIAL 64
+#define ITEM_LIST_INITIAL 16
+
+/*
+ * Values at least this large are written straight from the item instead
+ * of being copied into the write buffer.
+ */
+#define ITEM_ZEROCOPY_MIN 1024
+
+/* A command line longer than this without a newline is a protocol error. */
+#define KEY_MAX_LINE 2048
+
+/* Number of events we ask epoll_wait for in one call. */
+#define EVENTS_PER_WAIT 64
+
+#define NUM_THREADS_DEFAULT 4
+
+#define HASH_ALGORITHM_DEFAULT MURMUR3_HASH
+
+#define HASH_INDEX_DEFAULT HASH_INDEX_CHAINED
+
+/* Share of a slab class's items kept in the HOT and WARM LRU segments. */
+#define HOT_LRU_PCT_DEFAULT 20
+#define WARM_LRU_PCT_DEFAULT 40
+
+#define LRU_POLICY_DEFAULT LRU_POLICY_SEGMENTED
+
+#define ADMISSION_DEFAULT ADMISSION_NONE
+
+
+#define ITEM_key(item) (((char*)&((item)->data)) \
+         + (((item)->it_flags & ITEM_CAS) ? sizeof(uint64_t) : 0))
+
+#define ITEM_suffix(item) ((char*)&((item)->data) + (item)->nkey + 1 \
+         + (((item)->it_flags & ITEM_CAS) ? sizeof(uint64_t) : 0))
+
+#define ITEM_data(item) ((char*)&((item)->data) + (item)->nkey + 1 \
+         + (item)->nsuffix \
+         + (((item)->it_flags & ITEM_CAS) ? sizeof(uint64_t) : 0))
+
+#define ITEM_ntotal(item) (sizeof(struct _stritem) + (item)->nkey + 1 \
+         + (item)->nsuffix + (item)->nbytes \
+         + (((item)->it_flags & ITEM_CAS) ? sizeof(uint64_t) : 0))
+
+/** Time relative to server start. Smaller than time_t on 64-bit systems. */
+typedef unsigned int rel_time_t;
+
+/* current time of day (updated periodically) */
+extern volatile rel_time_t current_time;
+
+/*
+ * current_time at startup, so that items stored in the first minute don't
+ * look as though they were just bumped.
+ */
+#define TIME_BASE (ITEM_UPDATE_INTERVAL + 2)
+
+/* Larger exptimes are Unix times rather than seconds from now. */
+#define REALTIME_MAXDELTA (60 * 60 * 24 * 30)
+
+
+
+#define ITEM_LINKED 1
+#define ITEM_CAS 2
+
+/* temp */
+#define ITEM_SLABBED 4
+
+
+#define ITEM_FETCHED 8
+/*
+ * Hit again after its first fetch; consumed by LRU segment moves. Under the
+ * CLOCK policy it is the reference bit, set on every hit.
+ */
+#define ITEM_ACTIVE 16
+/* Lost its admission check; linked into COLD instead of HOT. */
+#define ITEM_PROBATION 32
+
+/*
+ * Each slab class LRU is split into three segments. New items enter HOT,
+ * items that are hit again are kept in WARM, and evictions come from COLD.
+ */
+#define HOT_LRU 0
+#define WARM_LRU 1
+#define COLD_LRU 2
+#define NUM_LRU_SEGMENTS 3
+
+/**
+ * Structure for storing items within memcached.
+ */
+typedef struct _stritem {
+    struct _stritem *next;
+    struct _stritem *prev;
+    struct _stritem *h_next;    /* hash chain next */
+    struct _stritem *e_next;    /* expiry wheel slot, see items.c */
+    struct _stritem **e_pprev;  /* NULL while not on the wheel */
+
+    rel_time_t      time;       /* least recent access */
+
+    rel_time_t      exptime;    /* expire time */
+
+    int             nbytes;     /* size of data */
+
+    uint32_t        hv;         /* hash of the key, set at allocation */
+
+    unsigned short  refcount;
+
+    uint8_t         nsuffix;    /* length of flags-and-length string */
+    uint8_t         it_flags;   /* ITEM_* above */
+
+    uint8_t         slabs_clsid;/* which slab class we're in */
+
+    uint8_t         lru_seg;    /* HOT_LRU, WARM_LRU or COLD_LRU */
+
+    uint8_t         nkey;       /* key length, w/terminating null and padding */
+
+    char         data[];
+
+
+} item;
+
+#include "latency.h"
+
+/*
+ * Event counters. Every thread counts into a block of its own, allocated the
+ * first time it counts anything, so counting never takes a lock or bounces
+ * a cache line between cores; `stats` adds the blocks up. All fields are
+ * uint64_t, summed word by word, so keep them that way.
+ */
+typedef struct {
+    uint64_t put_cmds;
+    uint64_t put_hits;
+    uint64_t put_misses;
+
+    uint64_t get_cmds;
+    uint64_t get_hits;
+    uint64_t get_misses;
+    uint64_t get_batches;       /* multi-key lookups, see item_get_batch() */
+    uint64_t get_batch_keys;    /* keys looked up in them */
+
+    uint64_t del_cmds;          /* deletes; not counted as gets too */
+    uint64_t del_hits;
+    uint64_t del_misses;
+
+    uint64_t total_items;       /* items stored */
+    uint64_t current_bytes;     /* gauge: linked minus unlinked bytes, mod 2^64 */
+
+    latency_hist_t latency[LATENCY_OPS];
+} thread_stats_t;
+
+extern __thread thread_stats_t *thread_stats_block;
+thread_stats_t *thread_stats_register(void);
+
+/* The calling thread's block. */
+static inline thread_stats_t *thread_stats(void) {
+    thread_stats_t *ts = thread_stats_block;
+
+    return __builtin_expect(ts != NULL, 1) ? ts : thread_stats_register();
+}
+
+/*
+ * Only the owning thread writes its block, so a relaxed load and store is
+ * enough; the atomics just let the `stats` reader see whole values.
+ */
+#define STATS_ADD(field, n) do { \
+        thread_stats_t *ts_ = thread_stats(); \
+        __atomic_store_n(&ts_->field, ts_->field + (uint64_t)(n), __ATOMIC_RELAXED); \
+    } while (0)
+#define STATS_INCR(field) STATS_ADD(field, 1)
+
+/* Counts a duration of ns nanoseconds against op. */
+#define LATENCY_ADD(op, ns) do { \
+        latency_hist_t *h_ = &thread_stats()->latency[op]; \
+        uint64_t ns_ = (ns); \
+        unsigned int b_ = latency_bucket(ns_); \
+        __atomic_store_n(&h_->sum_ns, h_->sum_ns + ns_, __ATOMIC_RELAXED); \
+        __atomic_store_n(&h_->buckets[b_], h_->buckets[b_] + 1, __ATOMIC_RELAXED); \
+    } while (0)
+
+/* Counts the time since start, a latency_ticks() reading, against op. */
+#define LATENCY_RECORD(op, start) LATENCY_ADD(op, latency_ns(latency_ticks() - (start)))
+
+/* Totals over all threads since startup; counters never go backwards. */
+void stats_snapshot(thread_stats_t *out);
+
+/* Totals since the last stats_reset(); gauges are not affected by resets. */
+void stats_since_reset(thread_stats_t *out);
+void stats_reset(void);
+
+#include "hash.h"
+
+/* Layouts of the key -> item index, see hash_functions.c. */
+enum hash_index_type {
+    HASH_INDEX_CHAINED,     /* one pointer per bucket, chained through h_next */
+    HASH_INDEX_BUCKETED     /* cache-line buckets of tagged item pointers */
+};
+
+/* Eviction policies, see items.c. */
+enum lru_policy_type {
+    LRU_POLICY_SEGMENTED,   /* HOT/WARM/COLD lists, relinked by a maintainer */
+    LRU_POLICY_CLOCK        /* reference bit per item and a sweeping hand */
+};
+
+/*
+ * What happens to a new item whose key the admission sketch rates as less
+ * popular than the item it would evict.
+ */
+enum admission_type {
+    ADMISSION_NONE,         /* no sketch, always evict */
+    ADMISSION_REJECT,       /* drop the write, keep the victim */
+    ADMISSION_PROBATION     /* evict, but link the new item into COLD */
+};
+
+/*
+ * Where item memory comes from. Everything but SLAB_ARENA_MALLOC reserves
+ * the whole memory limit as one mapping at startup; HUGETLB falls back to
+ * THP, and THP to plain pages, when the kernel can't provide them.
+ */
+enum slab_arena_type {
+    SLAB_ARENA_MALLOC,      /* malloc() per page, or all at once with -L */
+    SLAB_ARENA_MMAP,        /* anonymous mapping of base pages */
+    SLAB_ARENA_THP,         /* mapping advised for transparent huge pages */
+    SLAB_ARENA_HUGETLB      /* MAP_HUGETLB from the reserved huge page pool */
+};
+
+/* NUMA placement of the arena. */
+enum numa_policy_type {
+    NUMA_POLICY_NONE,       /* first touch */
+    NUMA_POLICY_BIND,       /* all on settings.numa_node */
+    NUMA_POLICY_INTERLEAVE  /* round robin over the online nodes */
+};
+
+/* When adding a setting, be sure to update engine_settings_default() too. */
+struct settings {
+    size_t maxbytes;
+    int maxconns;
+    int port;
+    char *inter;        /* interface to listen on, NULL for all */
+    int verbose;
+    double factor;      /* chunk size growth factor */
+    int hashpower_init;
+    bool preallocate;
+    int backlog;
+    int reqs_per_event; /* commands per connection per event, see drive_machine() */
+    int num_threads;    /* number of worker threads */
+    enum hashfunc_type hash_algorithm; /* key hash used everywhere */
+    enum hash_index_type hash_index;   /* layout of the hashtable */
+    int hot_lru_pct;    /* max % of a class's items in its HOT segment */
+    int warm_lru_pct;   /* max % of a class's items in its WARM segment */
+    enum lru_policy_type lru_policy;   /* how items are picked for eviction */
+    enum admission_type admission;     /* TinyLFU admission filter */
+    bool slab_automove;     /* move pages to classes that keep evicting */
+    bool slab_compact;      /* release sparsely used pages to the OS */
+    enum slab_arena_type slab_arena;   /* backing of item memory */
+    enum numa_policy_type numa_policy; /* placement of the arena */
+    int numa_node;          /* node for NUMA_POLICY_BIND */
+    char *trace_file;       /* command trace, see trace.h; NULL for none */
+    uint32_t trace_sample;  /* trace one key in this many */
+};
+
+extern struct settings settings;
+
+/* Sets every setting to its default. */
+void engine_settings_default(void);
+/*
+ * Sets up the hash function, the hashtable, the slabs and LRUs, the
+ * admission sketch and the item locks as settings say. Starts no threads.
+ * phase_done, if not NULL, is called with NULL once the setup that isn't
+ * worth timing is done, then with the name of each part as it is ready.
+ * Returns -1 if something could not be set up.
+ */
+int engine_init(void (*phase_done)(const char *name));
+
+/*
+ * Possible states of a connection.
+ */
+enum conn_states {
+    conn_listening,  /**< the socket which listens for connections */
+    conn_new_cmd,    /**< Prepare connection for next command */
+    conn_waiting,    /**< waiting for a readable socket */
+    conn_read,       /**< reading in a command line */
+    conn_parse_cmd,  /**< try to parse a command from the input buffer */
+    conn_nread,      /**< reading in a fixed number of bytes */
+    conn_swallow,    /**< swallowing unnecessary bytes w/o storing */
+    conn_write,      /**< writing out a simple response */
+    conn_closing,    /**< closing this connection */
+    conn_max_state   /**< Max state value (used for assertion) */
+};
+
+#include "protocol_binary.h"
+
+/*
+ * Protocol spoken on a connection, decided by the first byte the client
+ * sends: the binary request magic, or anything else for text.
+ */
+enum protocol {
+    negotiating_prot,   /* nothing received yet */
+    ascii_prot,
+    binary_prot
+};
+
+/**
+ * The structure representing a connection into simple_memcached.
+ */
+typedef struct conn conn;
+struct conn {
+    int    sfd;
+    enum conn_states  state;
+    int    epfd;        /* epoll instance this connection is registered with */
+    uint32_t ev_flags;  /* events we are currently waiting for */
+
+    char   *rbuf;   /** buffer to read commands into */
+    char   *rcurr;  /** but if we parsed some already, this is where we stopped */
+    int    rsize;   /** total allocated size of rbuf */
+    int    rbytes;  /** how much data, starting from rcur, do we have unparsed */
+
+    char   *wbuf;   /* reply text, see add_output() */
+    int    wsize;
+    int    wused;   /* bytes of wbuf holding queued text */
+    int    wbytes;  /* reply bytes queued and not written yet */
+
+    struct iovec *iov;  /* the queued reply, in wbuf and in items */
+    int    iovsize;
+    int    iovused;
+    int    iovcurr; /* first piece not fully written */
+
+    item   **ilist; /* items the queued reply points into */
+    int    isize;
+    int    ileft;
+    /** which state to go into after finishing current write */
+    enum conn_states  write_and_go;
+
+    /* data for the nread state */
+
+    /**
+     * item is used to hold an item structure created after reading the command
+     * line of set, to hold the value to store.
+     */
+    item   *item;
+    char   *ritem;  /** when we read in an item's value, it goes here */
+    int    rlbytes;
+    uint64_t cmd_start; /* latency_ticks() when the set command was parsed */
+
+    int    sbytes;    /* how many bytes to swallow */
+
+    enum protocol protocol;
+    protocol_binary_request_header binary_header; /* binary command being served, host order */
+    bool   noreply;   /* quiet binary command, answer only when it fails */
+
+    struct worker_thread *thread; /* Pointer to the thread object serving this connection */
+};
+
+/*
+ * A worker thread: owns an epoll instance and every connection registered
+ * with it. New connections arrive from the main thread through
+ * new_conn_queue, announced by a byte on the notify pipe.
+ */
+typedef struct worker_thread {
+    pthread_t thread_id;        /* unique ID of this thread */
+    int epfd;                   /* epoll instance this thread runs */
+    int notify_receive_fd;      /* receiving end of notify pipe */
+    int notify_send_fd;         /* sending end of notify pipe */
+    struct conn_queue *new_conn_queue; /* queue of new connections to handle */
+} worker_thread_t;
+
+
+
+
+
+
+
+
+#include "slab.h"
+#include "hash_functions.h"
+#include "items.h"
+#include "tinylfu.h"
+#include "trace.h"
+#include "mrc.h"
+
+
+item *item_alloc(char *key, size_t nkey, uint32_t flags, rel_time_t exptime, int nbytes,
+                 bool *rejected);
+item *item_get(const char *key, const size_t nkey);
+void  item_get_batch(char **keys, const size_t *nkeys, const int n, item **its);
+item *item_touch(const char *key, const size_t nkey, uint32_t exptime);
+int   item_link(item *it);
+int   item_store(item *it);
+void  item_remove(item *it);
+void  item_unlink(item *it);
+bool  item_unlink_key(const char *key, const size_t nkey);
+void  item_update(item *it);
+
+unsigned short refcount_incr(unsigned short *refcount);
+unsigned short refcount_decr(unsigned short *refcount);
+
+/*
+ * Functions such as the epoll-based connection handling and the item
+ * wrappers above are thread-safe; the do_* item functions require the
+ * caller to hold item_lock(hv).
+ */
+void thread_init(int nthreads);
+void item_locks_init(int nthreads);
+void dispatch_conn_new(int sfd, enum conn_states init_state);
+
+void  item_lock(uint32_t hv);
+void *item_trylock(uint32_t hv);
+void  item_trylock_unlock(void *arg);
+void  item_unlock(uint32_t hv);
+void  item_lock_all(void);
+void  item_unlock_all(void);
+
+conn *conn_new(const int sfd, enum conn_states init_state, const int epfd,
+               worker_thread_t *thread);
+void event_loop(const int epfd, void (*notify)(void *), void *arg);
+
+
+
+
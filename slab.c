@@ -1,309 +1,1187 @@
-#include <stdint.h>
-#include <stdbool.h>
-#include <errno.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-#include <assert.h>
-#include "simple_memcached.h"
-/* powers-of-N allocation structures */
-
-typedef struct {
- 
-    unsigned int size;      /* sizes of items  */
-    unsigned int perslab;   /* how many items per slab  */
-    void *slots;           /* list of item ptrs */
-    unsigned int sl_curr;   /* total free items in list */
-    unsigned int slabs;     /* how many slabs were allocated for this class */
-    void **slab_list;       /* array of slab pointers */
-    unsigned int list_size; /* size of prev array  */
-    unsigned int killing;  /* index+1 of dying slab, or zero if none */
-    size_t requested; /* The number of requested bytes */
-} slabclass_t;
-
-static slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES]; 
-static size_t mem_limit = 0;
-static size_t mem_malloced = 0;
-static size_t mem_avail = 0;
-static int power_largest;
-
-static void *mem_base = NULL; 
-static void *mem_current = NULL;
-
-/*
- * Forward Declarations
- */
-static int do_slabs_newslab(const unsigned int id);
-static void *memory_allocate(size_t size);
-static void do_slabs_free(void *ptr, const size_t size, unsigned int id);
-
-/* Preallocate as many slab pages as possible (called from slabs_init)
-   on start-up, so users don't get confused out-of-memory errors when
-   they do have free (in-slab) space, but no space to make new slabs.
-   if maxslabs is 18 (POWER_LARGEST - POWER_SMALLEST + 1), then all
-   slab types can be made.  if max memory is less than 18 MB, only the
-   smaller ones will be made.  */
-static void slabs_preallocate (const unsigned int maxslabs);
-
-/*
- * Figures out which slab class (chunk size) is required to store an item of
- * a given size.
- *
- * Given object size, return id to use when allocating/freeing memory for object
- * 0 means error: can't store such a large object
- */
-
-unsigned int slabs_clsid(const size_t size) {
-    int res = POWER_SMALLEST;
-
-    if (size == 0)
-        return 0;
-    while (size > slabclass[res].size)
-        if (res++ == power_largest)     /* won't fit in the biggest slab */
-            return 0;
-    return res;
-}
-
-/**
- * Determines the chunk sizes and initializes the slab class descriptors
- * accordingly.
- */
-void slabs_init(const size_t limit, 
-                  const double factor,
-                  const bool prealloc)  {
-    int i = POWER_SMALLEST - 1;
-    unsigned int size = sizeof(item) + 48;
-
-    mem_limit = limit;
-
-
-    if (prealloc) {
-        /* Allocate everything in a big chunk with malloc */
-        mem_base = malloc(mem_limit);
-        if (mem_base != NULL) {
-            mem_current = mem_base;
-            mem_avail = mem_limit;
-        } else {
-            fprintf(stderr, "Warning: Failed to allocate requested memory in"
-                    " one large chunk.\nWill allocate in smaller chunks\n");
-        }
-    }
-    printf("Come to here 1\n");
-    memset(slabclass, 0, sizeof(slabclass));
-
-    printf("Come to here 2\n");
-
-
-    while (++i < POWER_LARGEST && size <= 1048576 / factor) {
-        /* Make sure items are always n-byte aligned */
-        if (size % CHUNK_ALIGN_BYTES)
-            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES); 
-        slabclass[i].size = size;
-        slabclass[i].perslab = 1048576 / slabclass[i].size; 
-        size *= factor; 
-        fprintf(stderr, "slab class %3d: chunk size %9u perslab %7u\n", i, slabclass[i].size, slabclass[i].perslab);
-
-    }
-
-    power_largest = i;
-    slabclass[power_largest].size = 1048576;
-    slabclass[power_largest].perslab = 1;
-
-    fprintf(stderr, "slab class %3d: chunk size %9u perslab %7u\n",
-                i, slabclass[i].size, slabclass[i].perslab);
-
-
-
-    if (prealloc) {
-        slabs_preallocate(power_largest);
-    }
-}
-
-static void slabs_preallocate (const unsigned int maxslabs) {
-    int i;
-    unsigned int prealloc = 0;
-
-    /* pre-allocate a 1MB slab in every size class so people don't get
-       confused by non-intuitive "SERVER_ERROR out of memory"
-       messages.  this is the most common question on the mailing
-       list.  if you really don't want this, you can rebuild without
-       these three lines.  */
-    for (i = POWER_SMALLEST; i <= POWER_LARGEST; i++) {
-        if (++prealloc > maxslabs)
-            return;
-        if (do_slabs_newslab(i) == 0) {
-            fprintf(stderr, "Error while preallocating slab memory!\n"
-                "If using -L or other prealloc options, max memory must be "
-                "at least %d megabytes.\n", power_largest);
-            exit(1);
-        }
-    }
-
-}
-
-static int grow_slab_list (const unsigned int id) {
-    slabclass_t *p = &slabclass[id];
-    if (p->slabs == p->list_size) { 
-        size_t new_size =  (p->list_size != 0) ? p->list_size * 2 : 16; 
-        void *new_list = realloc(p->slab_list, new_size * sizeof(void *));
-        if (new_list == 0) return 0;
-        p->list_size = new_size;
-        p->slab_list = new_list;
-    }
-    return 1;
-}
-
-
-static void split_slab_page_into_freelist(char *ptr, const unsigned int id) {
-    slabclass_t *p = &slabclass[id];
-    int x;
-    for (x = 0; x < p->perslab; x++) {
-        do_slabs_free(ptr, 0, id);
-        ptr += p->size;
-    }
-}
-
-
-static int do_slabs_newslab(const unsigned int id) {
-    slabclass_t *p = &slabclass[id];
-
-    int len =  p->size * p->perslab;
-    char *ptr;
-
-    if ((mem_limit && mem_malloced + len > mem_limit && p->slabs > 0) ||
-        (grow_slab_list(id) == 0) ||
-        ((ptr = memory_allocate((size_t)len)) == 0)) {
-
-        return 0;
-    }
-
-    memset(ptr, 0, (size_t)len);
-    split_slab_page_into_freelist(ptr, id); 
-
-    p->slab_list[p->slabs++] = ptr; 
-    mem_malloced += len; 
-
-    return 1;
-}
-
-/*@null@*/
-
-
-static void *do_slabs_alloc(const size_t size, unsigned int id) {
-    slabclass_t *p;
-    void *ret = NULL;
-    item *it = NULL;
-
-    if (id < POWER_SMALLEST || id > POWER_LARGEST) {
-        return NULL;
-    }
-
-    p = &slabclass[id];
-    assert(p->sl_curr == 0 || ((item *)p->slots)->slabs_clsid == 0);
-
-
-    /* fail unless we have space at the end of a recently allocated page,
-       we have something on our freelist, or we could allocate a new page */
-    if (! (p->sl_curr != 0 || do_slabs_newslab(id) != 0)) {
-        /* We don't have more memory available */
-        ret = NULL;
-    } else if (p->sl_curr != 0) {
-        /* return off our freelist */
-
-        it = (item *)p->slots;
-        p->slots = it->next;
-        if (it->next) it->next->prev = 0;
-        p->sl_curr--;
-        ret = (void *)it;
-    }
-
-    if (ret) {
-        p->requested += size; 
-    } 
-
-    return ret;
-}
-
-
-static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
-    slabclass_t *p;
-    item *it;
-
-    assert(((item *)ptr)->slabs_clsid == 0);
-    assert(id >= POWER_SMALLEST && id <= POWER_LARGEST);
-    if (id < POWER_SMALLEST || id > POWER_LARGEST)
-        return;
-
-    p = &slabclass[id];
-
-    it = (item *)ptr;
-    it->it_flags |= ITEM_SLABBED;
-    it->prev = 0;
-    
-
-    it->next = p->slots; 
-    if (it->next) it->next->prev = it;
-    p->slots = it;
-
-    p->sl_curr++;
-    p->requested -= size; 
-    return;
-}
-
-
-
-static void *memory_allocate(size_t size) {
-    void *ret;
-
-    if (mem_base == NULL) {
-        /* We are not using a preallocated large memory chunk */
-        ret = malloc(size);
-    } else {
-
-        ret = mem_current;
-
-        if (size > mem_avail) {
-            return NULL;
-        }
-
-        /* mem_current pointer _must_ be aligned!!! */
-        if (size % CHUNK_ALIGN_BYTES) {
-            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES); 
-        }
-
-        mem_current = ((char*)mem_current) + size;
-        if (size < mem_avail) {
-            mem_avail -= size;
-        } else {
-            mem_avail = 0;
-        }
-    }
-
-    return ret;
-}
-
-
-void *slabs_alloc(size_t size, unsigned int id) {
-    void *ret;
-    ret = do_slabs_alloc(size, id);
-    return ret;
-}
-
-void slabs_free(void *ptr, size_t size, unsigned int id) {
-    do_slabs_free(ptr, size, id);
-}
-
-void slabs_adjust_mem_requested(unsigned int id, size_t old, size_t ntotal)
-{
-
-    slabclass_t *p;
-    if (id < POWER_SMALLEST || id > power_largest) {
-        fprintf(stderr, "Internal error! Invalid slab class\n");
-        abort();
-    }
-
-    p = &slabclass[id];
-    p->requested = p->requested - old + ntotal;
-}
-
-
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "simple_memcached.h"
+/* powers-of-N allocation structures */
+
+/*
+ * Every page is this big whatever its class, so the rebalancer can hand a
+ * page from one class to another.
+ */
+#define SLAB_PAGE_SIZE 1048576
+
+/* slabs_clsid of a chunk in a dying page that the rebalancer has taken. */
+#define SLABS_CLSID_CLAIMED 255
+
+typedef struct {
+ 
+    unsigned int size;      /* sizes of items  */
+    unsigned int perslab;   /* how many items per slab  */
+    void *slots;           /* list of item ptrs */
+    unsigned int sl_curr;   /* total free items in list */
+
+    void *end_page_ptr;         /* next chunk to carve from the newest page */
+    unsigned int end_page_free; /* chunks of it not carved yet */
+    unsigned int slabs;     /* how many slabs were allocated for this class */
+    void **slab_list;       /* array of slab pointers */
+    unsigned int list_size; /* size of prev array  */
+    unsigned int killing;  /* index+1 of dying slab, or zero if none */
+    size_t requested; /* The number of requested bytes */
+} slabclass_t;
+
+static slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES]; 
+static size_t mem_limit = 0;
+static size_t mem_malloced = 0;
+static size_t mem_avail = 0;
+static int power_largest;
+
+static void *mem_base = NULL; 
+static void *mem_current = NULL;
+
+/*
+ * The arena, when settings.slab_arena asks for one: a single mapping of
+ * mem_limit bytes that memory_allocate() carves pages from through
+ * mem_base. arena_type is what was actually obtained, arena_page_size the
+ * page size backing it. Item memory released to the OS is aligned to
+ * release_align, so nothing is released from hugetlb pages.
+ */
+static void *arena_base = NULL;
+static size_t arena_len = 0;
+static enum slab_arena_type arena_type = SLAB_ARENA_MALLOC;
+static size_t arena_page_size;
+static size_t release_align;
+
+/* THP only backs 2MB-aligned ranges. */
+#define THP_ALIGN (2 * 1024 * 1024)
+
+/* Preallocated memory is pre-faulted by up to this many threads. */
+#define PREFAULT_THREADS_MAX 64
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+
+/*
+ * Pages given back by compaction or a lower memlimit. Their memory is
+ * returned to the OS with madvise() but the address range stays on this
+ * list, linked through each page's first word, so do_slabs_newslab() can
+ * reuse it before allocating more. Not counted in mem_malloced. Guarded by
+ * slabs_mem_lock.
+ */
+static void *spare_pages = NULL;
+
+/*
+ * Page rebalancing. slabs_reassign() records a job and wakes the rebalancer
+ * thread, which empties one page of the source class a few chunks at a time
+ * and then gives it to the destination class. The job fields are guarded by
+ * slabs_rebalance_lock.
+ */
+static pthread_t rebalance_tid;
+static pthread_mutex_t slabs_rebalance_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slabs_rebalance_cond = PTHREAD_COND_INITIALIZER;
+static bool rebalance_requested = false;
+static bool rebalance_running = false;
+static int rebalance_src;
+static int rebalance_dst;
+
+/* Chunks checked per lock hold while emptying a page. */
+#define SLAB_BULK_CHECK 64
+
+/* Passes over a page before busy items are unlinked regardless. */
+#define SLAB_BUSY_PASSES_MAX 100
+
+/* Automove looks at eviction counts once per window. */
+#define AUTOMOVE_WINDOW_USEC 1000000
+#define AUTOMOVE_WINDOWS 3
+
+/*
+ * Compaction empties a class's sparsest page once its free chunks add up
+ * to this many pages, so the class keeps some room after giving one back.
+ */
+#define SLAB_COMPACT_FREE_PAGES 2
+
+/* Rebalancer statistics, written only by the rebalancer thread. */
+static uint64_t slabs_moved = 0;
+static uint64_t rebalance_rescues = 0;
+static uint64_t rebalance_evictions = 0;
+static uint64_t rebalance_busy_items = 0;
+static uint64_t slabs_compacted = 0;
+static uint64_t slabs_released = 0;
+
+/*
+ * Each slab class has its own lock for its freelist and page list; the
+ * global memory accounting above is guarded by slabs_mem_lock, which is
+ * always taken after a class lock.
+ */
+static pthread_mutex_t slabs_lock[MAX_NUMBER_OF_SLAB_CLASSES];
+static pthread_mutex_t slabs_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Forward Declarations
+ */
+static int do_slabs_newslab(const unsigned int id);
+static void *memory_allocate(size_t size);
+static void do_slabs_free(void *ptr, const size_t size, unsigned int id);
+static int grow_slab_list (const unsigned int id);
+static int slabs_pick_source(const int dst);
+
+/* Preallocate as many slab pages as possible (called from slabs_init)
+   on start-up, so users don't get confused out-of-memory errors when
+   they do have free (in-slab) space, but no space to make new slabs.
+   if maxslabs is 18 (POWER_LARGEST - POWER_SMALLEST + 1), then all
+   slab types can be made.  if max memory is less than 18 MB, only the
+   smaller ones will be made.  */
+static void slabs_preallocate (const unsigned int maxslabs);
+
+/*
+ * Figures out which slab class (chunk size) is required to store an item of
+ * a given size.
+ *
+ * Given object size, return id to use when allocating/freeing memory for object
+ * 0 means error: can't store such a large object
+ */
+
+unsigned int slabs_clsid(const size_t size) {
+    int res = POWER_SMALLEST;
+
+    if (size == 0)
+        return 0;
+    while (size > slabclass[res].size)
+        if (res++ == power_largest)     /* won't fit in the biggest slab */
+            return 0;
+    return res;
+}
+
+/* Huge page size from /proc/meminfo, or 2MB if it can't be read. */
+static size_t hugetlb_page_size(void) {
+    char line[128];
+    size_t kb = 2048;
+    FILE *fp = fopen("/proc/meminfo", "r");
+
+    if (fp == NULL)
+        return kb * 1024;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "Hugepagesize: %zu kB", &kb) == 1)
+            break;
+    }
+    fclose(fp);
+    return kb * 1024;
+}
+
+/* Bitmask of the online NUMA nodes, node 0 alone if unknown. */
+static unsigned long numa_online_nodes(void) {
+    unsigned long mask = 0;
+    unsigned int lo, hi;
+    char buf[256], *p;
+    FILE *fp = fopen("/sys/devices/system/node/online", "r");
+
+    if (fp == NULL)
+        return 1;
+    if (fgets(buf, sizeof(buf), fp) == NULL) {
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+
+    /* e.g. "0-3,6" */
+    for (p = strtok(buf, ",\n"); p != NULL; p = strtok(NULL, ",\n")) {
+        if (sscanf(p, "%u-%u", &lo, &hi) != 2) {
+            if (sscanf(p, "%u", &lo) != 1)
+                continue;
+            hi = lo;
+        }
+        for (; lo <= hi && lo < sizeof(mask) * 8; lo++)
+            mask |= 1UL << lo;
+    }
+    return mask ? mask : 1;
+}
+
+/* Applies settings.numa_policy to the arena; a failure only warns. */
+static void slabs_arena_numa(void *base, size_t len) {
+    unsigned long mask;
+    int mode;
+
+    if (settings.numa_policy == NUMA_POLICY_NONE)
+        return;
+    if (settings.numa_policy == NUMA_POLICY_BIND) {
+        mask = 1UL << settings.numa_node;
+        mode = MPOL_BIND;
+    } else {
+        mask = numa_online_nodes();
+        mode = MPOL_INTERLEAVE;
+    }
+    if (syscall(SYS_mbind, base, len, mode, &mask, sizeof(mask) * 8 + 1, 0) != 0)
+        fprintf(stderr, "Warning: couldn't set the NUMA policy of item memory: %s\n",
+                strerror(errno));
+}
+
+/*
+ * Maps the arena, falling back from huge pages to base pages. Nothing is
+ * touched here; the kernel backs pages as do_slabs_newslab() zeroes them.
+ */
+static int slabs_arena_init(const size_t len) {
+    enum slab_arena_type type = settings.slab_arena;
+    void *base = NULL;
+
+    if (type == SLAB_ARENA_HUGETLB) {
+        size_t hp = hugetlb_page_size();
+
+        arena_len = (len + hp - 1) & ~(hp - 1);
+        /* No MAP_NORESERVE: fail now rather than SIGBUS on first touch. */
+        base = mmap(NULL, arena_len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED) {
+            arena_page_size = hp;
+            release_align = hp;
+        } else {
+            fprintf(stderr, "Warning: no %zukB huge pages for item memory (%s), "
+                    "trying transparent huge pages\n", hp / 1024, strerror(errno));
+            type = SLAB_ARENA_THP;
+        }
+    }
+
+    if (type == SLAB_ARENA_THP || type == SLAB_ARENA_MMAP) {
+        size_t align = type == SLAB_ARENA_THP ? THP_ALIGN : release_align;
+        char *raw, *aligned;
+
+        /* Over-map by align and trim, so every 2MB can be a huge page. */
+        arena_len = (len + align - 1) & ~(align - 1);
+        raw = mmap(NULL, arena_len + align, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (raw == MAP_FAILED) {
+            fprintf(stderr, "Failed to map %zu bytes of item memory: %s\n",
+                    arena_len, strerror(errno));
+            return -1;
+        }
+        aligned = (char *)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+        if (aligned > raw)
+            munmap(raw, aligned - raw);
+        munmap(aligned + arena_len, align - (aligned - raw));
+        base = aligned;
+        if (type == SLAB_ARENA_THP &&
+            madvise(base, arena_len, MADV_HUGEPAGE) != 0) {
+            fprintf(stderr, "Warning: transparent huge pages unavailable (%s), "
+                    "using base pages\n", strerror(errno));
+            type = SLAB_ARENA_MMAP;
+        }
+    }
+
+    slabs_arena_numa(base, arena_len);
+    arena_base = base;
+    arena_type = type;
+    mem_base = mem_current = base;
+    mem_avail = arena_len;
+    return 0;
+}
+
+typedef struct {
+    pthread_t tid;
+    char *start;
+    size_t len;
+} prefault_job_t;
+
+static void *prefault_thread(void *arg) {
+    prefault_job_t *job = arg;
+    size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t off;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(job->start, job->len, MADV_POPULATE_WRITE) == 0)
+        return NULL;
+#endif
+    /* Older kernels, or malloc()ed memory: touch every page. */
+    for (off = 0; off < job->len; off += pagesize)
+        ((volatile char *)job->start)[off] = 0;
+    return NULL;
+}
+
+/*
+ * Faults in [base, base + len) from one thread per CPU, so a large
+ * preallocated cache doesn't take one thread minutes of page faults at
+ * startup. Slices are multiples of THP_ALIGN so no two threads fault the
+ * same huge page.
+ */
+static void slabs_prefault(char *base, const size_t len) {
+    prefault_job_t jobs[PREFAULT_THREADS_MAX];
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, nthreads = ncpus > 0 ? (int)ncpus : 1;
+    size_t slice;
+    struct timespec t0, t1;
+
+    if (nthreads > PREFAULT_THREADS_MAX)
+        nthreads = PREFAULT_THREADS_MAX;
+    slice = (len / nthreads + THP_ALIGN - 1) & ~((size_t)THP_ALIGN - 1);
+    if (slice == 0)
+        slice = THP_ALIGN;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nthreads && (size_t)i * slice < len; i++) {
+        jobs[i].start = base + (size_t)i * slice;
+        jobs[i].len = len - (size_t)i * slice < slice ? len - (size_t)i * slice : slice;
+        if (pthread_create(&jobs[i].tid, NULL, prefault_thread, &jobs[i]) != 0) {
+            /* Do this slice here rather than not at all. */
+            prefault_thread(&jobs[i]);
+            jobs[i].tid = 0;
+        }
+    }
+    nthreads = i;
+    for (i = 0; i < nthreads; i++) {
+        if (jobs[i].tid != 0)
+            pthread_join(jobs[i].tid, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    fprintf(stderr, "Pre-faulted %zu MB of item memory with %d threads in %.1f ms\n",
+            len / (1024 * 1024), nthreads,
+            (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+}
+
+/**
+ * Determines the chunk sizes and initializes the slab class descriptors
+ * accordingly.
+ */
+void slabs_init(const size_t limit, 
+                  const double factor,
+                  const bool prealloc)  {
+    int i = POWER_SMALLEST - 1;
+    unsigned int size = sizeof(item) + 48;
+
+    mem_limit = limit;
+    arena_page_size = release_align = (size_t)sysconf(_SC_PAGESIZE);
+
+    if (settings.slab_arena != SLAB_ARENA_MALLOC) {
+        if (slabs_arena_init(mem_limit) != 0)
+            exit(EXIT_FAILURE);
+    } else if (prealloc) {
+        /* Allocate everything in a big chunk with malloc */
+        mem_base = malloc(mem_limit);
+        if (mem_base != NULL) {
+            mem_current = mem_base;
+            mem_avail = mem_limit;
+        } else {
+            fprintf(stderr, "Warning: Failed to allocate requested memory in"
+                    " one large chunk.\nWill allocate in smaller chunks\n");
+        }
+    }
+    if (mem_base != NULL && prealloc)
+        slabs_prefault(mem_base, mem_avail);
+
+    memset(slabclass, 0, sizeof(slabclass));
+    for (i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        pthread_mutex_init(&slabs_lock[i], NULL);
+    }
+    i = POWER_SMALLEST - 1;
+
+    while (++i < POWER_LARGEST && size <= SLAB_PAGE_SIZE / factor) {
+        /* Make sure items are always n-byte aligned */
+        if (size % CHUNK_ALIGN_BYTES)
+            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES); 
+        slabclass[i].size = size;
+        slabclass[i].perslab = SLAB_PAGE_SIZE / slabclass[i].size; 
+        size *= factor; 
+        fprintf(stderr, "slab class %3d: chunk size %9u perslab %7u\n", i, slabclass[i].size, slabclass[i].perslab);
+
+    }
+
+    power_largest = i;
+    slabclass[power_largest].size = SLAB_PAGE_SIZE;
+    slabclass[power_largest].perslab = 1;
+
+    fprintf(stderr, "slab class %3d: chunk size %9u perslab %7u\n",
+                i, slabclass[i].size, slabclass[i].perslab);
+
+
+
+    if (prealloc) {
+        slabs_preallocate(power_largest);
+    }
+}
+
+static void slabs_preallocate (const unsigned int maxslabs) {
+    int i;
+    unsigned int prealloc = 0;
+
+    /* pre-allocate a 1MB slab in every size class so people don't get
+       confused by non-intuitive "SERVER_ERROR out of memory"
+       messages.  this is the most common question on the mailing
+       list.  if you really don't want this, you can rebuild without
+       these three lines.  */
+    for (i = POWER_SMALLEST; i <= POWER_LARGEST; i++) {
+        if (++prealloc > maxslabs)
+            return;
+        if (do_slabs_newslab(i) == 0) {
+            fprintf(stderr, "Error while preallocating slab memory!\n"
+                "If using -L or other prealloc options, max memory must be "
+                "at least %d megabytes.\n", power_largest);
+            exit(1);
+        }
+    }
+
+}
+
+static int grow_slab_list (const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+    if (p->slabs == p->list_size) { 
+        size_t new_size =  (p->list_size != 0) ? p->list_size * 2 : 16; 
+        void *new_list = realloc(p->slab_list, new_size * sizeof(void *));
+        if (new_list == 0) return 0;
+        p->list_size = new_size;
+        p->slab_list = new_list;
+    }
+    return 1;
+}
+
+
+static void split_slab_page_into_freelist(char *ptr, const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+    int x;
+    for (x = 0; x < p->perslab; x++) {
+        do_slabs_free(ptr, 0, id);
+        ptr += p->size;
+    }
+}
+
+
+static int do_slabs_newslab(const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+
+    int len = SLAB_PAGE_SIZE;
+    char *ptr;
+
+    pthread_mutex_lock(&slabs_mem_lock);
+    if ((mem_limit && mem_malloced + len > mem_limit && p->slabs > 0) ||
+        (grow_slab_list(id) == 0)) {
+
+        pthread_mutex_unlock(&slabs_mem_lock);
+        return 0;
+    }
+    if (spare_pages != NULL) {
+        ptr = spare_pages;
+        spare_pages = *(void **)ptr;
+    } else if ((ptr = memory_allocate((size_t)len)) == 0) {
+        pthread_mutex_unlock(&slabs_mem_lock);
+        return 0;
+    }
+    mem_malloced += len; 
+    pthread_mutex_unlock(&slabs_mem_lock);
+
+    /* Chunks are carved off as needed, so the page is only faulted in as
+       it fills. */
+    p->end_page_ptr = ptr;
+    p->end_page_free = p->perslab;
+
+    p->slab_list[p->slabs++] = ptr; 
+
+    return 1;
+}
+
+/*@null@*/
+
+
+static void *do_slabs_alloc(const size_t size, unsigned int id) {
+    slabclass_t *p;
+    void *ret = NULL;
+    item *it = NULL;
+
+    if (id < POWER_SMALLEST || id > POWER_LARGEST) {
+        return NULL;
+    }
+
+    p = &slabclass[id];
+    assert(p->sl_curr == 0 || ((item *)p->slots)->slabs_clsid == 0);
+
+
+    /* fail unless we have space at the end of a recently allocated page,
+       we have something on our freelist, or we could allocate a new page */
+    if (! (p->sl_curr != 0 || p->end_page_free != 0 ||
+           do_slabs_newslab(id) != 0)) {
+        /* We don't have more memory available */
+        ret = NULL;
+    } else if (p->sl_curr == 0) {
+        /* carve the next chunk off the newest page */
+        it = (item *)p->end_page_ptr;
+        if (--p->end_page_free != 0)
+            p->end_page_ptr = (char *)p->end_page_ptr + p->size;
+        else
+            p->end_page_ptr = NULL;
+        it->it_flags = 0;
+        it->slabs_clsid = 0;
+        it->refcount = 1;
+        ret = (void *)it;
+    } else {
+        /* return off our freelist */
+
+        it = (item *)p->slots;
+        p->slots = it->next;
+        if (it->next) it->next->prev = 0;
+        /* Taken under the lock so the rebalancer never sees it free */
+        it->it_flags &= ~ITEM_SLABBED;
+        it->refcount = 1;
+        p->sl_curr--;
+        ret = (void *)it;
+    }
+
+    if (ret) {
+        p->requested += size; 
+    } 
+
+    return ret;
+}
+
+
+static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
+    slabclass_t *p;
+    item *it;
+
+    assert(((item *)ptr)->slabs_clsid == 0);
+    assert(id >= POWER_SMALLEST && id <= POWER_LARGEST);
+    if (id < POWER_SMALLEST || id > POWER_LARGEST)
+        return;
+
+    p = &slabclass[id];
+
+    it = (item *)ptr;
+    it->it_flags |= ITEM_SLABBED;
+    it->prev = 0;
+    
+
+    it->next = p->slots; 
+    if (it->next) it->next->prev = it;
+    p->slots = it;
+
+    p->sl_curr++;
+    p->requested -= size; 
+    return;
+}
+
+
+
+static void *memory_allocate(size_t size) {
+    void *ret;
+
+    if (mem_base == NULL) {
+        /* We are not using a preallocated large memory chunk */
+        ret = malloc(size);
+    } else {
+
+        ret = mem_current;
+
+        if (size > mem_avail) {
+            return NULL;
+        }
+
+        /* mem_current pointer _must_ be aligned!!! */
+        if (size % CHUNK_ALIGN_BYTES) {
+            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES); 
+        }
+
+        mem_current = ((char*)mem_current) + size;
+        if (size < mem_avail) {
+            mem_avail -= size;
+        } else {
+            mem_avail = 0;
+        }
+    }
+
+    return ret;
+}
+
+
+void *slabs_alloc(size_t size, unsigned int id) {
+    void *ret;
+    uint64_t start;
+
+    if (id < POWER_SMALLEST || id > POWER_LARGEST) {
+        return NULL;
+    }
+    start = latency_ticks();
+    pthread_mutex_lock(&slabs_lock[id]);
+    ret = do_slabs_alloc(size, id);
+    pthread_mutex_unlock(&slabs_lock[id]);
+    LATENCY_RECORD(LATENCY_SLAB_ALLOC, start);
+    return ret;
+}
+
+void slabs_free(void *ptr, size_t size, unsigned int id) {
+    pthread_mutex_lock(&slabs_lock[id]);
+    do_slabs_free(ptr, size, id);
+    pthread_mutex_unlock(&slabs_lock[id]);
+}
+
+void slabs_adjust_mem_requested(unsigned int id, size_t old, size_t ntotal)
+{
+
+    slabclass_t *p;
+    if (id < POWER_SMALLEST || id > power_largest) {
+        fprintf(stderr, "Internal error! Invalid slab class\n");
+        abort();
+    }
+
+    pthread_mutex_lock(&slabs_lock[id]);
+    p = &slabclass[id];
+    p->requested = p->requested - old + ntotal;
+    pthread_mutex_unlock(&slabs_lock[id]);
+}
+
+
+
+/*
+ * Unlinks a free chunk from wherever it sits in its class's freelist.
+ */
+static void do_slabs_unlink_free(slabclass_t *p, item *it) {
+    if (it->next) it->next->prev = it->prev;
+    if (it->prev) it->prev->next = it->next;
+    if (p->slots == it) p->slots = it->next;
+    p->sl_curr--;
+}
+
+/* Marks a chunk of the dying page as taken by the rebalancer. */
+static void slabs_claim_chunk(item *it) {
+    it->refcount = 0;
+    it->it_flags = 0;
+    it->slabs_clsid = SLABS_CLSID_CLAIMED;
+}
+
+/*
+ * Pops a free chunk of class p outside the dying page [start, end) to move
+ * an item into, claiming the page's own free chunks found on the way.
+ */
+static item *do_slabs_rescue_chunk(slabclass_t *p, const char *start,
+                                   const char *end) {
+    item *it;
+
+    while ((it = p->slots) != NULL) {
+        do_slabs_unlink_free(p, it);
+        if ((char *)it >= start && (char *)it < end) {
+            slabs_claim_chunk(it);
+            continue;
+        }
+        return it;
+    }
+    return NULL;
+}
+
+/* Chunks of a page of class p that are not on the freelist. */
+static unsigned int do_slabs_page_used(slabclass_t *p, const char *page) {
+    unsigned int x, used = 0;
+
+    for (x = 0; x < p->perslab; x++) {
+        item *it = (item *)(page + (size_t)x * p->size);
+        if ((it->it_flags & ITEM_SLABBED) == 0)
+            used++;
+    }
+    return used;
+}
+
+/*
+ * Puts the chunks of the newest page that haven't been carved yet on the
+ * freelist, so every chunk of every page has a header the rebalancer can
+ * read.
+ */
+static void do_slabs_carve_rest(const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+    char *ptr = p->end_page_ptr;
+
+    for (; p->end_page_free > 0; p->end_page_free--, ptr += p->size) {
+        item *it = (item *)ptr;
+        it->slabs_clsid = 0;
+        it->refcount = 0;
+        do_slabs_free(it, 0, id);
+    }
+    p->end_page_ptr = NULL;
+}
+
+/*
+ * Picks the page of class src with the fewest chunks in use, so the fewest
+ * items have to move, and marks it dying. Returns NULL if the class can't
+ * spare one. Only this thread removes pages, so the indexes stay valid
+ * while the lock is dropped between pages.
+ */
+static char *slab_rebalance_start(const int src) {
+    slabclass_t *s = &slabclass[src];
+    unsigned int i, used, min_used = UINT32_MAX, slabs;
+    char *page = NULL;
+
+    pthread_mutex_lock(&slabs_lock[src]);
+    slabs = s->slabs;
+    if (slabs > 1)
+        do_slabs_carve_rest(src);
+    pthread_mutex_unlock(&slabs_lock[src]);
+    if (slabs < 2)
+        return NULL;
+
+    for (i = 0; i < slabs && min_used > 0; i++) {
+        pthread_mutex_lock(&slabs_lock[src]);
+        used = do_slabs_page_used(s, s->slab_list[i]);
+        pthread_mutex_unlock(&slabs_lock[src]);
+        if (used < min_used) {
+            min_used = used;
+            s->killing = i + 1;
+        }
+    }
+
+    pthread_mutex_lock(&slabs_lock[src]);
+    page = s->slab_list[s->killing - 1];
+    pthread_mutex_unlock(&slabs_lock[src]);
+    return page;
+}
+
+/*
+ * One pass over the dying page of class src, SLAB_BULK_CHECK chunks per
+ * hold of the class's LRU and slabs locks. Free chunks are pulled off the
+ * freelist; linked items nobody else references are moved to a free chunk
+ * elsewhere in the class, or evicted if there is none. Items in use are
+ * left for the next pass, unless force is set: then linked ones are
+ * unlinked so their chunk comes back through slabs_free() once released.
+ * Returns how many chunks are still not claimed.
+ */
+static int slab_rebalance_move(const int src, char *start, const bool force) {
+    slabclass_t *p = &slabclass[src];
+    char *end = start + (size_t)p->size * p->perslab;
+    unsigned int x = 0;
+    int busy = 0;
+
+    while (x < p->perslab) {
+        unsigned int batch_end = x + SLAB_BULK_CHECK;
+
+        item_lru_lock(src);
+        pthread_mutex_lock(&slabs_lock[src]);
+        for (; x < p->perslab && x < batch_end; x++) {
+            item *it = (item *)(start + (size_t)x * p->size);
+            void *hold_lock;
+            uint32_t hv;
+
+            if (it->slabs_clsid == SLABS_CLSID_CLAIMED)
+                continue;
+            if ((it->it_flags & ITEM_SLABBED) != 0) {
+                do_slabs_unlink_free(p, it);
+                slabs_claim_chunk(it);
+                continue;
+            }
+
+            /*
+             * Only the item lock keeps new references away. The hash value
+             * is stale while the chunk is being reused, so check it again
+             * once the item is known to be linked.
+             */
+            hv = it->hv;
+            if ((hold_lock = item_trylock(hv)) == NULL) {
+                busy++;
+                continue;
+            }
+            if (refcount_incr(&it->refcount) == 2 &&
+                (it->it_flags & ITEM_LINKED) != 0 && it->hv == hv) {
+                item *new_it = do_slabs_rescue_chunk(p, start, end);
+
+                if (new_it == NULL)
+                    p->requested -= ITEM_ntotal(it);
+                do_item_evacuate(it, new_it);
+                slabs_claim_chunk(it);
+                if (new_it != NULL)
+                    __atomic_add_fetch(&rebalance_rescues, 1, __ATOMIC_RELAXED);
+                else
+                    __atomic_add_fetch(&rebalance_evictions, 1, __ATOMIC_RELAXED);
+            } else {
+                if (force && (it->it_flags & ITEM_LINKED) != 0 && it->hv == hv) {
+                    do_item_evacuate(it, NULL);
+                    __atomic_add_fetch(&rebalance_busy_items, 1, __ATOMIC_RELAXED);
+                }
+                refcount_decr(&it->refcount);
+                busy++;
+            }
+            item_trylock_unlock(hold_lock);
+        }
+        pthread_mutex_unlock(&slabs_lock[src]);
+        item_lru_unlock(src);
+    }
+    return busy;
+}
+
+/*
+ * Returns the memory of an emptied page to the OS, all but the OS page
+ * holding the spare list link, and keeps its address range for
+ * do_slabs_newslab(). Caller holds slabs_mem_lock.
+ */
+static void do_slabs_release_page(char *page) {
+    uintptr_t start = ((uintptr_t)page + sizeof(void *) + release_align - 1)
+                      & ~(release_align - 1);
+    uintptr_t end = ((uintptr_t)page + SLAB_PAGE_SIZE) & ~(release_align - 1);
+
+    if (end > start)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    *(void **)page = spare_pages;
+    spare_pages = page;
+    mem_malloced -= SLAB_PAGE_SIZE;
+    __atomic_add_fetch(&slabs_released, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Hands the emptied page of class src over to class dst, or back to the OS
+ * if dst is 0.
+ */
+static void slab_rebalance_finish(const int src, const int dst, char *page) {
+    slabclass_t *s = &slabclass[src];
+    slabclass_t *d = &slabclass[dst];
+    int to = dst;
+
+    pthread_mutex_lock(&slabs_lock[src]);
+    s->slab_list[s->killing - 1] = s->slab_list[s->slabs - 1];
+    s->slabs--;
+    s->killing = 0;
+    if (dst == 0) {
+        pthread_mutex_lock(&slabs_mem_lock);
+        do_slabs_release_page(page);
+        pthread_mutex_unlock(&slabs_mem_lock);
+    }
+    pthread_mutex_unlock(&slabs_lock[src]);
+
+    if (dst == 0) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Released a slab page of class %d\n", src);
+        return;
+    }
+
+    memset(page, 0, SLAB_PAGE_SIZE);
+
+    pthread_mutex_lock(&slabs_lock[dst]);
+    if (grow_slab_list(dst) == 0) {
+        /* Can't track another page in dst; give it back. */
+        pthread_mutex_unlock(&slabs_lock[dst]);
+        to = src;
+        d = s;
+        pthread_mutex_lock(&slabs_lock[src]);
+        grow_slab_list(src);
+    }
+    d->slab_list[d->slabs++] = page;
+    split_slab_page_into_freelist(page, to);
+    pthread_mutex_unlock(&slabs_lock[to]);
+
+    if (to == dst)
+        __atomic_add_fetch(&slabs_moved, 1, __ATOMIC_RELAXED);
+    if (settings.verbose > 0)
+        fprintf(stderr, "Moved a slab page from class %d to class %d\n",
+                src, to);
+}
+
+/* Empties a page of class src and gives it to dst; false if none could go. */
+static bool slab_rebalance_run(const int src, const int dst) {
+    char *page = slab_rebalance_start(src);
+    int passes = 0;
+
+    if (page == NULL)
+        return false;
+    while (slab_rebalance_move(src, page, passes >= SLAB_BUSY_PASSES_MAX) != 0) {
+        passes++;
+        usleep(1000);
+    }
+    slab_rebalance_finish(src, dst, page);
+    return true;
+}
+
+/*
+ * Class with the most whole pages' worth of free chunks, at least
+ * min_free_pages, that can spare a page; 0 if none.
+ */
+static int slabs_pick_sparse(const unsigned int min_free_pages) {
+    unsigned int free_pages, max_free = min_free_pages - 1;
+    int id, src = 0;
+
+    for (id = POWER_SMALLEST; id <= power_largest; id++) {
+        pthread_mutex_lock(&slabs_lock[id]);
+        free_pages = (slabclass[id].sl_curr + slabclass[id].end_page_free)
+                     / slabclass[id].perslab;
+        if (slabclass[id].slabs > 1 && free_pages > max_free) {
+            max_free = free_pages;
+            src = id;
+        }
+        pthread_mutex_unlock(&slabs_lock[id]);
+    }
+    return src;
+}
+
+/*
+ * Compaction: once a class's free chunks are scattered over enough pages,
+ * moves the items of its sparsest page into free chunks on the others and
+ * gives the page back to the OS. One page per call.
+ */
+static void slab_compact(void) {
+    int src = slabs_pick_sparse(SLAB_COMPACT_FREE_PAGES);
+
+    if (src != 0 && slab_rebalance_run(src, 0))
+        __atomic_add_fetch(&slabs_compacted, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Releases pages until memory is back under a lowered limit: first pages
+ * that can be emptied by moving items, then pages of the class with the
+ * most, evicting what doesn't fit elsewhere. Every class keeps one page,
+ * so the limit may not be reached.
+ */
+static void slab_shrink_to_limit(void) {
+    for (;;) {
+        bool over;
+        int src;
+
+        pthread_mutex_lock(&slabs_mem_lock);
+        over = mem_limit && mem_malloced > mem_limit;
+        pthread_mutex_unlock(&slabs_mem_lock);
+        if (!over)
+            return;
+
+        if ((src = slabs_pick_sparse(1)) == 0 &&
+            (src = slabs_pick_source(0)) == 0)
+            return;
+        if (!slab_rebalance_run(src, 0))
+            return;
+    }
+}
+
+/*
+ * Automove state, touched only by the rebalancer thread: per-class eviction
+ * counts at the last window, windows in a row without evictions, and how
+ * many windows in a row the same class evicted the most.
+ */
+static uint64_t automove_evicted[MAX_NUMBER_OF_SLAB_CLASSES];
+static unsigned int automove_idle[MAX_NUMBER_OF_SLAB_CLASSES];
+static int automove_dst = 0;
+static int automove_dst_windows = 0;
+
+/*
+ * Once a class has evicted the most for AUTOMOVE_WINDOWS windows running,
+ * moves it a page from a class that has stopped evicting: preferably the one
+ * with the most whole pages' worth of free chunks, else the one with the
+ * most pages.
+ */
+static void slab_automove_decide(void) {
+    uint64_t max_evicted = 0;
+    unsigned int max_free = 0, max_slabs = 1;
+    int src_free = 0, src_idle = 0, dst = 0;
+    int id;
+
+    for (id = POWER_SMALLEST; id <= power_largest; id++) {
+        uint64_t evicted, delta;
+        unsigned int slabs, free_pages;
+
+        item_lru_lock(id);
+        evicted = do_item_lru_evictions(id);
+        item_lru_unlock(id);
+        delta = evicted - automove_evicted[id];
+        automove_evicted[id] = evicted;
+
+        pthread_mutex_lock(&slabs_lock[id]);
+        slabs = slabclass[id].slabs;
+        free_pages = (slabclass[id].sl_curr + slabclass[id].end_page_free)
+                     / slabclass[id].perslab;
+        pthread_mutex_unlock(&slabs_lock[id]);
+
+        if (delta > max_evicted) {
+            max_evicted = delta;
+            dst = id;
+        }
+        if (delta != 0) {
+            automove_idle[id] = 0;
+            continue;
+        }
+        automove_idle[id]++;
+        if (slabs < 2)
+            continue;
+        if (free_pages > max_free) {
+            max_free = free_pages;
+            src_free = id;
+        }
+        if (automove_idle[id] >= AUTOMOVE_WINDOWS && slabs > max_slabs) {
+            max_slabs = slabs;
+            src_idle = id;
+        }
+    }
+
+    if (dst != 0 && dst == automove_dst) {
+        automove_dst_windows++;
+    } else {
+        automove_dst = dst;
+        automove_dst_windows = dst != 0;
+    }
+    if (automove_dst_windows < AUTOMOVE_WINDOWS)
+        return;
+
+    if (src_free != 0 || src_idle != 0) {
+        if (slabs_reassign(src_free ? src_free : src_idle, dst) == REASSIGN_OK)
+            automove_dst_windows = 0;
+    }
+}
+
+/*
+ * Runs reassign jobs as they come in. Otherwise wakes up once per window,
+ * or when the memory limit changes, to shrink memory down to the limit,
+ * compact if enabled, and look for a page to move if automove is on.
+ */
+static void *slab_rebalance_thread(void *arg) {
+    struct timespec deadline;
+    int src, dst;
+
+    pthread_mutex_lock(&slabs_rebalance_lock);
+    for (;;) {
+        if (!rebalance_requested) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += AUTOMOVE_WINDOW_USEC / 1000000;
+            pthread_cond_timedwait(&slabs_rebalance_cond,
+                                   &slabs_rebalance_lock, &deadline);
+        }
+        if (!rebalance_requested) {
+            pthread_mutex_unlock(&slabs_rebalance_lock);
+            slab_shrink_to_limit();
+            if (settings.slab_compact)
+                slab_compact();
+            if (settings.slab_automove)
+                slab_automove_decide();
+            pthread_mutex_lock(&slabs_rebalance_lock);
+            continue;
+        }
+
+        src = rebalance_src;
+        dst = rebalance_dst;
+        rebalance_requested = false;
+        rebalance_running = true;
+        pthread_mutex_unlock(&slabs_rebalance_lock);
+
+        slab_rebalance_run(src, dst);
+
+        pthread_mutex_lock(&slabs_rebalance_lock);
+        rebalance_running = false;
+    }
+    pthread_mutex_unlock(&slabs_rebalance_lock);
+    return NULL;
+}
+
+int start_slab_rebalance_thread(void) {
+    int ret;
+
+    if ((ret = pthread_create(&rebalance_tid, NULL,
+                              slab_rebalance_thread, NULL)) != 0) {
+        fprintf(stderr, "Can't create slab rebalance thread: %s\n",
+                strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+/* Class with the most pages to spare other than dst, or 0. */
+static int slabs_pick_source(const int dst) {
+    unsigned int max_slabs = 1;
+    int id, src = 0;
+
+    for (id = POWER_SMALLEST; id <= power_largest; id++) {
+        if (id == dst)
+            continue;
+        pthread_mutex_lock(&slabs_lock[id]);
+        if (slabclass[id].slabs > max_slabs) {
+            max_slabs = slabclass[id].slabs;
+            src = id;
+        }
+        pthread_mutex_unlock(&slabs_lock[id]);
+    }
+    return src;
+}
+
+enum reassign_result_type slabs_reassign(int src, const int dst) {
+    enum reassign_result_type ret = REASSIGN_OK;
+    unsigned int slabs;
+
+    if (src == dst)
+        return REASSIGN_SRC_DST_SAME;
+    if (dst < POWER_SMALLEST || dst > power_largest)
+        return REASSIGN_BADCLASS;
+    if (src == -1)
+        src = slabs_pick_source(dst);
+    else if (src < POWER_SMALLEST || src > power_largest)
+        return REASSIGN_BADCLASS;
+    if (src == 0)
+        return REASSIGN_NOSPARE;
+
+    pthread_mutex_lock(&slabs_lock[src]);
+    slabs = slabclass[src].slabs;
+    pthread_mutex_unlock(&slabs_lock[src]);
+    if (slabs < 2)
+        return REASSIGN_NOSPARE;
+
+    pthread_mutex_lock(&slabs_rebalance_lock);
+    if (rebalance_requested || rebalance_running) {
+        ret = REASSIGN_RUNNING;
+    } else {
+        rebalance_src = src;
+        rebalance_dst = dst;
+        rebalance_requested = true;
+        pthread_cond_signal(&slabs_rebalance_cond);
+    }
+    pthread_mutex_unlock(&slabs_rebalance_lock);
+    return ret;
+}
+
+void slabs_set_mem_limit(const size_t limit) {
+    pthread_mutex_lock(&slabs_mem_lock);
+    mem_limit = limit;
+    pthread_mutex_unlock(&slabs_mem_lock);
+
+    /* Wake the rebalancer to shrink if needed. */
+    pthread_mutex_lock(&slabs_rebalance_lock);
+    pthread_cond_signal(&slabs_rebalance_cond);
+    pthread_mutex_unlock(&slabs_rebalance_lock);
+}
+
+/* Bytes of the arena the kernel currently backs with huge pages. */
+static size_t arena_huge_bytes(void) {
+    uintptr_t lo = (uintptr_t)arena_base, hi = lo + arena_len;
+    uintptr_t start, end;
+    bool in_arena = false;
+    size_t kb, total = 0;
+    char line[256];
+    FILE *fp;
+
+    if (arena_base == NULL || (fp = fopen("/proc/self/smaps", "r")) == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR, &start, &end) == 2) {
+            in_arena = start >= lo && start < hi;
+        } else if (in_arena &&
+                   (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1 ||
+                    sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1 ||
+                    sscanf(line, "Shared_Hugetlb: %zu kB", &kb) == 1)) {
+            total += kb * 1024;
+        }
+    }
+    fclose(fp);
+    return total;
+}
+
+void slabs_get_arena_stats(slabs_arena_stats_t *as) {
+    as->type = arena_type;
+    as->page_size = arena_page_size;
+    as->huge_bytes = arena_huge_bytes();
+}
+
+void slabs_get_rebalance_stats(slabs_rebalance_stats_t *rs) {
+    pthread_mutex_lock(&slabs_rebalance_lock);
+    rs->running = rebalance_requested || rebalance_running;
+    pthread_mutex_unlock(&slabs_rebalance_lock);
+    pthread_mutex_lock(&slabs_mem_lock);
+    rs->mem_limit = mem_limit;
+    rs->mem_malloced = mem_malloced;
+    pthread_mutex_unlock(&slabs_mem_lock);
+    rs->slabs_compacted = __atomic_load_n(&slabs_compacted, __ATOMIC_RELAXED);
+    rs->slabs_released = __atomic_load_n(&slabs_released, __ATOMIC_RELAXED);
+    rs->slabs_moved = __atomic_load_n(&slabs_moved, __ATOMIC_RELAXED);
+    rs->rescues = __atomic_load_n(&rebalance_rescues, __ATOMIC_RELAXED);
+    rs->evictions = __atomic_load_n(&rebalance_evictions, __ATOMIC_RELAXED);
+    rs->busy_items = __atomic_load_n(&rebalance_busy_items, __ATOMIC_RELAXED);
+}
@@ -1,37 +1,82 @@
-/* slabs memory allocation */
-#ifndef SLABS_H
-#define SLABS_H
-
-#include <stdint.h>
-#include <stdbool.h>
-#include <stddef.h>
-
-/** Init the subsystem. 1st argument is the limit on no. of bytes to allocate,
-    0 if no limit. 2nd argument is the growth factor; each slab will use a chunk
-    size equal to the previous slab's chunk size times this factor.
-    3rd argument specifies if the slab allocator should allocate all memory
-    up front (if true), or allocate memory in chunks as it is needed (if false)
-*/
-void slabs_init(const size_t limit, const double factor, const bool prealloc);
-
-
-/**
- * Given object size, return id to use when allocating/freeing memory for object
- * 0 means error: can't store such a large object
- */
-
-unsigned int slabs_clsid(const size_t size);
-
-/** Allocate object of given length. 0 on error */ /*@null@*/
-void *slabs_alloc(const size_t size, unsigned int id);
-
-/** Free previously allocated object */
-void slabs_free(void *ptr, size_t size, unsigned int id);
-
-/** Adjust memory requested for one slab */
-void slabs_adjust_mem_requested(unsigned int id, size_t old, size_t ntotal);
-
-
-
-
-#endif
+/* slabs memory allocation */
+#ifndef SLABS_H
+#define SLABS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Init the subsystem. 1st argument is the limit on no. of bytes to allocate,
+    0 if no limit. 2nd argument is the growth factor; each slab will use a chunk
+    size equal to the previous slab's chunk size times this factor.
+    3rd argument specifies if the slab allocator should allocate all memory
+    up front (if true), or allocate memory in chunks as it is needed (if false)
+*/
+void slabs_init(const size_t limit, const double factor, const bool prealloc);
+
+
+/**
+ * Given object size, return id to use when allocating/freeing memory for object
+ * 0 means error: can't store such a large object
+ */
+
+unsigned int slabs_clsid(const size_t size);
+
+/** Allocate object of given length. 0 on error */ /*@null@*/
+void *slabs_alloc(const size_t size, unsigned int id);
+
+/** Free previously allocated object */
+void slabs_free(void *ptr, size_t size, unsigned int id);
+
+/** Adjust memory requested for one slab */
+void slabs_adjust_mem_requested(unsigned int id, size_t old, size_t ntotal);
+
+/** Start the thread that moves pages between classes */
+int start_slab_rebalance_thread(void);
+
+enum reassign_result_type {
+    REASSIGN_OK = 0,
+    REASSIGN_RUNNING,       /* a page move is already in progress */
+    REASSIGN_BADCLASS,      /* no such class */
+    REASSIGN_NOSPARE,       /* source has no page to spare */
+    REASSIGN_SRC_DST_SAME
+};
+
+/**
+ * Ask for a page of class src to be given to class dst; src -1 picks the
+ * class with the most pages. The move itself runs in the background.
+ */
+enum reassign_result_type slabs_reassign(int src, const int dst);
+
+/**
+ * Change the limit on item memory at runtime. Lowering it below what is in
+ * use has the rebalancer thread empty pages and return them to the OS.
+ */
+void slabs_set_mem_limit(const size_t limit);
+
+typedef struct {
+    bool running;
+    size_t mem_limit;
+    size_t mem_malloced;    /* bytes in pages assigned to classes */
+    uint64_t slabs_moved;   /* pages handed to another class */
+    uint64_t rescues;       /* items moved out of a dying page */
+    uint64_t evictions;     /* items evicted from a dying page */
+    uint64_t busy_items;    /* in-use items unlinked after waiting too long */
+    uint64_t slabs_compacted;   /* pages emptied by compaction */
+    uint64_t slabs_released;    /* pages returned to the OS */
+} slabs_rebalance_stats_t;
+
+void slabs_get_rebalance_stats(slabs_rebalance_stats_t *rs);
+
+typedef struct {
+    enum slab_arena_type type;  /* what the arena ended up as */
+    size_t page_size;           /* page size backing item memory */
+    size_t huge_bytes;          /* arena bytes backed by huge pages now */
+} slabs_arena_stats_t;
+
+void slabs_get_arena_stats(slabs_arena_stats_t *as);
+
+
+
+
+#endif
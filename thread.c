@@ -0,0 +1,392 @@
+/*
+ * Locking and statistics for simple_memcached's worker threads.
+ *
+ * Items are protected by a table of striped mutexes indexed by the key's
+ * hash value; the item_*() wrappers take the right lock around the do_*()
+ * functions in items.c. Event counters are kept per thread. Starting the
+ * workers is thread_net.c's business, so the engine links without the
+ * network side.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "simple_memcached.h"
+
+/* Lock for the list of per-thread stats blocks */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Striped locks protecting items and the hash chains they live on. */
+static pthread_mutex_t *item_locks;
+/* size of the item lock hash table */
+static uint32_t item_lock_count;
+static unsigned int item_lock_hashpower;
+#define hashsize(n) ((unsigned long int)1<<(n))
+#define hashmask(n) (hashsize(n)-1)
+
+unsigned short refcount_incr(unsigned short *refcount) {
+    return __sync_add_and_fetch(refcount, 1);
+}
+
+unsigned short refcount_decr(unsigned short *refcount) {
+    return __sync_sub_and_fetch(refcount, 1);
+}
+
+void item_lock(uint32_t hv) {
+    pthread_mutex_lock(&item_locks[hv & hashmask(item_lock_hashpower)]);
+}
+
+void item_unlock(uint32_t hv) {
+    pthread_mutex_unlock(&item_locks[hv & hashmask(item_lock_hashpower)]);
+}
+
+/*
+ * Used by the eviction path, which already holds an LRU lock and so must not
+ * block on an item lock (lock order is item lock -> LRU lock). Returns the
+ * lock to pass to item_trylock_unlock(), or NULL if it is busy.
+ */
+void *item_trylock(uint32_t hv) {
+    pthread_mutex_t *lock = &item_locks[hv & hashmask(item_lock_hashpower)];
+    if (pthread_mutex_trylock(lock) == 0) {
+        return lock;
+    }
+    return NULL;
+}
+
+void item_trylock_unlock(void *lock) {
+    pthread_mutex_unlock((pthread_mutex_t *) lock);
+}
+
+/*
+ * Takes every item lock, in index order so that two callers can't deadlock.
+ * Used when the hash table itself is swapped out from under the readers.
+ */
+void item_lock_all(void) {
+    uint32_t i;
+    for (i = 0; i < item_lock_count; i++) {
+        pthread_mutex_lock(&item_locks[i]);
+    }
+}
+
+void item_unlock_all(void) {
+    uint32_t i;
+    for (i = 0; i < item_lock_count; i++) {
+        pthread_mutex_unlock(&item_locks[i]);
+    }
+}
+
+/********************************* ITEM ACCESS *******************************/
+
+item *item_alloc(char *key, size_t nkey, uint32_t flags, rel_time_t exptime, int nbytes,
+                 bool *rejected){
+    item* it;
+    it= do_item_alloc(key, nkey, flags, exptime, nbytes, rejected);
+    STATS_INCR(put_cmds);
+    if (it !=NULL){
+        mrc_record(it->hv, ITEM_ntotal(it), false);
+        STATS_INCR(put_hits);
+    }
+    else{
+        STATS_INCR(put_misses);
+    }
+    return it;
+
+
+}
+
+/*
+ * Returns an item if it hasn't been marked as expired,
+ * lazy-expiring as needed.
+ */
+item *item_get(const char *key, const size_t nkey){
+    item* it;
+    uint32_t hv = hash(key, nkey);
+    uint64_t start;
+    if (settings.admission != ADMISSION_NONE)
+        tinylfu_record(hv);
+    start = latency_ticks();
+    item_lock(hv);
+    it = do_item_get(key, nkey, hv);
+    item_unlock(hv);
+    LATENCY_RECORD(LATENCY_HASH_LOOKUP, start);
+    mrc_record(hv, it != NULL ? ITEM_ntotal(it) : 0, true);
+    STATS_INCR(get_cmds);
+    if(it !=NULL){
+        STATS_INCR(get_hits);
+    }
+    else{
+        STATS_INCR(get_misses);
+    }
+
+    return it;
+}
+
+/*
+ * Looks up n keys, at most GET_BATCH_MAX, as one batch: all hash values
+ * first, then the buckets are prefetched for every key, then the item
+ * headers, and only then are keys compared. The cache misses of the
+ * lookups overlap instead of being taken one key at a time. its[i] gets
+ * the item for keys[i], referenced like item_get() returns it, or NULL.
+ */
+void item_get_batch(char **keys, const size_t *nkeys, const int n, item **its){
+    uint32_t hvs[GET_BATCH_MAX];
+    uint64_t then, now;
+    int i, hits = 0;
+
+    assert(n <= GET_BATCH_MAX);
+
+    for (i = 0; i < n; i++) {
+        hvs[i] = hash(keys[i], nkeys[i]);
+        hash_prefetch_bucket(hvs[i]);
+    }
+    for (i = 0; i < n; i++) {
+        if (settings.admission != ADMISSION_NONE)
+            tinylfu_record(hvs[i]);
+        item_lock(hvs[i]);
+        hash_prefetch_items(hvs[i]);
+        item_unlock(hvs[i]);
+    }
+    /* One clock reading per key: each lookup ends where the next starts. */
+    then = latency_ticks();
+    for (i = 0; i < n; i++) {
+        item_lock(hvs[i]);
+        its[i] = do_item_get(keys[i], nkeys[i], hvs[i]);
+        item_unlock(hvs[i]);
+        now = latency_ticks();
+        LATENCY_ADD(LATENCY_HASH_LOOKUP, latency_ns(now - then));
+        then = now;
+        mrc_record(hvs[i], its[i] != NULL ? ITEM_ntotal(its[i]) : 0, true);
+        if (its[i] != NULL)
+            hits++;
+    }
+
+    STATS_ADD(get_cmds, n);
+    STATS_ADD(get_hits, hits);
+    STATS_ADD(get_misses, n - hits);
+    STATS_INCR(get_batches);
+    STATS_ADD(get_batch_keys, n);
+}
+
+item *item_touch(const char *key, const size_t nkey, uint32_t exptime){
+    item* it;
+    uint32_t hv = hash(key, nkey);
+    item_lock(hv);
+    it = do_item_touch( key, nkey, exptime, hv);
+    item_unlock(hv);
+    return it;
+}
+
+/*
+ * Links an item into the LRU and hashtable.
+ */
+int item_link(item *it){
+    uint32_t hv = it->hv;
+    int link_success;
+    item_lock(hv);
+    link_success = do_item_link(it, hv);
+    item_unlock(hv);
+    if(link_success == 0){
+        return 0;
+    }
+    STATS_INCR(total_items);
+    return 1;
+}
+
+/*
+ * Stores an item, replacing any existing one with the same key.
+ */
+int item_store(item *it){
+    uint32_t hv = it->hv;
+    int store_success;
+    item_lock(hv);
+    store_success = do_store_item(it, hv);
+    item_unlock(hv);
+    if(store_success == 0){
+        return 0;
+    }
+    STATS_INCR(total_items);
+    return 1;
+}
+
+/*
+ * Decrements the reference count on an item and adds it to the freelist if
+ * needed.
+ */
+void  item_remove(item *it){
+    uint32_t hv;
+    hv = it->hv;
+
+    item_lock(hv);
+    do_item_remove(it);
+    item_unlock(hv);
+}
+
+/*
+ * Unlinks an item from the LRU and hashtable.
+ */
+void  item_unlink(item *it){
+    uint32_t hv;
+    hv = it->hv;
+    item_lock(hv);
+    do_item_unlink(it, hv);
+    item_unlock(hv);
+}
+
+/*
+ * Unlinks whatever item is stored under key, if any. Returns false if there
+ * was none. Unlike item_get(), this is not a read: the admission sketch and
+ * the miss ratio curve sampler don't see it.
+ */
+bool  item_unlink_key(const char *key, const size_t nkey){
+    item *it;
+    uint32_t hv = hash(key, nkey);
+    item_lock(hv);
+    it = do_item_get(key, nkey, hv);
+    if (it != NULL) {
+        do_item_unlink(it, hv);
+        do_item_remove(it);
+    }
+    item_unlock(hv);
+    return it != NULL;
+}
+
+/*
+ * Moves an item to the back of the LRU queue.
+ */
+void  item_update(item *it){
+    uint32_t hv;
+    hv = it->hv;
+
+    item_lock(hv);
+    do_item_update(it);
+    item_unlock(hv);
+}
+
+/******************************* GLOBAL STATS ******************************/
+
+/*
+ * Counter blocks, one per thread that ever counted something. Threads live
+ * as long as the process, so blocks are never freed.
+ */
+typedef struct stats_block {
+    thread_stats_t counters;
+    struct stats_block *next;
+} __attribute__((aligned(64))) stats_block_t;
+
+#define STATS_WORDS (sizeof(thread_stats_t) / sizeof(uint64_t))
+_Static_assert(sizeof(thread_stats_t) % sizeof(uint64_t) == 0,
+               "thread_stats_t must only hold uint64_t counters");
+
+__thread thread_stats_t *thread_stats_block = NULL;
+static stats_block_t *stats_blocks = NULL;
+static thread_stats_t stats_baseline;   /* totals at the last reset */
+
+thread_stats_t *thread_stats_register(void) {
+    stats_block_t *b = aligned_alloc(64, sizeof(stats_block_t));
+
+    if (b == NULL) {
+        fprintf(stderr, "Failed to allocate thread stats\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(b, 0, sizeof(*b));
+
+    pthread_mutex_lock(&stats_lock);
+    b->next = stats_blocks;
+    stats_blocks = b;
+    pthread_mutex_unlock(&stats_lock);
+
+    thread_stats_block = &b->counters;
+    return thread_stats_block;
+}
+
+/* Caller holds stats_lock. */
+static void do_stats_snapshot(thread_stats_t *out) {
+    uint64_t *sum = (uint64_t *)out;
+    stats_block_t *b;
+    size_t i;
+
+    memset(out, 0, sizeof(*out));
+    for (b = stats_blocks; b != NULL; b = b->next) {
+        const uint64_t *words = (const uint64_t *)&b->counters;
+
+        for (i = 0; i < STATS_WORDS; i++)
+            sum[i] += __atomic_load_n(&words[i], __ATOMIC_RELAXED);
+    }
+}
+
+void stats_snapshot(thread_stats_t *out) {
+    pthread_mutex_lock(&stats_lock);
+    do_stats_snapshot(out);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_since_reset(thread_stats_t *out) {
+    uint64_t *sum = (uint64_t *)out;
+    const uint64_t *base = (const uint64_t *)&stats_baseline;
+    uint64_t current_bytes;
+    size_t i;
+
+    pthread_mutex_lock(&stats_lock);
+    do_stats_snapshot(out);
+    current_bytes = out->current_bytes;
+    for (i = 0; i < STATS_WORDS; i++)
+        sum[i] -= base[i];
+    out->current_bytes = current_bytes;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Counters are only ever written by their own thread, so instead of
+ * zeroing them under its feet we remember where they stood.
+ */
+void stats_reset(void) {
+    pthread_mutex_lock(&stats_lock);
+    do_stats_snapshot(&stats_baseline);
+    pthread_mutex_unlock(&stats_lock);
+    mrc_reset();
+}
+
+/*
+ * Sets up the item lock table, sized for nthreads workers. Called by
+ * engine_init().
+ */
+void item_locks_init(int nthreads) {
+    int         i;
+    int         power;
+
+    /* Want a wide lock table, but don't waste memory */
+    if (nthreads < 3) {
+        power = 10;
+    } else if (nthreads < 4) {
+        power = 11;
+    } else if (nthreads < 5) {
+        power = 12;
+    } else {
+        power = 13;
+    }
+
+    /* A lock must never cover more than one hash bucket's worth of keys. */
+    if (power >= hashpower) {
+        fprintf(stderr, "Hash table power size (%d) cannot be equal to or less than item lock table (%d)\n", hashpower, power);
+        fprintf(stderr, "Item lock table grows with `-t N` (worker threadcount)\n");
+        fprintf(stderr, "Hash table grows with `-H N`\n");
+        exit(1);
+    }
+
+    item_lock_count = hashsize(power);
+    item_lock_hashpower = power;
+
+    item_locks = calloc(item_lock_count, sizeof(pthread_mutex_t));
+    if (! item_locks) {
+        perror("Can't allocate item locks");
+        exit(1);
+    }
+    for (i = 0; i < item_lock_count; i++) {
+        pthread_mutex_init(&item_locks[i], NULL);
+    }
+}
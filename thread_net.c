@@ -0,0 +1,254 @@
+/*
+ * Worker threads for simple_memcached.
+ *
+ * The main thread only accepts connections; each accepted socket is handed
+ * to one of settings.num_threads worker threads, which runs its own epoll
+ * loop over the connections it owns.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "simple_memcached.h"
+
+/* An item in the connection queue. */
+typedef struct conn_queue_item CQ_ITEM;
+struct conn_queue_item {
+    int               sfd;
+    enum conn_states  init_state;
+    CQ_ITEM          *next;
+};
+
+/* A connection queue. */
+typedef struct conn_queue CQ;
+struct conn_queue {
+    CQ_ITEM *head;
+    CQ_ITEM *tail;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Each worker thread has its own epoll instance and a queue of new
+ * connections handed to it by the main thread.
+ */
+static worker_thread_t *threads;
+
+/*
+ * Number of worker threads that have finished setting themselves up.
+ */
+static int init_count = 0;
+static pthread_mutex_t init_lock;
+static pthread_cond_t init_cond;
+
+static void thread_notify_process(void *arg);
+
+/*
+ * Initializes a connection queue.
+ */
+static void cq_init(CQ *cq) {
+    pthread_mutex_init(&cq->lock, NULL);
+    cq->head = NULL;
+    cq->tail = NULL;
+}
+
+/*
+ * Looks for an item on a connection queue, but doesn't block if there isn't
+ * one.
+ * Returns the item, or NULL if no item is available
+ */
+static CQ_ITEM *cq_pop(CQ *cq) {
+    CQ_ITEM *item;
+
+    pthread_mutex_lock(&cq->lock);
+    item = cq->head;
+    if (NULL != item) {
+        cq->head = item->next;
+        if (NULL == cq->head)
+            cq->tail = NULL;
+    }
+    pthread_mutex_unlock(&cq->lock);
+
+    return item;
+}
+
+/*
+ * Adds an item to a connection queue.
+ */
+static void cq_push(CQ *cq, CQ_ITEM *item) {
+    item->next = NULL;
+
+    pthread_mutex_lock(&cq->lock);
+    if (NULL == cq->tail)
+        cq->head = item;
+    else
+        cq->tail->next = item;
+    cq->tail = item;
+    pthread_mutex_unlock(&cq->lock);
+}
+
+/*
+ * Creates a worker thread.
+ */
+static void create_worker(void *(*func)(void *), void *arg) {
+    pthread_attr_t  attr;
+    int             ret;
+
+    pthread_attr_init(&attr);
+
+    if ((ret = pthread_create(&((worker_thread_t*)arg)->thread_id, &attr, func, arg)) != 0) {
+        fprintf(stderr, "Can't create thread: %s\n",
+                strerror(ret));
+        exit(1);
+    }
+}
+
+/*
+ * Set up a thread's epoll instance and notification pipe.
+ */
+static void setup_thread(worker_thread_t *me) {
+    struct epoll_event ev;
+    int fds[2];
+
+    me->epfd = epoll_create1(0);
+    if (me->epfd == -1) {
+        perror("Can't create epoll instance");
+        exit(1);
+    }
+
+    if (pipe2(fds, O_NONBLOCK)) {
+        perror("Can't create notify pipe");
+        exit(1);
+    }
+    me->notify_receive_fd = fds[0];
+    me->notify_send_fd = fds[1];
+
+    /* A NULL data pointer tells event_loop() this is the notify pipe. */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(me->epfd, EPOLL_CTL_ADD, me->notify_receive_fd, &ev) == -1) {
+        perror("Can't monitor notify pipe");
+        exit(1);
+    }
+
+    me->new_conn_queue = malloc(sizeof(struct conn_queue));
+    if (me->new_conn_queue == NULL) {
+        perror("Failed to allocate memory for connection queue");
+        exit(EXIT_FAILURE);
+    }
+    cq_init(me->new_conn_queue);
+}
+
+/*
+ * Worker thread: main event loop
+ */
+static void *worker_thread(void *arg) {
+    worker_thread_t *me = arg;
+
+    pthread_mutex_lock(&init_lock);
+    init_count++;
+    pthread_cond_signal(&init_cond);
+    pthread_mutex_unlock(&init_lock);
+
+    event_loop(me->epfd, thread_notify_process, me);
+    return NULL;
+}
+
+/*
+ * Processes an incoming "handle a new connection" item. This is called when
+ * input arrives on the notify pipe.
+ */
+static void thread_notify_process(void *arg) {
+    worker_thread_t *me = arg;
+    CQ_ITEM *item;
+    char buf[64];
+
+    /* Drain the pipe; each byte announces one queued connection. */
+    while (read(me->notify_receive_fd, buf, sizeof(buf)) > 0)
+        ;
+
+    while ((item = cq_pop(me->new_conn_queue)) != NULL) {
+        conn *c = conn_new(item->sfd, item->init_state, me->epfd, me);
+        if (c == NULL) {
+            if (settings.verbose > 0) {
+                fprintf(stderr, "Can't listen for events on fd %d\n",
+                    item->sfd);
+            }
+            close(item->sfd);
+        }
+        free(item);
+    }
+}
+
+/* Which thread we assigned a connection to most recently. */
+static int last_thread = -1;
+
+/*
+ * Dispatches a new connection to another thread. This is only ever called
+ * from the main thread, when a new connection is accepted.
+ */
+void dispatch_conn_new(int sfd, enum conn_states init_state) {
+    CQ_ITEM *item = malloc(sizeof(CQ_ITEM));
+    if (item == NULL) {
+        close(sfd);
+        /* given that malloc failed this may also fail, but let's try */
+        fprintf(stderr, "Failed to allocate memory for connection object\n");
+        return;
+    }
+
+    int tid = (last_thread + 1) % settings.num_threads;
+
+    worker_thread_t *thread = threads + tid;
+
+    last_thread = tid;
+
+    item->sfd = sfd;
+    item->init_state = init_state;
+
+    cq_push(thread->new_conn_queue, item);
+
+    if (write(thread->notify_send_fd, "", 1) != 1) {
+        perror("Writing to thread notify pipe");
+    }
+}
+
+/*
+ * Initializes the thread subsystem, creating various worker threads. The
+ * item locks are engine_init()'s.
+ *
+ * nthreads  Number of worker threads to create
+ */
+void thread_init(int nthreads) {
+    int         i;
+
+    pthread_mutex_init(&init_lock, NULL);
+    pthread_cond_init(&init_cond, NULL);
+
+    threads = calloc(nthreads, sizeof(worker_thread_t));
+    if (! threads) {
+        perror("Can't allocate thread descriptors");
+        exit(1);
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        setup_thread(&threads[i]);
+    }
+
+    /* Create threads after we've done all the epoll setup. */
+    for (i = 0; i < nthreads; i++) {
+        create_worker(worker_thread, &threads[i]);
+    }
+
+    /* Wait for all the threads to set themselves up before returning. */
+    pthread_mutex_lock(&init_lock);
+    while (init_count < nthreads) {
+        pthread_cond_wait(&init_cond, &init_lock);
+    }
+    pthread_mutex_unlock(&init_lock);
+}
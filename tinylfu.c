@@ -0,0 +1,142 @@
+/*
+ * TinyLFU frequency sketch, see tinylfu.h.
+ *
+ * Workers record accesses concurrently without a lock. Counters and filter
+ * words are read and written with relaxed atomics: two threads bumping the
+ * same counter at once may lose one of the increments, which the estimate
+ * can afford.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "tinylfu.h"
+
+#define SKETCH_ROWS 4
+#define COUNTER_MAX 15
+
+/* Accesses per counter between two agings. */
+#define SAMPLE_FACTOR 10
+
+static const uint64_t row_seeds[SKETCH_ROWS] = {
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+    0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+
+static const uint64_t door_seeds[2] = {
+    0xFF51AFD7ED558CCDULL, 0xC4CEB9FE1A85EC53ULL
+};
+
+/* SKETCH_ROWS rows of 2^width_power counters, one byte each. */
+static uint8_t *counters;
+static unsigned int width_power;
+
+/* Doorkeeper bloom filter, 2^(width_power + 3) bits. */
+static uint64_t *doorkeeper;
+
+static uint64_t additions = 0;
+static uint64_t sample_size;
+static uint64_t resets = 0;
+
+/* Multiply-shift: the top bits bits of hv scrambled by seed. */
+static inline uint64_t sketch_index(const uint32_t hv, const uint64_t seed,
+                                    const unsigned int bits) {
+    return (((uint64_t)hv + 1) * seed) >> (64 - bits);
+}
+
+int tinylfu_init(const size_t nitems) {
+    size_t width;
+
+    width_power = 10;
+    while (((size_t)1 << width_power) < nitems && width_power < 30)
+        width_power++;
+    width = (size_t)1 << width_power;
+
+    counters = calloc(SKETCH_ROWS, width);
+    doorkeeper = calloc(width / 8, sizeof(uint64_t));
+    if (counters == NULL || doorkeeper == NULL) {
+        fprintf(stderr, "Failed to allocate the admission sketch\n");
+        return -1;
+    }
+    sample_size = (uint64_t)width * SAMPLE_FACTOR;
+    return 0;
+}
+
+static bool doorkeeper_contains(const uint32_t hv) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        uint64_t bit = sketch_index(hv, door_seeds[i], width_power + 3);
+        if ((__atomic_load_n(&doorkeeper[bit >> 6], __ATOMIC_RELAXED)
+             & (1ULL << (bit & 63))) == 0)
+            return false;
+    }
+    return true;
+}
+
+static void doorkeeper_add(const uint32_t hv) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        uint64_t bit = sketch_index(hv, door_seeds[i], width_power + 3);
+        __atomic_fetch_or(&doorkeeper[bit >> 6], 1ULL << (bit & 63),
+                          __ATOMIC_RELAXED);
+    }
+}
+
+/* Halves every counter and empties the doorkeeper. */
+static void sketch_age(void) {
+    size_t i, n = (size_t)SKETCH_ROWS << width_power;
+
+    for (i = 0; i < n; i++) {
+        uint8_t c = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        __atomic_store_n(&counters[i], c >> 1, __ATOMIC_RELAXED);
+    }
+    n = ((size_t)1 << width_power) / 8;
+    for (i = 0; i < n; i++)
+        __atomic_store_n(&doorkeeper[i], 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&resets, 1, __ATOMIC_RELAXED);
+}
+
+void tinylfu_record(const uint32_t hv) {
+    int r;
+
+    /* The thread that completes a sample ages the sketch. */
+    if (__atomic_add_fetch(&additions, 1, __ATOMIC_RELAXED) == sample_size) {
+        sketch_age();
+        __atomic_store_n(&additions, 0, __ATOMIC_RELAXED);
+    }
+
+    /* One-hit wonders stop at the doorkeeper. */
+    if (!doorkeeper_contains(hv)) {
+        doorkeeper_add(hv);
+        return;
+    }
+
+    for (r = 0; r < SKETCH_ROWS; r++) {
+        uint8_t *c = &counters[((size_t)r << width_power)
+                               + sketch_index(hv, row_seeds[r], width_power)];
+        uint8_t v = __atomic_load_n(c, __ATOMIC_RELAXED);
+        if (v < COUNTER_MAX)
+            __atomic_store_n(c, v + 1, __ATOMIC_RELAXED);
+    }
+}
+
+unsigned int tinylfu_estimate(const uint32_t hv) {
+    unsigned int min = COUNTER_MAX;
+    int r;
+
+    for (r = 0; r < SKETCH_ROWS; r++) {
+        uint8_t v = __atomic_load_n(&counters[((size_t)r << width_power)
+                                              + sketch_index(hv, row_seeds[r], width_power)],
+                                    __ATOMIC_RELAXED);
+        if (v < min)
+            min = v;
+    }
+    return min + (doorkeeper_contains(hv) ? 1 : 0);
+}
+
+uint64_t tinylfu_resets(void) {
+    return __atomic_load_n(&resets, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,22 @@
+#ifndef TINYLFU_H
+#define TINYLFU_H
+
+/*
+ * Frequency sketch for TinyLFU admission: a doorkeeper bloom filter that
+ * absorbs first accesses, in front of a count-min sketch of 4-bit counters
+ * that is halved every few accesses per counter so old popularity fades.
+ */
+
+// Size the sketch to track about nitems distinct keys
+int tinylfu_init(const size_t nitems);
+
+// Count one access to the key with hash value hv
+void tinylfu_record(const uint32_t hv);
+
+// Estimated recent access count of the key with hash value hv
+unsigned int tinylfu_estimate(const uint32_t hv);
+
+// Number of times the sketch has been aged
+uint64_t tinylfu_resets(void);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Text protocol tokenizer, see tokenize.h.
+ *
+ * Lines are scanned a block at a time: AVX2 compares 32 bytes per step,
+ * SSE2 16, and elsewhere an 8-byte word is searched with the usual zero
+ * byte trick. Each step yields a bitmask of the spaces in the block, and
+ * tokens fall out of walking its set bits, so a short GET line costs one
+ * or two compares instead of a branch per byte.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "tokenize.h"
+
+#if defined(__AVX2__)
+
+#define BLOCK_BYTES 32
+
+static inline uint32_t space_mask(const char *p) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+
+#elif defined(__SSE2__)
+
+#define BLOCK_BYTES 16
+
+static inline uint32_t space_mask(const char *p) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+
+#else
+
+#define BLOCK_BYTES 8
+
+/* Find the zero bytes of v ^ "        ", then gather the high bit of every
+   byte into the low 8 bits. */
+static inline uint32_t space_mask(const char *p) {
+    const uint64_t lo7 = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    v ^= 0x2020202020202020ULL;
+    v = ~(((v & lo7) + lo7) | v | lo7);
+    return (uint32_t)(((v >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+#endif
+
+_Static_assert(BLOCK_BYTES <= TOKENIZE_PADDING, "blocks may overrun the line by TOKENIZE_PADDING");
+
+size_t tokenize_command(char *command, const size_t len, token_t *tokens,
+                        const size_t max_tokens) {
+    char *s = command;      /* start of the token being scanned */
+    size_t ntokens = 0;
+    size_t base;
+
+    assert(command != NULL && tokens != NULL && max_tokens > 1);
+
+    for (base = 0; base < len; base += BLOCK_BYTES) {
+        uint32_t mask = space_mask(command + base);
+
+        if (len - base < BLOCK_BYTES)
+            mask &= (1U << (len - base)) - 1;
+
+        while (mask != 0) {
+            char *e = command + base + __builtin_ctz(mask);
+
+            mask &= mask - 1;
+            if (e != s) {
+                tokens[ntokens].value = s;
+                tokens[ntokens].length = e - s;
+                ntokens++;
+                if (ntokens == max_tokens - 1) {
+                    s = e + 1;
+                    goto full;
+                }
+            }
+            s = e + 1;
+        }
+    }
+
+    if (s < command + len) {
+        tokens[ntokens].value = s;
+        tokens[ntokens].length = command + len - s;
+        ntokens++;
+    }
+    s = command + len;
+
+full:
+    tokens[ntokens].value = s < command + len ? s : NULL;
+    tokens[ntokens].length = 0;
+    ntokens++;
+
+    return ntokens;
+}
+
+bool token_to_uint64(const token_t *t, uint64_t *out) {
+    uint64_t v = 0;
+    size_t i;
+
+    if (t->length == 0)
+        return false;
+    for (i = 0; i < t->length; i++) {
+        unsigned int d = (unsigned char)t->value[i] - '0';
+
+        if (d > 9 || v > (UINT64_MAX - d) / 10)
+            return false;
+        v = v * 10 + d;
+    }
+    *out = v;
+    return true;
+}
+
+bool token_to_uint32(const token_t *t, uint32_t *out) {
+    uint64_t v;
+
+    if (!token_to_uint64(t, &v) || v > UINT32_MAX)
+        return false;
+    *out = v;
+    return true;
+}
+
+bool token_to_int32(const token_t *t, int32_t *out) {
+    token_t digits = *t;
+    bool negative = false;
+    uint32_t v;
+
+    if (digits.length > 0 && digits.value[0] == '-') {
+        negative = true;
+        digits.value++;
+        digits.length--;
+    }
+    if (!token_to_uint32(&digits, &v) || v > (negative ? 2147483648U : INT32_MAX))
+        return false;
+    *out = negative ? (int32_t)(0 - (int64_t)v) : (int32_t)v;
+    return true;
+}
@@ -0,0 +1,49 @@
+#ifndef TOKENIZE_H
+#define TOKENIZE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Text protocol tokenizer. Lines are split where they stand in the read
+ * buffer: nothing is written to them, so tokens are not NUL-terminated and
+ * have to be compared by length.
+ */
+
+/* Readable bytes a line buffer must have past its end, see tokenize_command(). */
+#define TOKENIZE_PADDING 32
+
+typedef struct token_s {
+    char *value;
+    size_t length;
+} token_t;
+
+/*
+ * Splits the len bytes at command on spaces into tokens. Returns the total
+ * number of tokens, the last of which is the terminal token: length zero,
+ * value NULL if the whole line was consumed, otherwise the first character
+ * left unprocessed because max_tokens - 1 tokens were found.
+ *
+ * Spaces are searched a vector at a time, which may read up to
+ * TOKENIZE_PADDING bytes past command + len; they must be addressable, but
+ * their contents don't matter.
+ */
+size_t tokenize_command(char *command, const size_t len, token_t *tokens,
+                        const size_t max_tokens);
+
+/* True if the token is exactly the string literal lit. */
+#define token_is(t, lit) \
+    ((t)->length == sizeof(lit) - 1 && memcmp((t)->value, lit, sizeof(lit) - 1) == 0)
+
+/*
+ * Decimal integer fields. The whole token must be digits, with a leading
+ * '-' allowed only for the signed type; false on anything else or on
+ * overflow.
+ */
+bool token_to_uint32(const token_t *t, uint32_t *out);
+bool token_to_uint64(const token_t *t, uint64_t *out);
+bool token_to_int32(const token_t *t, int32_t *out);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Benchmark for the text protocol tokenizer in tokenize.c.
+ *
+ * Tokenizes a set of realistic get and set command lines and reports the
+ * time per line, against the byte-at-a-time tokenizer the server used
+ * before: a strlen() pass, then a loop that writes a NUL after every
+ * token. Both get a fresh copy of each line per round, as the old one
+ * consumes its input; the copy alone is timed too so it can be
+ * subtracted. Every line is first checked to produce the same tokens
+ * both ways.
+ *
+ * Build: make tokenize_bench
+ *        (CFLAGS="-O2 -mavx2" for the 32-byte path)
+ * Usage: tokenize_bench [-n lines] [-r rounds]
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tokenize.h"
+
+#define MAX_TOKENS 8
+#define LINE_MAX_BYTES 320
+
+typedef struct {
+    const char *name;
+    const char *fmt;    /* printf format taking the key number twice */
+} line_shape_t;
+
+static const line_shape_t line_shapes[] = {
+    { "get short",  "get u:%d" },
+    { "get medium", "get session:%08d:profile:%d" },
+    { "set short",  "set u:%d 0 0 %d" },
+    { "set medium", "set app:cache:v2:user:%d:settings 3735928559 86400 %d" },
+};
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The tokenizer as it was, on a NUL-terminated line. */
+static size_t reference_tokenize(char *command, token_t *tokens, const size_t max_tokens) {
+    char *s, *e;
+    size_t ntokens = 0;
+    size_t len = strlen(command);
+    unsigned int i = 0;
+
+    s = e = command;
+    for (i = 0; i < len; i++) {
+        if (*e == ' ') {
+            if (s != e) {
+                tokens[ntokens].value = s;
+                tokens[ntokens].length = e - s;
+                ntokens++;
+                *e = '\0';
+                if (ntokens == max_tokens - 1) {
+                    e++;
+                    s = e; /* so we don't add an extra token */
+                    break;
+                }
+            }
+            s = e + 1;
+        }
+        e++;
+    }
+
+    if (s != e) {
+        tokens[ntokens].value = s;
+        tokens[ntokens].length = e - s;
+        ntokens++;
+    }
+
+    tokens[ntokens].value =  *e == '\0' ? NULL : e;
+    tokens[ntokens].length = 0;
+    ntokens++;
+
+    return ntokens;
+}
+
+/* True if both tokenizations cut their copy of a line at the same offsets. */
+static bool same_tokens(const char *a, const token_t *ta, size_t na,
+                        const char *b, const token_t *tb, size_t nb) {
+    size_t i;
+
+    if (na != nb)
+        return false;
+    for (i = 0; i < na; i++) {
+        if (ta[i].length != tb[i].length ||
+            (ta[i].value == NULL) != (tb[i].value == NULL) ||
+            (ta[i].value != NULL && ta[i].value - a != tb[i].value - b))
+            return false;
+    }
+    return true;
+}
+
+static void usage(void) {
+    printf("tokenize_bench\n"
+           "-n <num>      lines per shape (default: 4096)\n"
+           "-r <num>      rounds over the lines (default: 200)\n");
+}
+
+int main(int argc, char **argv) {
+    size_t nlines = 4096;
+    int rounds = 200;
+    char *lines, *work;
+    size_t *lens;
+    size_t shape, i;
+    int c, r;
+
+    while (-1 != (c = getopt(argc, argv, "n:r:h"))) {
+        switch (c) {
+        case 'n':
+            nlines = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (nlines == 0 || rounds <= 0) {
+        usage();
+        return 1;
+    }
+
+    lines = malloc(nlines * LINE_MAX_BYTES);
+    lens = malloc(nlines * sizeof(size_t));
+    work = malloc(LINE_MAX_BYTES + TOKENIZE_PADDING);
+    if (lines == NULL || lens == NULL || work == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    printf("%-12s %10s %10s %10s\n", "line", "copy ns", "old ns", "new ns");
+    for (shape = 0; shape < sizeof(line_shapes) / sizeof(line_shapes[0]); shape++) {
+        token_t tokens[MAX_TOKENS], ref[MAX_TOKENS];
+        uint64_t start, copy_ns, old_ns, new_ns;
+        size_t n, nref;
+        volatile size_t sink = 0;
+
+        for (i = 0; i < nlines; i++) {
+            char *line = lines + i * LINE_MAX_BYTES;
+            int k = rand();
+
+            lens[i] = snprintf(line, LINE_MAX_BYTES, line_shapes[shape].fmt, k, k % 4096);
+            memcpy(work, line, lens[i] + 1);
+            nref = reference_tokenize(work, ref, MAX_TOKENS);
+            n = tokenize_command(line, lens[i], tokens, MAX_TOKENS);
+            if (!same_tokens(work, ref, nref, line, tokens, n)) {
+                fprintf(stderr, "tokens differ on \"%s\"\n", line);
+                return 1;
+            }
+        }
+
+        start = now_nsec();
+        for (r = 0; r < rounds; r++) {
+            for (i = 0; i < nlines; i++) {
+                memcpy(work, lines + i * LINE_MAX_BYTES, lens[i] + 1);
+                sink += work[0];
+            }
+        }
+        copy_ns = now_nsec() - start;
+
+        start = now_nsec();
+        for (r = 0; r < rounds; r++) {
+            for (i = 0; i < nlines; i++) {
+                memcpy(work, lines + i * LINE_MAX_BYTES, lens[i] + 1);
+                sink += reference_tokenize(work, tokens, MAX_TOKENS);
+            }
+        }
+        old_ns = now_nsec() - start;
+
+        start = now_nsec();
+        for (r = 0; r < rounds; r++) {
+            for (i = 0; i < nlines; i++) {
+                memcpy(work, lines + i * LINE_MAX_BYTES, lens[i] + 1);
+                sink += tokenize_command(work, lens[i], tokens, MAX_TOKENS);
+            }
+        }
+        new_ns = now_nsec() - start;
+
+        printf("%-12s %10.2f %10.2f %10.2f\n", line_shapes[shape].name,
+               (double)copy_ns / (nlines * rounds),
+               (double)old_ns / (nlines * rounds),
+               (double)new_ns / (nlines * rounds));
+    }
+
+    free(work);
+    free(lens);
+    free(lines);
+    return 0;
+}
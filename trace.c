@@ -0,0 +1,210 @@
+/*
+ * Command trace capture, see trace.h.
+ *
+ * Each thread appends to a buffer of its own and writes it out whole when
+ * it fills up, so a traced command costs a key hash and an uncontended
+ * lock, and the file sees one write() per TRACE_BUFFER_RECORDS records. The
+ * lock only matters to trace_stop(), which empties every buffer.
+ *
+ * Lock order: trace_lock, then a buffer's lock, then file_lock.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "trace.h"
+#include "hash.h"
+#include "latency.h"
+
+/* 32KB per thread. */
+#define TRACE_BUFFER_RECORDS 1024
+
+typedef struct trace_buffer {
+    struct trace_buffer *next;
+    pthread_mutex_t lock;
+    int n;
+    trace_record_t records[TRACE_BUFFER_RECORDS];
+} trace_buffer_t;
+
+volatile bool trace_active = false;
+
+/* Serializes trace_start() and trace_stop(), guards the buffer list. */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t *trace_buffers = NULL;
+static __thread trace_buffer_t *trace_buffer = NULL;
+
+/* Set before trace_active goes up, constant while it is. */
+static uint32_t trace_sample = 1;
+static uint64_t trace_start_ticks;
+
+/* The file and what went into it. */
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static uint64_t trace_records = 0;
+static uint64_t trace_dropped = 0;
+
+static trace_buffer_t *trace_buffer_register(void) {
+    trace_buffer_t *b = calloc(1, sizeof(trace_buffer_t));
+
+    if (b == NULL)
+        return NULL;
+    pthread_mutex_init(&b->lock, NULL);
+
+    pthread_mutex_lock(&trace_lock);
+    b->next = trace_buffers;
+    trace_buffers = b;
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_buffer = b;
+    return b;
+}
+
+/* Caller holds b->lock. */
+static void trace_buffer_flush(trace_buffer_t *b) {
+    const char *p = (const char *)b->records;
+    size_t left = b->n * sizeof(trace_record_t), lost;
+    ssize_t n;
+
+    if (b->n == 0)
+        return;
+    pthread_mutex_lock(&file_lock);
+    while (left > 0 && trace_fd != -1) {
+        n = write(trace_fd, p, left);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        left -= n;
+    }
+    /* A record cut short by an error counts as lost. */
+    lost = (left + sizeof(trace_record_t) - 1) / sizeof(trace_record_t);
+    trace_dropped += lost;
+    trace_records += b->n - lost;
+    pthread_mutex_unlock(&file_lock);
+    b->n = 0;
+}
+
+void trace_log(const enum trace_op op, const char *key, const size_t nkey,
+               const uint32_t nbytes, const int32_t exptime, const bool hit) {
+    uint64_t hv = xxh64(key, nkey);
+    trace_buffer_t *b;
+    trace_record_t *r;
+
+    if (hv % trace_sample != 0)
+        return;
+    if ((b = trace_buffer) == NULL && (b = trace_buffer_register()) == NULL)
+        return;
+
+    pthread_mutex_lock(&b->lock);
+    /* trace_stop() may have emptied this buffer for the last time. */
+    if (trace_active) {
+        r = &b->records[b->n++];
+        r->time_ns = latency_ns(latency_ticks() - trace_start_ticks);
+        r->key = hv;
+        r->nbytes = nbytes;
+        r->exptime = exptime;
+        r->op = op;
+        r->nkey = nkey;
+        r->hit = hit;
+        memset(r->reserved, 0, sizeof(r->reserved));
+        if (b->n == TRACE_BUFFER_RECORDS)
+            trace_buffer_flush(b);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+int trace_start(const char *path, const uint32_t sample) {
+    trace_header_t header;
+    int fd;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_active) {
+        pthread_mutex_unlock(&trace_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.sample = sample > 0 ? sample : 1;
+    header.start_time = time(NULL);
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+        close(fd);
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    pthread_mutex_lock(&file_lock);
+    trace_fd = fd;
+    trace_records = 0;
+    trace_dropped = 0;
+    pthread_mutex_unlock(&file_lock);
+    trace_sample = header.sample;
+    trace_start_ticks = latency_ticks();
+    __atomic_store_n(&trace_active, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+void trace_stop(void) {
+    trace_buffer_t *b;
+
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_active) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    __atomic_store_n(&trace_active, false, __ATOMIC_RELEASE);
+    for (b = trace_buffers; b != NULL; b = b->next) {
+        pthread_mutex_lock(&b->lock);
+        trace_buffer_flush(b);
+        pthread_mutex_unlock(&b->lock);
+    }
+    pthread_mutex_lock(&file_lock);
+    close(trace_fd);
+    trace_fd = -1;
+    pthread_mutex_unlock(&file_lock);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_get_stats(uint64_t *records, uint64_t *dropped) {
+    pthread_mutex_lock(&file_lock);
+    *records = trace_records;
+    *dropped = trace_dropped;
+    pthread_mutex_unlock(&file_lock);
+}
+
+FILE *trace_open(const char *path, trace_header_t *header) {
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fread(header, sizeof(*header), 1, f) != 1 ||
+        memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        fclose(f);
+        return NULL;
+    }
+    if (header->version != TRACE_VERSION) {
+        fprintf(stderr, "%s: trace version %u, expected %u\n", path,
+                header->version, TRACE_VERSION);
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
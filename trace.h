@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Command traces, for replaying real traffic offline with replay.c.
+ *
+ * While a capture runs, gets (one record per key), sets and deletes are
+ * written to a file as fixed-size binary records. Keys are kept only as
+ * 64-bit hashes. Sampling is by key: a key is either traced on every
+ * access or never, so a sampled trace keeps each key's full reuse pattern,
+ * and a cache 1/sample the size replays it with about the same hit ratio.
+ *
+ * Records are buffered per thread and written a buffer at a time. Within
+ * a buffer they are in time order; buffers of different threads follow
+ * each other in the order they filled up.
+ */
+
+#define TRACE_MAGIC "SMCTRACE"
+#define TRACE_VERSION 1
+
+enum trace_op {
+    TRACE_GET = 1,
+    TRACE_SET,
+    TRACE_DELETE
+};
+
+/* Start of the file. Fields are in host byte order. */
+typedef struct {
+    char magic[8];          /* TRACE_MAGIC, without the NUL */
+    uint32_t version;
+    uint32_t sample;        /* one key in sample was traced */
+    uint64_t start_time;    /* when the capture started, Unix seconds */
+} trace_header_t;
+
+typedef struct {
+    uint64_t time_ns;       /* since the capture started */
+    uint64_t key;           /* xxh64() of the key */
+    uint32_t nbytes;        /* value length of a set, without \r\n */
+    int32_t exptime;        /* exptime of a set, as the client sent it */
+    uint8_t op;             /* enum trace_op */
+    uint8_t nkey;
+    uint8_t hit;            /* get or delete found the key, set was stored */
+    uint8_t reserved[5];
+} trace_record_t;
+
+extern volatile bool trace_active;
+
+// Start writing sampled commands to a new file at path; 0, or -1 with
+// errno set (EBUSY if a capture is already running)
+int trace_start(const char *path, const uint32_t sample);
+
+// Write out every thread's buffer and close the file
+void trace_stop(void);
+
+// Records captured and lost to write errors since the last trace_start()
+void trace_get_stats(uint64_t *records, uint64_t *dropped);
+
+void trace_log(const enum trace_op op, const char *key, const size_t nkey,
+               const uint32_t nbytes, const int32_t exptime, const bool hit);
+
+/* Costs a predictable branch while no capture runs. */
+static inline void trace_command(const enum trace_op op, const char *key,
+                                 const size_t nkey, const uint32_t nbytes,
+                                 const int32_t exptime, const bool hit) {
+    if (__builtin_expect(trace_active, 0))
+        trace_log(op, key, nkey, nbytes, exptime, hit);
+}
+
+// Open a trace for reading and check its header; NULL with a message on
+// stderr if it isn't one
+FILE *trace_open(const char *path, trace_header_t *header);
+
+#endif